@@ -0,0 +1,521 @@
+#define _XOPEN_SOURCE 700
+#include <fcntl.h>
+#include <ftw.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "arena.h"
+#include "header.h"
+#include "maildir.h"
+#include "mblaze.h"
+#include "scheduler.h"
+#include "thread.h"
+
+
+#define DEFAULT_MESSAGE_COUNT 100
+#define DEFAULT_MESSAGE_LIMIT (1024 * 1024)
+// messages were listed by this pipeline before they were threaded in-process
+#define PIPELINE_COMMAND                                                      \
+    "mlist \"$1\" | mthread -r | mscan -f '%i\n%R\n%u\n%s\n%f\n%D'"
+
+
+typedef struct {
+    GMainLoop *loop;
+    gint64 start;
+    gint64 first;
+    gint64 end;
+    gsize pending;
+} bench_t;
+
+typedef struct {
+    GPtrArray *paths;
+    const gchar *directory;
+    guint limit;
+} list_data_t;
+
+// message record, as it was allocated before message arenas
+typedef struct legacy_message_t {
+    GString *path;
+    mbgui_message_status_t status;
+    GString *subject;
+    GString *sender;
+    GString *date;
+    struct legacy_message_t *children;
+    struct legacy_message_t *next;
+} legacy_message_t;
+
+typedef void (*run_cb_t)(bench_t *bench, gchar *maildir);
+
+typedef struct {
+    const gchar *name;
+    run_cb_t run;
+} api_t;
+
+
+static gchar *api_name = NULL;
+static gchar *run_name = NULL;
+static gboolean cold = FALSE;
+static gboolean records = FALSE;
+static gint message_count = DEFAULT_MESSAGE_COUNT;
+static gint message_limit = DEFAULT_MESSAGE_LIMIT;
+static gint jobs = 0;
+
+
+static void on_result(bench_t *bench) {
+    if (!bench->first)
+        bench->first = g_get_monotonic_time();
+}
+
+
+static void on_done(bench_t *bench) {
+    bench->pending -= 1;
+    if (bench->pending)
+        return;
+
+    bench->end = g_get_monotonic_time();
+    g_main_loop_quit(bench->loop);
+}
+
+
+static void on_get_directories(mbgui_directory_t *directories, gboolean done,
+                               gpointer user_data) {
+    on_result(user_data);
+    if (done)
+        on_done(user_data);
+}
+
+
+static void on_get_messages(gchar *directory, mbgui_message_arena_t *arena,
+                            mbgui_message_t *messages, gboolean done,
+                            gpointer user_data) {
+    on_result(user_data);
+    if (done)
+        on_done(user_data);
+}
+
+
+static void on_get_message(gchar *path, gchar *chunk, gboolean done,
+                           gsize rest, gpointer user_data) {
+    on_result(user_data);
+    if (done)
+        on_done(user_data);
+}
+
+
+static void on_pipeline_done(GObject *source, GAsyncResult *result,
+                             gpointer user_data) {
+    GError *error = NULL;
+    if (!g_subprocess_communicate_finish(G_SUBPROCESS(source), result, NULL,
+                                         NULL, &error)) {
+        g_printerr("can not run pipeline: %s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_object_unref(source);
+    on_result(user_data);
+    on_done(user_data);
+}
+
+
+static void on_list_entry(const gchar *subdirectory, const gchar *name,
+                          gpointer user_data) {
+    list_data_t *data = user_data;
+
+    if (data->paths->len >= data->limit)
+        return;
+
+    g_ptr_array_add(data->paths, g_build_filename(data->directory,
+                                                  subdirectory, name, NULL));
+}
+
+
+static void run_directories(bench_t *bench, gchar *maildir) {
+    gchar *argv[] = {maildir, NULL};
+
+    bench->pending = 1;
+    bench->start = g_get_monotonic_time();
+    mbgui_get_directories(argv, NULL, on_get_directories, bench);
+}
+
+
+static void run_messages(bench_t *bench, gchar *maildir) {
+    gchar *argv[] = {maildir, NULL};
+    GPtrArray *directories = mbgui_maildir_find(argv, NULL);
+
+    bench->pending = directories->len;
+    bench->start = g_get_monotonic_time();
+    for (guint i = 0; i < directories->len; ++i)
+        mbgui_get_messages(g_ptr_array_index(directories, i), NULL,
+                           on_get_messages, bench);
+
+    g_ptr_array_free(directories, TRUE);
+}
+
+
+// baseline for messages - output is read, but not parsed
+static void run_pipeline(bench_t *bench, gchar *maildir) {
+    gchar *argv[] = {maildir, NULL};
+    GPtrArray *directories = mbgui_maildir_find(argv, NULL);
+
+    bench->pending = 0;
+    bench->start = g_get_monotonic_time();
+    for (guint i = 0; i < directories->len; ++i) {
+        GError *error = NULL;
+        GSubprocess *process = g_subprocess_new(
+            G_SUBPROCESS_FLAGS_STDOUT_PIPE, &error, "sh", "-c",
+            PIPELINE_COMMAND, "sh", g_ptr_array_index(directories, i), NULL);
+        if (!process) {
+            g_printerr("can not run pipeline: %s\n", error->message);
+            g_error_free(error);
+            continue;
+        }
+
+        bench->pending += 1;
+        g_subprocess_communicate_async(process, NULL, NULL, on_pipeline_done,
+                                       bench);
+    }
+
+    g_ptr_array_free(directories, TRUE);
+}
+
+
+// previews first `message_count` messages, in the same way as they would be
+// requested by clicking through messages list
+static void run_message(bench_t *bench, gchar *maildir) {
+    gchar *argv[] = {maildir, NULL};
+    GPtrArray *directories = mbgui_maildir_find(argv, NULL);
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    list_data_t data = {paths, NULL, message_count};
+
+    for (guint i = 0; i < directories->len; ++i) {
+        data.directory = g_ptr_array_index(directories, i);
+        mbgui_maildir_list(data.directory, on_list_entry, &data);
+    }
+
+    bench->pending = paths->len;
+    bench->start = g_get_monotonic_time();
+    for (guint i = 0; i < paths->len; ++i)
+        mbgui_get_message(g_ptr_array_index(paths, i), 0, message_limit, NULL,
+                          on_get_message, bench);
+
+    g_ptr_array_free(paths, TRUE);
+    g_ptr_array_free(directories, TRUE);
+}
+
+
+static const api_t apis[] = {{"directories", run_directories},
+                             {"messages", run_messages},
+                             {"pipeline", run_pipeline},
+                             {"message", run_message}};
+
+
+// allocations made by main thread, which are still in use
+static gsize get_heap_size(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+
+static GString *format_date(gint64 date) {
+    GDateTime *time = (date ? g_date_time_new_from_unix_local(date) : NULL);
+    gchar *str = (time ? g_date_time_format(time, "%Y-%m-%d %H:%M") : NULL);
+    GString *result = g_string_new(str ? str : "");
+    g_free(str);
+    if (time)
+        g_date_time_unref(time);
+    return result;
+}
+
+
+// headers are read before measurement, so only records are measured
+static gsize measure_legacy_records(GPtrArray *paths) {
+    mbgui_header_t *headers = g_new0(mbgui_header_t, paths->len);
+    mbgui_header_read_all((gchar **)paths->pdata, paths->len, headers, NULL);
+
+    gsize begin = get_heap_size();
+    legacy_message_t *messages = NULL;
+    for (guint i = 0; i < paths->len; ++i) {
+        if (!headers[i].valid)
+            continue;
+
+        legacy_message_t *message = g_malloc(sizeof(legacy_message_t));
+        message->path = g_string_new(g_ptr_array_index(paths, i));
+        message->status =
+            mbgui_maildir_get_status(g_ptr_array_index(paths, i));
+        message->subject =
+            g_string_new(headers[i].subject ? headers[i].subject : "");
+        message->sender =
+            g_string_new(headers[i].sender ? headers[i].sender : "");
+        message->date = format_date(headers[i].date);
+        message->children = NULL;
+        message->next = messages;
+        messages = message;
+    }
+    gsize result = get_heap_size() - begin;
+
+    while (messages) {
+        legacy_message_t *next = messages->next;
+        g_string_free(messages->path, TRUE);
+        g_string_free(messages->subject, TRUE);
+        g_string_free(messages->sender, TRUE);
+        g_string_free(messages->date, TRUE);
+        g_free(messages);
+        messages = next;
+    }
+
+    for (guint i = 0; i < paths->len; ++i)
+        mbgui_header_clear(headers + i);
+    g_free(headers);
+    return result;
+}
+
+
+// records are built in the same way as new messages of threaded list -
+// headers are read by worker threads and freed before scan returns
+static gsize measure_arena_records(GPtrArray *paths) {
+    g_ptr_array_add(paths, NULL);
+
+    gsize begin = get_heap_size();
+    mbgui_message_arena_t *arena = mbgui_message_arena_new();
+    mbgui_thread_scan((gchar **)paths->pdata, arena, NULL);
+    gsize result = get_heap_size() - begin;
+
+    mbgui_message_arena_unref(arena);
+    g_ptr_array_remove_index(paths, paths->len - 1);
+    return result;
+}
+
+
+// per-message memory of message records, before and after message arenas,
+// built from headers of all messages in `maildir`
+static gint run_records(gchar *maildir) {
+    gchar *argv[] = {maildir, NULL};
+    GPtrArray *directories = mbgui_maildir_find(argv, NULL);
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    list_data_t data = {paths, NULL, G_MAXUINT};
+
+    for (guint i = 0; i < directories->len; ++i) {
+        data.directory = g_ptr_array_index(directories, i);
+        mbgui_maildir_list(data.directory, on_list_entry, &data);
+    }
+
+    if (!paths->len) {
+        g_printerr("no messages found\n");
+        g_ptr_array_free(paths, TRUE);
+        g_ptr_array_free(directories, TRUE);
+        return 1;
+    }
+
+    gsize legacy = measure_legacy_records(paths);
+    gsize arena = measure_arena_records(paths);
+
+    g_print("%-12s %10s %12s %12s %14s\n", "records", "messages",
+            "record_bytes", "heap_bytes", "bytes_per_msg");
+    g_print("%-12s %10u %12lu %12lu %14.1f\n", "legacy", paths->len,
+            sizeof(legacy_message_t), legacy, (gdouble)legacy / paths->len);
+    g_print("%-12s %10u %12lu %12lu %14.1f\n", "arena", paths->len,
+            sizeof(mbgui_message_t), arena, (gdouble)arena / paths->len);
+
+    g_ptr_array_free(paths, TRUE);
+    g_ptr_array_free(directories, TRUE);
+    return 0;
+}
+
+
+static gint on_evict_entry(const char *path, const struct stat *st, int flag,
+                           struct FTW *ftw) {
+    if (flag != FTW_F)
+        return 0;
+
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    return 0;
+}
+
+
+// dropping all caches requires root - otherwise only pages of Maildir files
+// are evicted
+static void evict_page_cache(const gchar *maildir) {
+    sync();
+
+    FILE *drop_caches = fopen("/proc/sys/vm/drop_caches", "w");
+    if (drop_caches) {
+        gboolean dropped = (fputs("3", drop_caches) >= 0);
+        dropped = (fclose(drop_caches) == 0) && dropped;
+        if (dropped)
+            return;
+    }
+
+    nftw(maildir, on_evict_entry, 64, FTW_PHYS);
+}
+
+
+static gint on_remove_entry(const char *path, const struct stat *st, int flag,
+                            struct FTW *ftw) {
+    g_remove(path);
+    return 0;
+}
+
+
+static gint run(const api_t *api, gchar *maildir) {
+    bench_t bench = {g_main_loop_new(NULL, FALSE), 0, 0, 0, 0};
+
+    api->run(&bench, maildir);
+    if (bench.pending)
+        g_main_loop_run(bench.loop);
+    else
+        bench.first = bench.end = bench.start;
+
+    // caches written by cold run are used by warm run
+    mbgui_save_directories();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    g_print("%-12s %-5s %10.1f %10.1f %12ld %10lu\n", api->name,
+            (cold ? "cold" : "warm"), (bench.first - bench.start) / 1000.0,
+            (bench.end - bench.start) / 1000.0, usage.ru_maxrss,
+            mbgui_get_process_count());
+
+    g_main_loop_unref(bench.loop);
+    return 0;
+}
+
+
+// each measurement runs in separate process, so peak RSS and in-memory
+// caches are not shared between measurements
+static gboolean spawn_run(const gchar *program, const api_t *api,
+                          gchar *maildir, const gchar *cache_dir,
+                          gboolean cold_run) {
+    GPtrArray *argv = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(argv, g_strdup(program));
+    g_ptr_array_add(argv, g_strdup("--run"));
+    g_ptr_array_add(argv, g_strdup(api->name));
+    g_ptr_array_add(argv, g_strdup_printf("--count=%d", message_count));
+    g_ptr_array_add(argv, g_strdup_printf("--limit=%d", message_limit));
+    g_ptr_array_add(argv, g_strdup_printf("--jobs=%d", jobs));
+    if (cold_run)
+        g_ptr_array_add(argv, g_strdup("--cold"));
+    g_ptr_array_add(argv, g_strdup(maildir));
+    g_ptr_array_add(argv, NULL);
+
+    gchar **envp = g_environ_setenv(g_get_environ(), "XDG_CACHE_HOME",
+                                    cache_dir, TRUE);
+
+    if (cold_run)
+        evict_page_cache(maildir);
+
+    GError *error = NULL;
+    gboolean result =
+        g_spawn_sync(NULL, (gchar **)argv->pdata, envp, 0, NULL, NULL, NULL,
+                     NULL, NULL, &error);
+    if (!result) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_strfreev(envp);
+    g_ptr_array_free(argv, TRUE);
+    return result;
+}
+
+
+int main(int argc, char **argv) {
+    GOptionEntry entries[] = {
+        {"api", 'a', 0, G_OPTION_ARG_STRING, &api_name,
+         "Benchmarked API: directories, messages, pipeline or message (all)",
+         "NAME"},
+        {"count", 'c', 0, G_OPTION_ARG_INT, &message_count,
+         "Number of previewed messages (100)", "N"},
+        {"limit", 'l', 0, G_OPTION_ARG_INT, &message_limit,
+         "Preview limit in bytes (1048576)", "N"},
+        {"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+         "Maximum number of concurrent jobs (number of processors)", "N"},
+        {"records", 'r', 0, G_OPTION_ARG_NONE, &records,
+         "Report per-message memory of message records instead", NULL},
+        {"run", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &run_name, NULL,
+         NULL},
+        {"cold", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &cold, NULL,
+         NULL},
+        {NULL}};
+
+    GOptionContext *context =
+        g_option_context_new("MAILDIR - benchmark mbgui Maildir access");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 2) {
+        g_printerr("missing MAILDIR argument\n");
+        return 1;
+    }
+
+    if (jobs > 0)
+        mbgui_scheduler_set_max_jobs(jobs);
+
+    if (records)
+        return run_records(argv[1]);
+
+    for (gsize i = 0; i < G_N_ELEMENTS(apis); ++i) {
+        if (!g_strcmp0(run_name, apis[i].name))
+            return run(apis + i, argv[1]);
+    }
+
+    const gchar *name = (run_name ? run_name : api_name);
+    gboolean known = !name;
+    for (gsize i = 0; !known && i < G_N_ELEMENTS(apis); ++i)
+        known = !g_strcmp0(name, apis[i].name);
+    if (!known || run_name) {
+        g_printerr("unknown API %s\n", name);
+        return 1;
+    }
+
+    gchar *program = g_file_read_link("/proc/self/exe", &error);
+    if (!program) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        return 1;
+    }
+
+    // cold run starts with empty mbgui cache, which is reused by warm run
+    gchar *cache_dir = g_dir_make_tmp("mbgui-bench-XXXXXX", &error);
+    if (!cache_dir) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_free(program);
+        return 1;
+    }
+
+    g_print("%-12s %-5s %10s %10s %12s %10s\n", "api", "cache", "first_ms",
+            "total_ms", "peak_rss_kib", "processes");
+
+    gboolean success = TRUE;
+    for (gsize i = 0; success && i < G_N_ELEMENTS(apis); ++i) {
+        if (api_name && g_strcmp0(api_name, apis[i].name))
+            continue;
+
+        gchar *api_cache_dir = g_build_filename(cache_dir, apis[i].name, NULL);
+        success =
+            spawn_run(program, apis + i, argv[1], api_cache_dir, TRUE) &&
+            spawn_run(program, apis + i, argv[1], api_cache_dir, FALSE);
+        g_free(api_cache_dir);
+    }
+
+    nftw(cache_dir, on_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    g_free(cache_dir);
+    g_free(program);
+    return (success ? 0 : 1);
+}
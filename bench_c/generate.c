@@ -0,0 +1,193 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+
+#define BASE_DATE 1640995200
+#define LINE_SIZE 72
+
+
+typedef struct {
+    gint folders;
+    gint messages;
+    gint depth;
+    gint unseen;
+    gint flagged;
+    gint trashed;
+    gint size;
+    gint seed;
+} options_t;
+
+
+static gchar *get_flags(options_t *options, GRand *rand) {
+    GString *flags = g_string_new(NULL);
+
+    if (g_rand_int_range(rand, 0, 100) < options->flagged)
+        g_string_append_c(flags, 'F');
+    if (g_rand_int_range(rand, 0, 100) >= options->unseen)
+        g_string_append_c(flags, 'S');
+    if (g_rand_int_range(rand, 0, 100) < options->trashed)
+        g_string_append_c(flags, 'T');
+
+    return g_string_free(flags, FALSE);
+}
+
+
+static void append_body(GString *message, gint size, GRand *rand) {
+    static const gchar *words[] = {"lorem", "ipsum", "dolor", "sit",
+                                   "amet",  "mail",  "dir",   "thread",
+                                   "reply", "flag",  "bench", "message"};
+
+    gsize end = message->len + size;
+    gsize line_start = message->len;
+
+    while (message->len < end) {
+        if (message->len - line_start > LINE_SIZE) {
+            g_string_append_c(message, '\n');
+            line_start = message->len;
+            continue;
+        }
+
+        g_string_append(message,
+                        words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))]);
+        g_string_append_c(message, ' ');
+    }
+
+    g_string_append_c(message, '\n');
+}
+
+
+// messages are grouped into threads of `depth` messages, where each message
+// replies to previous message of its thread
+static void create_message(options_t *options, const gchar *folder,
+                           gint folder_index, gint index, GRand *rand) {
+    gint thread = index / options->depth;
+    gint thread_index = index % options->depth;
+
+    GString *message = g_string_new(NULL);
+    g_string_append_printf(message, "Message-ID: <%d.%d@mbgui.bench>\n", index,
+                           folder_index);
+
+    if (thread_index) {
+        g_string_append(message, "References:");
+        for (gint i = index - thread_index; i < index; ++i)
+            g_string_append_printf(message, " <%d.%d@mbgui.bench>", i,
+                                   folder_index);
+        g_string_append_printf(message,
+                               "\nIn-Reply-To: <%d.%d@mbgui.bench>\n",
+                               index - 1, folder_index);
+    }
+
+    GDateTime *date = g_date_time_new_from_unix_utc(
+        BASE_DATE + (gint64)(folder_index * options->messages + index) * 60);
+    gchar *date_str = g_date_time_format(date, "%a, %d %b %Y %H:%M:%S +0000");
+    g_date_time_unref(date);
+
+    g_string_append_printf(message,
+                           "From: Sender %d <sender%d@mbgui.bench>\n"
+                           "To: Bench <bench@mbgui.bench>\n"
+                           "Subject: %sThread %d\n"
+                           "Date: %s\n"
+                           "\n",
+                           g_rand_int_range(rand, 0, 100),
+                           g_rand_int_range(rand, 0, 100),
+                           (thread_index ? "Re: " : ""), thread, date_str);
+    g_free(date_str);
+
+    append_body(message, options->size, rand);
+
+    gchar *flags = get_flags(options, rand);
+    gchar *name = g_strdup_printf("%d.%d_%d.mbgui:2,%s", BASE_DATE + index,
+                                  folder_index, index, flags);
+    gchar *path = g_build_filename(folder, "cur", name, NULL);
+
+    GError *error = NULL;
+    if (!g_file_set_contents(path, message->str, message->len, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+    }
+
+    g_free(path);
+    g_free(name);
+    g_free(flags);
+    g_string_free(message, TRUE);
+}
+
+
+static gboolean create_folder(options_t *options, const gchar *root,
+                              gint folder_index, GRand *rand) {
+    gchar *name = g_strdup_printf("folder%04d", folder_index);
+    gchar *folder = g_build_filename(root, name, NULL);
+    g_free(name);
+
+    const gchar *subdirectories[] = {"cur", "new", "tmp"};
+    for (gsize i = 0; i < G_N_ELEMENTS(subdirectories); ++i) {
+        gchar *path = g_build_filename(folder, subdirectories[i], NULL);
+        gint result = g_mkdir_with_parents(path, 0700);
+        g_free(path);
+
+        if (result) {
+            g_printerr("can not create %s\n", folder);
+            g_free(folder);
+            return FALSE;
+        }
+    }
+
+    for (gint i = 0; i < options->messages; ++i)
+        create_message(options, folder, folder_index, i, rand);
+
+    g_free(folder);
+    return TRUE;
+}
+
+
+int main(int argc, char **argv) {
+    options_t options = {10, 1000, 5, 20, 5, 1, 2048, 1};
+
+    GOptionEntry entries[] = {
+        {"folders", 'f', 0, G_OPTION_ARG_INT, &(options.folders),
+         "Number of folders (10)", "N"},
+        {"messages", 'm', 0, G_OPTION_ARG_INT, &(options.messages),
+         "Number of messages per folder (1000)", "N"},
+        {"depth", 'd', 0, G_OPTION_ARG_INT, &(options.depth),
+         "Number of messages per thread (5)", "N"},
+        {"unseen", 'u', 0, G_OPTION_ARG_INT, &(options.unseen),
+         "Percentage of unseen messages (20)", "P"},
+        {"flagged", 'F', 0, G_OPTION_ARG_INT, &(options.flagged),
+         "Percentage of flagged messages (5)", "P"},
+        {"trashed", 't', 0, G_OPTION_ARG_INT, &(options.trashed),
+         "Percentage of trashed messages (1)", "P"},
+        {"size", 's', 0, G_OPTION_ARG_INT, &(options.size),
+         "Approximate message body size in bytes (2048)", "N"},
+        {"seed", 0, 0, G_OPTION_ARG_INT, &(options.seed),
+         "Random seed (1)", "N"},
+        {NULL}};
+
+    GOptionContext *context =
+        g_option_context_new("DIRECTORY - generate synthetic Maildir tree");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    GError *error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (argc != 2) {
+        g_printerr("missing DIRECTORY argument\n");
+        return 1;
+    }
+
+    options.depth = MAX(options.depth, 1);
+    options.size = MAX(options.size, 0);
+
+    GRand *rand = g_rand_new_with_seed(options.seed);
+    gboolean success = TRUE;
+    for (gint i = 0; success && i < options.folders; ++i)
+        success = create_folder(&options, argv[1], i, rand);
+    g_rand_free(rand);
+
+    return (success ? 0 : 1);
+}
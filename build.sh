@@ -9,3 +9,11 @@ CC=${CC:-cc}
 
 mkdir -p build
 $CC -o build/mbgui src_c/*.c $(pkg-config --cflags --libs $LIBS)
+
+if [ "$1" = "bench" ]; then
+    $CC -o build/mbgui-generate bench_c/generate.c \
+        $(pkg-config --cflags --libs glib-2.0)
+    $CC -o build/mbgui-bench -Isrc_c bench_c/bench.c \
+        $(ls src_c/*.c | grep -v 'src_c/main.c') \
+        $(pkg-config --cflags --libs $LIBS)
+fi
@@ -4,4 +4,4 @@ set -e
 
 cd $(dirname -- "$0")
 
-clang-format -style=file -i src_c/*.c src_c/*.h
+clang-format -style=file -i src_c/*.c src_c/*.h bench_c/*.c
@@ -0,0 +1,100 @@
+#include <string.h>
+#include "arena.h"
+
+
+#define ARENA_BLOCK_SIZE 1024
+
+
+struct mbgui_message_arena_t {
+    gatomicrefcount rc;
+    GStringChunk *strings;
+    GSList *blocks;
+    gsize block_used;
+    GSList *files;
+};
+
+
+mbgui_message_arena_t *mbgui_message_arena_new(void) {
+    mbgui_message_arena_t *arena = g_malloc(sizeof(mbgui_message_arena_t));
+    g_atomic_ref_count_init(&(arena->rc));
+    arena->strings = g_string_chunk_new(64 * 1024);
+    arena->blocks = NULL;
+    arena->block_used = ARENA_BLOCK_SIZE;
+    arena->files = NULL;
+    return arena;
+}
+
+
+mbgui_message_arena_t *mbgui_message_arena_ref(mbgui_message_arena_t *arena) {
+    g_atomic_ref_count_inc(&(arena->rc));
+    return arena;
+}
+
+
+void mbgui_message_arena_unref(mbgui_message_arena_t *arena) {
+    if (!g_atomic_ref_count_dec(&(arena->rc)))
+        return;
+
+    g_string_chunk_free(arena->strings);
+    g_slist_free_full(arena->blocks, g_free);
+    g_slist_free_full(arena->files, (GDestroyNotify)g_mapped_file_unref);
+    g_free(arena);
+}
+
+
+mbgui_message_t *mbgui_message_arena_alloc(mbgui_message_arena_t *arena) {
+    if (arena->block_used >= ARENA_BLOCK_SIZE) {
+        arena->blocks = g_slist_prepend(
+            arena->blocks, g_malloc(ARENA_BLOCK_SIZE * sizeof(mbgui_message_t)));
+        arena->block_used = 0;
+    }
+
+    mbgui_message_t *message =
+        (mbgui_message_t *)arena->blocks->data + arena->block_used++;
+    memset(message, 0, sizeof(mbgui_message_t));
+    return message;
+}
+
+
+const gchar *mbgui_message_arena_insert(mbgui_message_arena_t *arena,
+                                        const gchar *str) {
+    return g_string_chunk_insert(arena->strings, str);
+}
+
+
+const gchar *mbgui_message_arena_intern(mbgui_message_arena_t *arena,
+                                        const gchar *str) {
+    return g_string_chunk_insert_const(arena->strings, str);
+}
+
+
+// case folded subject and sender, matched by messages list filter
+const gchar *mbgui_message_arena_insert_key(mbgui_message_arena_t *arena,
+                                            const gchar *subject,
+                                            const gchar *sender) {
+    gchar *key = g_strconcat(subject, "\n", sender, NULL);
+    gchar *folded = g_utf8_casefold(key, -1);
+    const gchar *result = g_string_chunk_insert(arena->strings, folded);
+    g_free(folded);
+    g_free(key);
+    return result;
+}
+
+
+// case insensitive collation key, compared with strcmp - equal keys are
+// stored only once
+const gchar *mbgui_message_arena_insert_sort_key(mbgui_message_arena_t *arena,
+                                                 const gchar *str) {
+    gchar *folded = g_utf8_casefold(str, -1);
+    gchar *key = g_utf8_collate_key(folded, -1);
+    const gchar *result = g_string_chunk_insert_const(arena->strings, key);
+    g_free(key);
+    g_free(folded);
+    return result;
+}
+
+
+void mbgui_message_arena_add_file(mbgui_message_arena_t *arena,
+                                  GMappedFile *file) {
+    arena->files = g_slist_prepend(arena->files, g_mapped_file_ref(file));
+}
@@ -0,0 +1,22 @@
+#ifndef MBGUI_ARENA_H
+#define MBGUI_ARENA_H
+
+#include <glib.h>
+#include "mblaze.h"
+
+
+mbgui_message_arena_t *mbgui_message_arena_new(void);
+mbgui_message_t *mbgui_message_arena_alloc(mbgui_message_arena_t *arena);
+const gchar *mbgui_message_arena_insert(mbgui_message_arena_t *arena,
+                                        const gchar *str);
+const gchar *mbgui_message_arena_intern(mbgui_message_arena_t *arena,
+                                        const gchar *str);
+const gchar *mbgui_message_arena_insert_key(mbgui_message_arena_t *arena,
+                                            const gchar *subject,
+                                            const gchar *sender);
+const gchar *mbgui_message_arena_insert_sort_key(mbgui_message_arena_t *arena,
+                                                 const gchar *str);
+void mbgui_message_arena_add_file(mbgui_message_arena_t *arena,
+                                  GMappedFile *file);
+
+#endif
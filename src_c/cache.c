@@ -0,0 +1,664 @@
+#include <locale.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+#include "cache.h"
+#include "arena.h"
+#include "maildir.h"
+
+
+#define MESSAGES_MAGIC "MBGUIMSG"
+#define MESSAGES_VERSION 5
+#define DIRECTORIES_MAGIC "MBGUIDIR"
+#define DIRECTORIES_VERSION 1
+
+
+// cache file layout: header, `count` records, string pool (NUL terminated
+// strings referenced by record offsets)
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 count;
+    mbgui_cache_stamp_t stamp;
+    guint32 collation;
+    guint32 reserved;
+    guint64 strings_len;
+} messages_header_t;
+
+typedef struct {
+    guint32 depth;
+    guint32 status;
+    guint32 path;
+    guint32 subject;
+    guint32 sender;
+    guint32 date;
+    guint32 key;
+    guint32 subject_key;
+    guint32 sender_key;
+    guint32 message_id;
+    guint32 references;
+    guint32 reserved;
+    gint64 timestamp;
+} messages_record_t;
+
+// directories file layout: header, `count` records, string pool
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 count;
+    guint64 strings_len;
+} directories_header_t;
+
+typedef struct {
+    guint32 path;
+    guint32 counted;
+    mbgui_cache_stamp_t stamp;
+    guint64 unseen;
+    guint64 total;
+} directories_record_t;
+
+typedef struct {
+    gsize depth;
+    mbgui_message_status_t status;
+    const gchar *path;
+    const gchar *subject;
+    const gchar *sender;
+    const gchar *date;
+    const gchar *key;
+    const gchar *subject_key;
+    const gchar *sender_key;
+    gint64 timestamp;
+    const gchar *message_id;
+    const gchar *references;
+} entry_t;
+
+typedef struct {
+    const gchar *directory;
+    GHashTable *files;
+} patch_data_t;
+
+typedef struct {
+    GString *directory;
+    GBytes *bytes;
+} save_messages_data_t;
+
+struct mbgui_cache_writer_t {
+    guint32 count;
+    GByteArray *records;
+    GByteArray *strings;
+    GHashTable *offsets;
+};
+
+
+static GMutex save_mutex;
+static GCond save_cond;
+static guint save_count = 0;
+
+
+static void free_save_messages_data(save_messages_data_t *data) {
+    g_string_free(data->directory, TRUE);
+    g_bytes_unref(data->bytes);
+    g_free(data);
+}
+
+
+static gchar *get_cache_path(const gchar *kind, const gchar *key) {
+    gchar *name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+    gchar *path =
+        g_build_filename(g_get_user_cache_dir(), "mbgui", kind, name, NULL);
+    g_free(name);
+    return path;
+}
+
+
+// sort keys depend on collation locale, so cache is valid only for the same
+// locale
+static guint32 get_collation(void) {
+    const gchar *locale = setlocale(LC_COLLATE, NULL);
+    return g_str_hash(locale ? locale : "");
+}
+
+
+static guint32 add_string(mbgui_cache_writer_t *writer, const gchar *str) {
+    gpointer offset;
+    if (g_hash_table_lookup_extended(writer->offsets, str, NULL, &offset))
+        return GPOINTER_TO_UINT(offset);
+
+    guint32 result = writer->strings->len;
+    g_byte_array_append(writer->strings, (const guint8 *)str, strlen(str) + 1);
+    g_hash_table_insert(writer->offsets, g_strdup(str),
+                        GUINT_TO_POINTER(result));
+    return result;
+}
+
+
+static void add_entry(mbgui_cache_writer_t *writer, entry_t *entry) {
+    messages_record_t record = {.depth = entry->depth,
+                                .status = entry->status,
+                                .path = add_string(writer, entry->path),
+                                .subject = add_string(writer, entry->subject),
+                                .sender = add_string(writer, entry->sender),
+                                .date = add_string(writer, entry->date),
+                                .key = add_string(writer, entry->key),
+                                .subject_key =
+                                    add_string(writer, entry->subject_key),
+                                .sender_key =
+                                    add_string(writer, entry->sender_key),
+                                .message_id =
+                                    add_string(writer, entry->message_id),
+                                .references =
+                                    add_string(writer, entry->references),
+                                .reserved = 0,
+                                .timestamp = entry->timestamp};
+    g_byte_array_append(writer->records, (const guint8 *)&record,
+                        sizeof(record));
+    writer->count += 1;
+}
+
+
+static GBytes *serialize(mbgui_cache_writer_t *writer,
+                         const mbgui_cache_stamp_t *stamp) {
+    messages_header_t header = {.version = MESSAGES_VERSION,
+                                .count = writer->count,
+                                .stamp = *stamp,
+                                .collation = get_collation(),
+                                .reserved = 0,
+                                .strings_len = writer->strings->len};
+    memcpy(header.magic, MESSAGES_MAGIC, sizeof(header.magic));
+
+    GByteArray *result = g_byte_array_sized_new(
+        sizeof(header) + writer->records->len + writer->strings->len);
+    g_byte_array_append(result, (const guint8 *)&header, sizeof(header));
+    g_byte_array_append(result, writer->records->data, writer->records->len);
+    g_byte_array_append(result, writer->strings->data, writer->strings->len);
+    return g_byte_array_free_to_bytes(result);
+}
+
+
+static void write_bytes(const gchar *path, GBytes *bytes) {
+    gchar *dirname = g_path_get_dirname(path);
+
+    if (!g_mkdir_with_parents(dirname, 0700)) {
+        gsize len;
+        const gchar *contents = g_bytes_get_data(bytes, &len);
+        g_file_set_contents(path, contents, len, NULL);
+    }
+
+    g_free(dirname);
+}
+
+
+static gboolean read_entries(GMappedFile *file, mbgui_cache_stamp_t *stamp,
+                             GArray **entries) {
+    gsize len = g_mapped_file_get_length(file);
+    const gchar *contents = g_mapped_file_get_contents(file);
+
+    messages_header_t header;
+    if (len < sizeof(header))
+        return FALSE;
+    memcpy(&header, contents, sizeof(header));
+
+    if (memcmp(header.magic, MESSAGES_MAGIC, sizeof(header.magic)) ||
+        header.version != MESSAGES_VERSION ||
+        header.collation != get_collation())
+        return FALSE;
+
+    gsize records_len = (gsize)header.count * sizeof(messages_record_t);
+    if (header.strings_len > len ||
+        len != sizeof(header) + records_len + header.strings_len)
+        return FALSE;
+
+    const messages_record_t *records =
+        (const messages_record_t *)(contents + sizeof(header));
+    const gchar *strings = contents + sizeof(header) + records_len;
+    if (header.strings_len && strings[header.strings_len - 1])
+        return FALSE;
+
+    *stamp = header.stamp;
+    *entries = g_array_sized_new(FALSE, FALSE, sizeof(entry_t), header.count);
+
+    for (guint32 i = 0; i < header.count; ++i) {
+        const messages_record_t *record = records + i;
+        if (record->path >= header.strings_len ||
+            record->subject >= header.strings_len ||
+            record->sender >= header.strings_len ||
+            record->date >= header.strings_len ||
+            record->key >= header.strings_len ||
+            record->subject_key >= header.strings_len ||
+            record->sender_key >= header.strings_len ||
+            record->message_id >= header.strings_len ||
+            record->references >= header.strings_len) {
+            g_array_free(*entries, TRUE);
+            return FALSE;
+        }
+
+        entry_t entry = {.depth = record->depth,
+                         .status = record->status,
+                         .path = strings + record->path,
+                         .subject = strings + record->subject,
+                         .sender = strings + record->sender,
+                         .date = strings + record->date,
+                         .key = strings + record->key,
+                         .subject_key = strings + record->subject_key,
+                         .sender_key = strings + record->sender_key,
+                         .timestamp = record->timestamp,
+                         .message_id = strings + record->message_id,
+                         .references = strings + record->references};
+        g_array_append_val(*entries, entry);
+    }
+
+    return TRUE;
+}
+
+
+static void on_patch_entry(const gchar *subdirectory, const gchar *name,
+                           gpointer user_data) {
+    patch_data_t *data = user_data;
+
+    g_hash_table_insert(data->files, mbgui_maildir_get_key(name),
+                        g_build_filename(data->directory, subdirectory, name,
+                                         NULL));
+}
+
+
+// renames (flag changes, new/ to cur/ moves) are patched in place - removed
+// and added messages change threads, so FALSE is returned with paths of added
+// messages in `added` and only messages, which are still present, in
+// `entries`
+static gboolean patch_entries(const gchar *directory, GArray *entries,
+                              mbgui_message_arena_t *arena,
+                              GPtrArray **added) {
+    patch_data_t data = {.directory = directory,
+                         .files = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                        g_free, g_free)};
+    mbgui_maildir_list(directory, on_patch_entry, &data);
+
+    gboolean result = TRUE;
+    guint count = 0;
+
+    for (guint i = 0; i < entries->len; ++i) {
+        entry_t entry = g_array_index(entries, entry_t, i);
+
+        if (entry.status != MBGUI_MSG_STATUS_VIRTUAL) {
+            gchar *key = mbgui_maildir_get_key(entry.path);
+            gchar *path = g_hash_table_lookup(data.files, key);
+
+            if (!path) {
+                g_free(key);
+                result = FALSE;
+                continue;
+            }
+
+            if (strcmp(path, entry.path)) {
+                entry.path = mbgui_message_arena_insert(arena, path);
+                entry.status = mbgui_maildir_get_status(entry.path);
+            }
+
+            g_hash_table_remove(data.files, key);
+            g_free(key);
+        }
+
+        g_array_index(entries, entry_t, count++) = entry;
+    }
+
+    if (g_hash_table_size(data.files))
+        result = FALSE;
+
+    g_array_set_size(entries, count);
+
+    if (!result) {
+        *added = g_ptr_array_new_with_free_func(g_free);
+
+        GHashTableIter iter;
+        gpointer path;
+        g_hash_table_iter_init(&iter, data.files);
+        while (g_hash_table_iter_next(&iter, NULL, &path)) {
+            g_ptr_array_add(*added, path);
+            g_hash_table_iter_steal(&iter);
+        }
+    }
+
+    g_hash_table_destroy(data.files);
+    return result;
+}
+
+
+static mbgui_message_t *new_message(mbgui_message_arena_t *arena,
+                                    entry_t *entry) {
+    mbgui_message_t *message = mbgui_message_arena_alloc(arena);
+    message->path = entry->path;
+    message->status = entry->status;
+    message->subject = entry->subject;
+    message->sender = entry->sender;
+    message->date = entry->date;
+    message->key = entry->key;
+    message->subject_key = entry->subject_key;
+    message->sender_key = entry->sender_key;
+    message->timestamp = entry->timestamp;
+    return message;
+}
+
+
+static mbgui_message_t *build_messages(mbgui_message_arena_t *arena,
+                                       GArray *entries) {
+    mbgui_message_t *messages = NULL;
+    GPtrArray *last = g_ptr_array_new();
+
+    for (guint i = 0; i < entries->len; ++i) {
+        entry_t *entry = &g_array_index(entries, entry_t, i);
+        gsize depth = MIN(entry->depth, last->len);
+
+        mbgui_message_t *message = new_message(arena, entry);
+
+        if (depth)
+            message->parent = g_ptr_array_index(last, depth - 1);
+
+        if (depth < last->len) {
+            mbgui_message_t *previous = g_ptr_array_index(last, depth);
+            previous->next = message;
+            message->index = previous->index + 1;
+        } else if (depth) {
+            message->parent->children = message;
+        } else {
+            messages = message;
+        }
+
+        g_ptr_array_set_size(last, depth + 1);
+        g_ptr_array_index(last, depth) = message;
+    }
+
+    g_ptr_array_free(last, TRUE);
+    return messages;
+}
+
+
+// virtual messages are not kept, as they are created again by threading
+static GArray *get_cached_messages(mbgui_message_arena_t *arena,
+                                   GArray *entries) {
+    GArray *result = g_array_new(FALSE, FALSE, sizeof(mbgui_cache_message_t));
+
+    for (guint i = 0; i < entries->len; ++i) {
+        entry_t *entry = &g_array_index(entries, entry_t, i);
+        if (entry->status == MBGUI_MSG_STATUS_VIRTUAL)
+            continue;
+
+        mbgui_cache_message_t message = {
+            .message = new_message(arena, entry),
+            .message_id = entry->message_id,
+            .references = entry->references};
+        g_array_append_val(result, message);
+    }
+
+    return result;
+}
+
+
+static void save_messages_thread(GTask *task, gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable) {
+    save_messages_data_t *data = task_data;
+
+    gchar *path = get_cache_path("messages", data->directory->str);
+    write_bytes(path, data->bytes);
+    g_free(path);
+
+    g_mutex_lock(&save_mutex);
+    save_count -= 1;
+    if (!save_count)
+        g_cond_broadcast(&save_cond);
+    g_mutex_unlock(&save_mutex);
+
+    g_task_return_boolean(task, TRUE);
+}
+
+
+gboolean mbgui_cache_get_stamp(const gchar *directory,
+                               mbgui_cache_stamp_t *stamp) {
+    struct stat cur_stat;
+    struct stat new_stat;
+
+    gchar *cur_path = g_build_filename(directory, "cur", NULL);
+    gchar *new_path = g_build_filename(directory, "new", NULL);
+    gboolean result =
+        !stat(cur_path, &cur_stat) && !stat(new_path, &new_stat);
+    g_free(cur_path);
+    g_free(new_path);
+
+    if (!result)
+        return FALSE;
+
+    stamp->cur_sec = cur_stat.st_mtim.tv_sec;
+    stamp->cur_nsec = cur_stat.st_mtim.tv_nsec;
+    stamp->new_sec = new_stat.st_mtim.tv_sec;
+    stamp->new_nsec = new_stat.st_mtim.tv_nsec;
+    return TRUE;
+}
+
+
+// up to date or renamed messages are returned in `messages` - otherwise
+// messages, which are still present, are returned in `cached` and paths of
+// added messages in `added`, to be threaded again
+gboolean mbgui_cache_load_messages(const gchar *directory,
+                                   const mbgui_cache_stamp_t *stamp,
+                                   mbgui_message_arena_t *arena,
+                                   mbgui_message_t **messages,
+                                   GArray **cached, GPtrArray **added) {
+    gchar *path = get_cache_path("messages", directory);
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!file)
+        return FALSE;
+
+    mbgui_cache_stamp_t cached_stamp;
+    GArray *entries;
+    if (!read_entries(file, &cached_stamp, &entries)) {
+        g_mapped_file_unref(file);
+        return FALSE;
+    }
+
+    gboolean patched = TRUE;
+
+    if (memcmp(&cached_stamp, stamp, sizeof(mbgui_cache_stamp_t))) {
+        patched = patch_entries(directory, entries, arena, added);
+        if (patched) {
+            mbgui_cache_writer_t *writer = mbgui_cache_writer_new();
+            for (guint i = 0; i < entries->len; ++i)
+                add_entry(writer, &g_array_index(entries, entry_t, i));
+
+            GBytes *bytes = serialize(writer, stamp);
+            gchar *cache_path = get_cache_path("messages", directory);
+            write_bytes(cache_path, bytes);
+            g_free(cache_path);
+            g_bytes_unref(bytes);
+            mbgui_cache_writer_free(writer);
+        }
+    }
+
+    // message strings point directly into mapped file
+    mbgui_message_arena_add_file(arena, file);
+    if (patched)
+        *messages = build_messages(arena, entries);
+    else
+        *cached = get_cached_messages(arena, entries);
+
+    g_array_free(entries, TRUE);
+    g_mapped_file_unref(file);
+    return TRUE;
+}
+
+
+mbgui_cache_writer_t *mbgui_cache_writer_new(void) {
+    mbgui_cache_writer_t *writer = g_malloc(sizeof(mbgui_cache_writer_t));
+    writer->count = 0;
+    writer->records = g_byte_array_new();
+    writer->strings = g_byte_array_new();
+    writer->offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            NULL);
+    return writer;
+}
+
+
+void mbgui_cache_writer_free(mbgui_cache_writer_t *writer) {
+    g_byte_array_free(writer->records, TRUE);
+    g_byte_array_free(writer->strings, TRUE);
+    g_hash_table_destroy(writer->offsets);
+    g_free(writer);
+}
+
+
+// messages are added in order of tree traversal (parent before replies) -
+// `message_id` and `references` are kept for threading of added messages
+void mbgui_cache_writer_add_message(mbgui_cache_writer_t *writer,
+                                    mbgui_message_t *message, gsize depth,
+                                    const gchar *message_id,
+                                    const gchar *references) {
+    entry_t entry = {.depth = depth,
+                     .status = message->status,
+                     .path = message->path,
+                     .subject = message->subject,
+                     .sender = message->sender,
+                     .date = message->date,
+                     .key = message->key,
+                     .subject_key = message->subject_key,
+                     .sender_key = message->sender_key,
+                     .timestamp = message->timestamp,
+                     .message_id = message_id,
+                     .references = references};
+    add_entry(writer, &entry);
+}
+
+
+// records are serialized by calling thread, file is written by separate task
+void mbgui_cache_writer_save(mbgui_cache_writer_t *writer,
+                             const gchar *directory,
+                             const mbgui_cache_stamp_t *stamp) {
+    save_messages_data_t *data = g_malloc(sizeof(save_messages_data_t));
+    data->directory = g_string_new(directory);
+    data->bytes = serialize(writer, stamp);
+
+    g_mutex_lock(&save_mutex);
+    save_count += 1;
+    g_mutex_unlock(&save_mutex);
+
+    GTask *task = g_task_new(NULL, NULL, NULL, NULL);
+    g_task_set_task_data(task, data, (GDestroyNotify)free_save_messages_data);
+    g_task_run_in_thread(task, save_messages_thread);
+    g_object_unref(task);
+}
+
+
+// waits until messages, saved by mbgui_cache_writer_save, are written
+void mbgui_cache_flush(void) {
+    g_mutex_lock(&save_mutex);
+    while (save_count)
+        g_cond_wait(&save_cond, &save_mutex);
+    g_mutex_unlock(&save_mutex);
+}
+
+
+// returns array of mbgui_cache_directory_t or NULL - `key` identifies set of
+// searched directories
+GArray *mbgui_cache_load_directories(const gchar *key) {
+    gchar *path = get_cache_path("directories", key);
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!file)
+        return NULL;
+
+    gsize len = g_mapped_file_get_length(file);
+    const gchar *contents = g_mapped_file_get_contents(file);
+
+    directories_header_t header;
+    gsize records_len = 0;
+    gboolean valid = (len >= sizeof(header));
+    if (valid) {
+        memcpy(&header, contents, sizeof(header));
+        records_len = (gsize)header.count * sizeof(directories_record_t);
+        valid = !memcmp(header.magic, DIRECTORIES_MAGIC,
+                        sizeof(header.magic)) &&
+                header.version == DIRECTORIES_VERSION &&
+                header.strings_len <= len &&
+                len == sizeof(header) + records_len + header.strings_len;
+    }
+
+    const directories_record_t *records =
+        (const directories_record_t *)(contents + sizeof(header));
+    const gchar *strings = contents + sizeof(header) + records_len;
+    if (valid && header.strings_len && strings[header.strings_len - 1])
+        valid = FALSE;
+
+    GArray *result = NULL;
+    if (valid) {
+        result = g_array_sized_new(FALSE, FALSE,
+                                   sizeof(mbgui_cache_directory_t),
+                                   header.count);
+        g_array_set_clear_func(result,
+                               (GDestroyNotify)mbgui_cache_directory_clear);
+    }
+
+    for (guint32 i = 0; result && i < header.count; ++i) {
+        const directories_record_t *record = records + i;
+        if (record->path >= header.strings_len) {
+            g_clear_pointer(&result, g_array_unref);
+            break;
+        }
+
+        mbgui_cache_directory_t directory = {
+            .path = g_strdup(strings + record->path),
+            .counted = record->counted,
+            .stamp = record->stamp,
+            .unseen = record->unseen,
+            .total = record->total};
+        g_array_append_val(result, directory);
+    }
+
+    g_mapped_file_unref(file);
+    return result;
+}
+
+
+void mbgui_cache_save_directories(const gchar *key, GArray *directories) {
+    directories_header_t header = {.version = DIRECTORIES_VERSION,
+                                   .count = directories->len,
+                                   .strings_len = 0};
+    memcpy(header.magic, DIRECTORIES_MAGIC, sizeof(header.magic));
+
+    GByteArray *records = g_byte_array_new();
+    GByteArray *strings = g_byte_array_new();
+
+    for (guint i = 0; i < directories->len; ++i) {
+        mbgui_cache_directory_t *directory =
+            &g_array_index(directories, mbgui_cache_directory_t, i);
+        directories_record_t record = {.path = strings->len,
+                                       .counted = directory->counted,
+                                       .stamp = directory->stamp,
+                                       .unseen = directory->unseen,
+                                       .total = directory->total};
+        g_byte_array_append(records, (const guint8 *)&record, sizeof(record));
+        g_byte_array_append(strings, (const guint8 *)directory->path,
+                            strlen(directory->path) + 1);
+    }
+    header.strings_len = strings->len;
+
+    GByteArray *contents = g_byte_array_new();
+    g_byte_array_append(contents, (const guint8 *)&header, sizeof(header));
+    g_byte_array_append(contents, records->data, records->len);
+    g_byte_array_append(contents, strings->data, strings->len);
+    GBytes *bytes = g_byte_array_free_to_bytes(contents);
+
+    gchar *path = get_cache_path("directories", key);
+    write_bytes(path, bytes);
+    g_free(path);
+
+    g_bytes_unref(bytes);
+    g_byte_array_free(strings, TRUE);
+    g_byte_array_free(records, TRUE);
+}
+
+
+void mbgui_cache_directory_clear(mbgui_cache_directory_t *directory) {
+    g_clear_pointer(&(directory->path), g_free);
+}
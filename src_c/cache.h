@@ -0,0 +1,55 @@
+#ifndef MBGUI_CACHE_H
+#define MBGUI_CACHE_H
+
+#include <glib.h>
+#include "mblaze.h"
+
+
+typedef struct {
+    gint64 cur_sec;
+    gint64 cur_nsec;
+    gint64 new_sec;
+    gint64 new_nsec;
+} mbgui_cache_stamp_t;
+
+typedef struct {
+    gchar *path;
+    gboolean counted;
+    mbgui_cache_stamp_t stamp;
+    gsize unseen;
+    gsize total;
+} mbgui_cache_directory_t;
+
+typedef struct {
+    mbgui_message_t *message;
+    const gchar *message_id;
+    const gchar *references;
+} mbgui_cache_message_t;
+
+typedef struct mbgui_cache_writer_t mbgui_cache_writer_t;
+
+
+gboolean mbgui_cache_get_stamp(const gchar *directory,
+                               mbgui_cache_stamp_t *stamp);
+gboolean mbgui_cache_load_messages(const gchar *directory,
+                                   const mbgui_cache_stamp_t *stamp,
+                                   mbgui_message_arena_t *arena,
+                                   mbgui_message_t **messages,
+                                   GArray **cached, GPtrArray **added);
+
+mbgui_cache_writer_t *mbgui_cache_writer_new(void);
+void mbgui_cache_writer_free(mbgui_cache_writer_t *writer);
+void mbgui_cache_writer_add_message(mbgui_cache_writer_t *writer,
+                                    mbgui_message_t *message, gsize depth,
+                                    const gchar *message_id,
+                                    const gchar *references);
+void mbgui_cache_writer_save(mbgui_cache_writer_t *writer,
+                             const gchar *directory,
+                             const mbgui_cache_stamp_t *stamp);
+void mbgui_cache_flush(void);
+
+GArray *mbgui_cache_load_directories(const gchar *key);
+void mbgui_cache_save_directories(const gchar *key, GArray *directories);
+void mbgui_cache_directory_clear(mbgui_cache_directory_t *directory);
+
+#endif
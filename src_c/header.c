@@ -0,0 +1,431 @@
+#include <string.h>
+#include "header.h"
+#include "reader.h"
+
+
+#define READ_SIZE 8192
+#define READ_CHUNK_SIZE 256
+
+
+typedef struct {
+    gchar *from;
+    gchar *to;
+    gchar *cc;
+    gchar *date;
+} raw_fields_t;
+
+typedef struct {
+    gchar **paths;
+    gsize count;
+    mbgui_header_t *headers;
+    GCancellable *cancellable;
+} read_all_data_t;
+
+
+static const gchar *skip_spaces(const gchar *str) {
+    while (g_ascii_isspace(*str))
+        ++str;
+    return str;
+}
+
+
+static const gchar *parse_number(const gchar *str, gint *number) {
+    *number = 0;
+    while (g_ascii_isdigit(*str))
+        *number = *number * 10 + (*(str++) - '0');
+    return str;
+}
+
+
+static gint64 parse_date(const gchar *date) {
+    static const gchar *months[] = {"jan", "feb", "mar", "apr", "may", "jun",
+                                    "jul", "aug", "sep", "oct", "nov", "dec"};
+
+    if (!date)
+        return 0;
+
+    // [day-of-week ","] day month year hour ":" minute [":" second] zone
+    const gchar *i = skip_spaces(date);
+    if (g_ascii_isalpha(*i)) {
+        while (g_ascii_isalpha(*i))
+            ++i;
+        if (*i == ',')
+            ++i;
+        i = skip_spaces(i);
+    }
+
+    gint day;
+    i = skip_spaces(parse_number(i, &day));
+
+    gint month = 0;
+    while (month < 12 && g_ascii_strncasecmp(i, months[month], 3))
+        ++month;
+    if (month >= 12)
+        return 0;
+    while (g_ascii_isalpha(*i))
+        ++i;
+
+    gint year;
+    i = skip_spaces(parse_number(skip_spaces(i), &year));
+    if (year < 50)
+        year += 2000;
+    else if (year < 1000)
+        year += 1900;
+
+    gint hour, minute, second = 0;
+    i = parse_number(i, &hour);
+    if (*i != ':')
+        return 0;
+    i = parse_number(i + 1, &minute);
+    if (*i == ':')
+        i = parse_number(i + 1, &second);
+    i = skip_spaces(i);
+
+    gint64 offset = 0;
+    if ((*i == '+' || *i == '-') && strspn(i + 1, "0123456789") >= 4) {
+        gint zone;
+        parse_number(i + 1, &zone);
+        offset = ((zone / 100) * 60 + zone % 100) * 60;
+        if (*i == '-')
+            offset = -offset;
+    }
+
+    GDateTime *time =
+        g_date_time_new_utc(year, month + 1, day, hour, minute, second);
+    if (!time)
+        return 0;
+
+    gint64 result = g_date_time_to_unix(time) - offset;
+    g_date_time_unref(time);
+    return result;
+}
+
+
+static void decode_q(const gchar *text, gsize len, GString *result) {
+    for (gsize i = 0; i < len; ++i) {
+        if (text[i] == '_') {
+            g_string_append_c(result, ' ');
+
+        } else if (text[i] == '=' && i + 2 < len &&
+                   g_ascii_isxdigit(text[i + 1]) &&
+                   g_ascii_isxdigit(text[i + 2])) {
+            g_string_append_c(result, (g_ascii_xdigit_value(text[i + 1]) << 4) |
+                                          g_ascii_xdigit_value(text[i + 2]));
+            i += 2;
+
+        } else {
+            g_string_append_c(result, text[i]);
+        }
+    }
+}
+
+
+// decodes single "=?charset?encoding?text?=" word, returning position after
+// the word or NULL if word is not valid
+static const gchar *decode_word(const gchar *word, GString *result) {
+    const gchar *charset_end = strchr(word + 2, '?');
+    if (!charset_end || !charset_end[1] || charset_end[2] != '?')
+        return NULL;
+
+    gchar encoding = g_ascii_toupper(charset_end[1]);
+    if (encoding != 'B' && encoding != 'Q')
+        return NULL;
+
+    const gchar *text = charset_end + 3;
+    const gchar *text_end = strstr(text, "?=");
+    if (!text_end)
+        return NULL;
+
+    GString *bytes = g_string_sized_new(text_end - text);
+    if (encoding == 'B') {
+        gchar *encoded = g_strndup(text, text_end - text);
+        gsize len;
+        guchar *decoded = g_base64_decode(encoded, &len);
+        g_string_append_len(bytes, (gchar *)decoded, len);
+        g_free(decoded);
+        g_free(encoded);
+
+    } else {
+        decode_q(text, text_end - text, bytes);
+    }
+
+    // RFC 2231 language suffix ("charset*language")
+    gchar *charset = g_strndup(word + 2, charset_end - word - 2);
+    gchar *language = strchr(charset, '*');
+    if (language)
+        *language = '\0';
+
+    gchar *converted =
+        g_convert(bytes->str, bytes->len, "UTF-8", charset, NULL, NULL, NULL);
+    if (converted) {
+        g_string_append(result, converted);
+        g_free(converted);
+    } else {
+        g_string_append_len(result, bytes->str, bytes->len);
+    }
+
+    g_free(charset);
+    g_string_free(bytes, TRUE);
+    return text_end + 2;
+}
+
+
+// RFC 2047 encoded words are decoded and result is always valid UTF-8
+static gchar *decode_value(const gchar *value) {
+    GString *result = g_string_sized_new(strlen(value));
+    gboolean previous_encoded = FALSE;
+
+    const gchar *i = value;
+    while (*i) {
+        const gchar *word = strstr(i, "=?");
+        if (!word) {
+            g_string_append(result, i);
+            break;
+        }
+
+        // whitespace between adjacent encoded words is ignored
+        gsize result_len = result->len;
+        if (!previous_encoded || skip_spaces(i) != word)
+            g_string_append_len(result, i, word - i);
+
+        const gchar *next = decode_word(word, result);
+        if (next) {
+            i = next;
+            previous_encoded = TRUE;
+
+        } else {
+            g_string_truncate(result, result_len);
+            g_string_append_len(result, i, word - i + 2);
+            i = word + 2;
+            previous_encoded = FALSE;
+        }
+    }
+
+    gchar *valid = g_utf8_make_valid(result->str, result->len);
+    g_string_free(result, TRUE);
+    return valid;
+}
+
+
+static gchar *get_sender(const gchar *from) {
+    const gchar *address = strchr(from, '<');
+
+    // "name <address>" - name (without quotes) or address if name is empty
+    if (address) {
+        gchar *name = g_strstrip(g_strndup(from, address - from));
+        gsize len = strlen(name);
+        if (len >= 2 && name[0] == '"' && name[len - 1] == '"') {
+            memmove(name, name + 1, len - 2);
+            name[len - 2] = '\0';
+        }
+
+        if (name[0])
+            return name;
+        g_free(name);
+
+        const gchar *address_end = strchr(address, '>');
+        if (!address_end)
+            address_end = address + strlen(address);
+        return g_strndup(address + 1, address_end - address - 1);
+    }
+
+    // "address (name)"
+    const gchar *comment = strchr(from, '(');
+    const gchar *comment_end = (comment ? strrchr(comment, ')') : NULL);
+    if (comment_end && comment_end > comment + 1)
+        return g_strndup(comment + 1, comment_end - comment - 1);
+
+    return g_strstrip(g_strdup(from));
+}
+
+
+static gchar **get_field(mbgui_header_t *header, raw_fields_t *raw,
+                         const gchar *line, gsize name_len) {
+    if (name_len == 10 && !g_ascii_strncasecmp(line, "message-id", 10))
+        return &(header->message_id);
+
+    if (name_len == 11 && !g_ascii_strncasecmp(line, "in-reply-to", 11))
+        return &(header->in_reply_to);
+
+    if (name_len == 10 && !g_ascii_strncasecmp(line, "references", 10))
+        return &(header->references);
+
+    if (name_len == 7 && !g_ascii_strncasecmp(line, "subject", 7))
+        return &(header->subject);
+
+    if (name_len == 4 && !g_ascii_strncasecmp(line, "from", 4))
+        return &(raw->from);
+
+    if (name_len == 4 && !g_ascii_strncasecmp(line, "date", 4))
+        return &(raw->date);
+
+    if (name_len == 2 && !g_ascii_strncasecmp(line, "to", 2))
+        return &(raw->to);
+
+    if (name_len == 2 && !g_ascii_strncasecmp(line, "cc", 2))
+        return &(raw->cc);
+
+    return NULL;
+}
+
+
+static void init_header(mbgui_header_t *header) {
+    header->valid = FALSE;
+    header->message_id = NULL;
+    header->in_reply_to = NULL;
+    header->references = NULL;
+    header->subject = NULL;
+    header->sender = NULL;
+    header->from = NULL;
+    header->recipients = NULL;
+    header->date = 0;
+}
+
+
+static void append_value(GString *value, const gchar *str, gsize len) {
+    const gchar *end = str + len;
+    while (str < end && g_ascii_isspace(*str))
+        ++str;
+    g_string_append_len(value, str, end - str);
+}
+
+
+// lines are parsed in place - only values of used fields are copied
+static gboolean read_header(mbgui_reader_t *reader, GString *value,
+                            const gchar *path, mbgui_header_t *header) {
+    init_header(header);
+
+    if (!mbgui_reader_open(reader, path))
+        return FALSE;
+
+    raw_fields_t raw = {NULL, NULL, NULL, NULL};
+    gchar **field = NULL;
+    const gchar *line;
+    gsize len;
+
+    // header block ends with first empty line
+    for (;;) {
+        gboolean read = mbgui_reader_read_line(reader, &line, &len) && len;
+
+        // folded continuation of previous field
+        if (read && (line[0] == ' ' || line[0] == '\t')) {
+            if (field) {
+                g_string_append_c(value, ' ');
+                append_value(value, line, len);
+            }
+            continue;
+        }
+
+        if (field)
+            *field = g_strndup(value->str, value->len);
+        if (!read)
+            break;
+
+        const gchar *separator = memchr(line, ':', len);
+        field = (separator ? get_field(header, &raw, line, separator - line)
+                           : NULL);
+        if (field && *field)
+            field = NULL;
+
+        if (field) {
+            g_string_truncate(value, 0);
+            append_value(value, separator + 1, line + len - separator - 1);
+        }
+    }
+
+    mbgui_reader_close(reader);
+
+    if (header->subject) {
+        gchar *subject = decode_value(header->subject);
+        g_free(header->subject);
+        header->subject = subject;
+    }
+
+    if (raw.from) {
+        header->from = decode_value(raw.from);
+        header->sender = get_sender(header->from);
+    }
+
+    if (raw.to || raw.cc) {
+        gchar *recipients = g_strjoin(", ", (raw.to ? raw.to : ""),
+                                      (raw.cc ? raw.cc : ""), NULL);
+        header->recipients = decode_value(recipients);
+        g_free(recipients);
+    }
+
+    header->date = parse_date(raw.date);
+    header->valid = TRUE;
+
+    g_free(raw.from);
+    g_free(raw.to);
+    g_free(raw.cc);
+    g_free(raw.date);
+    return TRUE;
+}
+
+
+static void read_chunk(gpointer chunk, gpointer user_data) {
+    read_all_data_t *data = user_data;
+
+    gsize begin = (GPOINTER_TO_SIZE(chunk) - 1) * READ_CHUNK_SIZE;
+    gsize end = MIN(begin + READ_CHUNK_SIZE, data->count);
+
+    // buffers are shared by all headers of chunk
+    mbgui_reader_t reader;
+    mbgui_reader_init(&reader, READ_SIZE);
+    GString *value = g_string_sized_new(READ_SIZE);
+
+    // remaining headers of cancelled read are left invalid
+    for (gsize i = begin; i < end; ++i) {
+        if (g_cancellable_is_cancelled(data->cancellable))
+            init_header(data->headers + i);
+        else
+            read_header(&reader, value, data->paths[i], data->headers + i);
+    }
+
+    g_string_free(value, TRUE);
+    mbgui_reader_clear(&reader);
+}
+
+
+gboolean mbgui_header_read(const gchar *path, mbgui_header_t *header) {
+    mbgui_reader_t reader;
+    mbgui_reader_init(&reader, READ_SIZE);
+    GString *value = g_string_new(NULL);
+
+    gboolean result = read_header(&reader, value, path, header);
+
+    g_string_free(value, TRUE);
+    mbgui_reader_clear(&reader);
+    return result;
+}
+
+
+void mbgui_header_read_all(gchar **paths, gsize count, mbgui_header_t *headers,
+                           GCancellable *cancellable) {
+    read_all_data_t data = {paths, count, headers, cancellable};
+
+    GThreadPool *pool = g_thread_pool_new(read_chunk, &data,
+                                          g_get_num_processors(), FALSE, NULL);
+
+    for (gsize chunk = 0; chunk * READ_CHUNK_SIZE < count; ++chunk) {
+        if (pool)
+            g_thread_pool_push(pool, GSIZE_TO_POINTER(chunk + 1), NULL);
+        else
+            read_chunk(GSIZE_TO_POINTER(chunk + 1), &data);
+    }
+
+    if (pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+
+void mbgui_header_clear(mbgui_header_t *header) {
+    g_clear_pointer(&(header->message_id), g_free);
+    g_clear_pointer(&(header->in_reply_to), g_free);
+    g_clear_pointer(&(header->references), g_free);
+    g_clear_pointer(&(header->subject), g_free);
+    g_clear_pointer(&(header->sender), g_free);
+    g_clear_pointer(&(header->from), g_free);
+    g_clear_pointer(&(header->recipients), g_free);
+}
@@ -0,0 +1,25 @@
+#ifndef MBGUI_HEADER_H
+#define MBGUI_HEADER_H
+
+#include <gio/gio.h>
+
+
+typedef struct {
+    gboolean valid;
+    gchar *message_id;
+    gchar *in_reply_to;
+    gchar *references;
+    gchar *subject;
+    gchar *sender;
+    gchar *from;
+    gchar *recipients;
+    gint64 date;
+} mbgui_header_t;
+
+
+gboolean mbgui_header_read(const gchar *path, mbgui_header_t *header);
+void mbgui_header_read_all(gchar **paths, gsize count, mbgui_header_t *headers,
+                           GCancellable *cancellable);
+void mbgui_header_clear(mbgui_header_t *header);
+
+#endif
@@ -0,0 +1,813 @@
+#include <string.h>
+#include <glib/gstdio.h>
+#include "index.h"
+#include "header.h"
+#include "maildir.h"
+#include "mime.h"
+
+
+#define INDEX_MAGIC "MBGUIIDX"
+#define INDEX_VERSION 1
+#define INDEX_BODY_SIZE (16 * 1024)
+#define INDEX_BATCH_SIZE 4096
+#define INDEX_CHUNK_SIZE 64
+#define INDEX_MERGE_SIZE 1024
+#define TERM_MIN_SIZE 2
+#define TERM_MAX_SIZE 64
+
+
+// index file layout: header, `doc_count` document records, `term_count` term
+// records (sorted by term), postings (delta encoded varints), string pool
+//
+// documents added after index file was written are kept in memory (delta)
+// until their number reaches INDEX_MERGE_SIZE, when index file is rewritten
+// with all documents - documents that were not written are reindexed by
+// next mbgui_index_sync
+
+typedef struct {
+    gchar magic[8];
+    guint32 version;
+    guint32 doc_count;
+    guint32 term_count;
+    guint32 reserved;
+    guint64 postings_len;
+    guint64 strings_len;
+} index_header_t;
+
+typedef struct {
+    guint32 path;
+} doc_record_t;
+
+typedef struct {
+    guint32 term;
+    guint32 count;
+    guint64 postings;
+} term_record_t;
+
+struct mbgui_index_t {
+    GMutex mutex;
+    gchar *directory;
+    gboolean loaded;
+    gboolean synced;
+    GMappedFile *file;
+    guint32 base_count;
+    guint32 term_count;
+    const doc_record_t *docs;
+    const term_record_t *terms;
+    const guchar *postings;
+    gsize postings_len;
+    const gchar *strings;
+    gsize strings_len;
+    GPtrArray *paths;
+    GHashTable *renamed;
+    GHashTable *deleted;
+    GHashTable *delta;
+    GHashTable *keys;
+};
+
+typedef struct {
+    gchar *path;
+    gchar *name;
+    GPtrArray *terms;
+} document_t;
+
+typedef struct {
+    document_t *documents;
+    gsize count;
+    GCancellable *cancellable;
+} read_all_data_t;
+
+
+static gchar *get_index_path(const gchar *directory) {
+    gchar *name = g_compute_checksum_for_string(G_CHECKSUM_SHA1, directory, -1);
+    gchar *path =
+        g_build_filename(g_get_user_cache_dir(), "mbgui", "index", name, NULL);
+    g_free(name);
+    return path;
+}
+
+
+static void add_terms(GHashTable *terms, const gchar *text) {
+    if (!text)
+        return;
+
+    gchar *lower = g_utf8_strdown(text, -1);
+    GString *term = g_string_new(NULL);
+
+    for (const gchar *i = lower;; i = g_utf8_next_char(i)) {
+        gunichar c = g_utf8_get_char(i);
+        if (c && g_unichar_isalnum(c)) {
+            g_string_append_unichar(term, c);
+            continue;
+        }
+
+        if (term->len >= TERM_MIN_SIZE && term->len <= TERM_MAX_SIZE &&
+            !g_hash_table_contains(terms, term->str))
+            g_hash_table_add(terms, g_strdup(term->str));
+        g_string_truncate(term, 0);
+
+        if (!c)
+            break;
+    }
+
+    g_string_free(term, TRUE);
+    g_free(lower);
+}
+
+
+static GPtrArray *get_document_terms(const gchar *path) {
+    GHashTable *terms =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    mbgui_header_t header;
+    if (mbgui_header_read(path, &header)) {
+        add_terms(terms, header.subject);
+        add_terms(terms, header.from);
+        add_terms(terms, header.recipients);
+        mbgui_header_clear(&header);
+
+        gchar *text = mbgui_mime_get_text(path, INDEX_BODY_SIZE);
+        add_terms(terms, text);
+        g_free(text);
+    }
+
+    GPtrArray *result = g_ptr_array_new_with_free_func(g_free);
+    GHashTableIter iter;
+    gpointer term;
+    g_hash_table_iter_init(&iter, terms);
+    while (g_hash_table_iter_next(&iter, &term, NULL)) {
+        g_hash_table_iter_steal(&iter);
+        g_ptr_array_add(result, term);
+    }
+
+    g_hash_table_destroy(terms);
+    return result;
+}
+
+
+static void read_chunk(gpointer chunk, gpointer user_data) {
+    read_all_data_t *data = user_data;
+
+    gsize begin = (GPOINTER_TO_SIZE(chunk) - 1) * INDEX_CHUNK_SIZE;
+    gsize end = MIN(begin + INDEX_CHUNK_SIZE, data->count);
+
+    for (gsize i = begin; i < end; ++i) {
+        if (!g_cancellable_is_cancelled(data->cancellable))
+            data->documents[i].terms =
+                get_document_terms(data->documents[i].path);
+    }
+}
+
+
+static void read_documents(document_t *documents, gsize count,
+                           GCancellable *cancellable) {
+    read_all_data_t data = {documents, count, cancellable};
+
+    GThreadPool *pool = g_thread_pool_new(read_chunk, &data,
+                                          g_get_num_processors(), FALSE, NULL);
+
+    for (gsize chunk = 0; chunk * INDEX_CHUNK_SIZE < count; ++chunk) {
+        if (pool)
+            g_thread_pool_push(pool, GSIZE_TO_POINTER(chunk + 1), NULL);
+        else
+            read_chunk(GSIZE_TO_POINTER(chunk + 1), &data);
+    }
+
+    if (pool)
+        g_thread_pool_free(pool, FALSE, TRUE);
+}
+
+
+static void append_varint(GByteArray *bytes, guint32 value) {
+    while (value >= 0x80) {
+        guint8 byte = (value & 0x7f) | 0x80;
+        g_byte_array_append(bytes, &byte, 1);
+        value >>= 7;
+    }
+
+    guint8 byte = value;
+    g_byte_array_append(bytes, &byte, 1);
+}
+
+
+static const guchar *read_varint(const guchar *i, const guchar *end,
+                                 guint32 *value) {
+    *value = 0;
+    for (guint shift = 0; i < end && shift < 32; shift += 7) {
+        guchar byte = *(i++);
+        *value |= (guint32)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return i;
+}
+
+
+static void append_postings(mbgui_index_t *index, const term_record_t *term,
+                            GArray *ids) {
+    const guchar *i = index->postings + term->postings;
+    const guchar *end = index->postings + index->postings_len;
+    guint32 id = 0;
+
+    for (guint32 count = 0; count < term->count && i < end; ++count) {
+        guint32 delta;
+        i = read_varint(i, end, &delta);
+        id += delta;
+        g_array_append_val(ids, id);
+    }
+}
+
+
+static const gchar *get_base_term(mbgui_index_t *index, guint32 i) {
+    return index->strings + index->terms[i].term;
+}
+
+
+static const gchar *get_path(mbgui_index_t *index, guint32 id) {
+    if (id >= index->base_count)
+        return g_ptr_array_index(index->paths, id - index->base_count);
+
+    const gchar *path =
+        g_hash_table_lookup(index->renamed, GUINT_TO_POINTER(id));
+    return (path ? path : index->strings + index->docs[id].path);
+}
+
+
+static guint32 get_doc_count(mbgui_index_t *index) {
+    return index->base_count + index->paths->len;
+}
+
+
+static void clear_delta(mbgui_index_t *index) {
+    g_ptr_array_set_size(index->paths, 0);
+    g_hash_table_remove_all(index->renamed);
+    g_hash_table_remove_all(index->deleted);
+    g_hash_table_remove_all(index->delta);
+    g_clear_pointer(&(index->keys), g_hash_table_destroy);
+}
+
+
+static gboolean read_index(mbgui_index_t *index, GMappedFile *file) {
+    gsize len = g_mapped_file_get_length(file);
+    const gchar *contents = g_mapped_file_get_contents(file);
+
+    index_header_t header;
+    if (len < sizeof(header))
+        return FALSE;
+    memcpy(&header, contents, sizeof(header));
+
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) ||
+        header.version != INDEX_VERSION)
+        return FALSE;
+
+    gsize docs_len = (gsize)header.doc_count * sizeof(doc_record_t);
+    gsize terms_len = (gsize)header.term_count * sizeof(term_record_t);
+    if (header.postings_len > len || header.strings_len > len ||
+        len != sizeof(header) + docs_len + terms_len + header.postings_len +
+                   header.strings_len)
+        return FALSE;
+
+    const gchar *i = contents + sizeof(header);
+    index->docs = (const doc_record_t *)i;
+    i += docs_len;
+    index->terms = (const term_record_t *)i;
+    i += terms_len;
+    index->postings = (const guchar *)i;
+    i += header.postings_len;
+    index->strings = i;
+
+    if (header.strings_len && index->strings[header.strings_len - 1])
+        return FALSE;
+
+    for (guint32 j = 0; j < header.doc_count; ++j) {
+        if (index->docs[j].path >= header.strings_len)
+            return FALSE;
+    }
+
+    for (guint32 j = 0; j < header.term_count; ++j) {
+        if (index->terms[j].term >= header.strings_len ||
+            index->terms[j].postings > header.postings_len)
+            return FALSE;
+    }
+
+    index->base_count = header.doc_count;
+    index->term_count = header.term_count;
+    index->postings_len = header.postings_len;
+    index->strings_len = header.strings_len;
+    return TRUE;
+}
+
+
+static void load(mbgui_index_t *index) {
+    if (index->loaded)
+        return;
+    index->loaded = TRUE;
+
+    gchar *path = get_index_path(index->directory);
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    if (!file)
+        return;
+
+    if (read_index(index, file)) {
+        index->file = file;
+    } else {
+        index->base_count = 0;
+        index->term_count = 0;
+        g_mapped_file_unref(file);
+    }
+}
+
+
+static void init_keys(mbgui_index_t *index) {
+    if (index->keys)
+        return;
+
+    index->keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (guint32 id = 0; id < get_doc_count(index); ++id) {
+        if (!g_hash_table_contains(index->deleted, GUINT_TO_POINTER(id)))
+            g_hash_table_insert(index->keys,
+                                mbgui_maildir_get_key(get_path(index, id)),
+                                GUINT_TO_POINTER(id));
+    }
+}
+
+
+static void add_document(mbgui_index_t *index, document_t *document) {
+    guint32 id = get_doc_count(index);
+    g_ptr_array_add(index->paths, g_strdup(document->name));
+    g_hash_table_insert(index->keys, mbgui_maildir_get_key(document->name),
+                        GUINT_TO_POINTER(id));
+
+    for (guint i = 0; i < document->terms->len; ++i) {
+        const gchar *term = g_ptr_array_index(document->terms, i);
+        GArray *ids = g_hash_table_lookup(index->delta, term);
+        if (!ids) {
+            ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+            g_hash_table_insert(index->delta, g_strdup(term), ids);
+        }
+        g_array_append_val(ids, id);
+    }
+}
+
+
+static void remove_document(mbgui_index_t *index, const gchar *key) {
+    gpointer id;
+    if (!g_hash_table_lookup_extended(index->keys, key, NULL, &id))
+        return;
+
+    g_hash_table_add(index->deleted, id);
+    g_hash_table_remove(index->keys, key);
+}
+
+
+static void rename_document(mbgui_index_t *index, guint32 id,
+                            const gchar *name) {
+    if (id >= index->base_count) {
+        g_free(g_ptr_array_index(index->paths, id - index->base_count));
+        g_ptr_array_index(index->paths, id - index->base_count) =
+            g_strdup(name);
+    } else {
+        g_hash_table_insert(index->renamed, GUINT_TO_POINTER(id),
+                            g_strdup(name));
+    }
+}
+
+
+static void index_documents(mbgui_index_t *index, GPtrArray *names,
+                            GCancellable *cancellable) {
+    for (guint begin = 0; begin < names->len; begin += INDEX_BATCH_SIZE) {
+        if (g_cancellable_is_cancelled(cancellable))
+            break;
+
+        gsize count = MIN(INDEX_BATCH_SIZE, names->len - begin);
+        document_t *documents = g_new0(document_t, count);
+        for (gsize i = 0; i < count; ++i) {
+            documents[i].name = g_ptr_array_index(names, begin + i);
+            documents[i].path = g_build_filename(index->directory,
+                                                 documents[i].name, NULL);
+        }
+
+        read_documents(documents, count, cancellable);
+
+        for (gsize i = 0; i < count; ++i) {
+            if (documents[i].terms) {
+                add_document(index, documents + i);
+                g_ptr_array_free(documents[i].terms, TRUE);
+            }
+            g_free(documents[i].path);
+        }
+        g_free(documents);
+    }
+}
+
+
+static gint compare_terms(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const gchar **)a, *(const gchar **)b);
+}
+
+
+static void write_term(GByteArray *terms, GByteArray *postings,
+                       GByteArray *strings, const gchar *term, GArray *ids,
+                       GArray *new_ids) {
+    term_record_t record = {.term = strings->len,
+                            .count = 0,
+                            .postings = postings->len};
+    guint32 last = 0;
+
+    for (guint i = 0; i < ids->len; ++i) {
+        guint32 id = g_array_index(new_ids, guint32, g_array_index(ids, guint32,
+                                                                   i));
+        if (id == G_MAXUINT32)
+            continue;
+
+        append_varint(postings, id - last);
+        last = id;
+        record.count += 1;
+    }
+
+    if (!record.count)
+        return;
+
+    g_byte_array_append(strings, (const guint8 *)term, strlen(term) + 1);
+    g_byte_array_append(terms, (const guint8 *)&record, sizeof(record));
+}
+
+
+// writes all documents, without removed ones, to new index file
+static void merge(mbgui_index_t *index) {
+    GArray *new_ids = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+                                        get_doc_count(index));
+    GByteArray *docs = g_byte_array_new();
+    GByteArray *terms = g_byte_array_new();
+    GByteArray *postings = g_byte_array_new();
+    GByteArray *strings = g_byte_array_new();
+    guint32 doc_count = 0;
+
+    for (guint32 id = 0; id < get_doc_count(index); ++id) {
+        guint32 new_id = G_MAXUINT32;
+        if (!g_hash_table_contains(index->deleted, GUINT_TO_POINTER(id))) {
+            const gchar *path = get_path(index, id);
+            doc_record_t record = {.path = strings->len};
+            g_byte_array_append(strings, (const guint8 *)path,
+                                strlen(path) + 1);
+            g_byte_array_append(docs, (const guint8 *)&record, sizeof(record));
+            new_id = doc_count++;
+        }
+        g_array_append_val(new_ids, new_id);
+    }
+
+    GPtrArray *delta_terms = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer term;
+    g_hash_table_iter_init(&iter, index->delta);
+    while (g_hash_table_iter_next(&iter, &term, NULL))
+        g_ptr_array_add(delta_terms, term);
+    g_ptr_array_sort(delta_terms, compare_terms);
+
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+    guint32 i = 0;
+    guint j = 0;
+    while (i < index->term_count || j < delta_terms->len) {
+        const gchar *base_term =
+            (i < index->term_count ? get_base_term(index, i) : NULL);
+        const gchar *delta_term =
+            (j < delta_terms->len ? g_ptr_array_index(delta_terms, j) : NULL);
+        gint cmp = (!base_term    ? 1
+                    : !delta_term ? -1
+                                  : strcmp(base_term, delta_term));
+
+        // delta documents have greater ids than base documents
+        g_array_set_size(ids, 0);
+        if (cmp <= 0)
+            append_postings(index, index->terms + i++, ids);
+        if (cmp >= 0) {
+            GArray *delta_ids = g_hash_table_lookup(index->delta, delta_term);
+            g_array_append_vals(ids, delta_ids->data, delta_ids->len);
+            j += 1;
+        }
+
+        write_term(terms, postings, strings,
+                   (cmp <= 0 ? base_term : delta_term), ids, new_ids);
+    }
+
+    index_header_t header = {.version = INDEX_VERSION,
+                             .doc_count = doc_count,
+                             .term_count = terms->len / sizeof(term_record_t),
+                             .reserved = 0,
+                             .postings_len = postings->len,
+                             .strings_len = strings->len};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+
+    GByteArray *contents = g_byte_array_new();
+    g_byte_array_append(contents, (const guint8 *)&header, sizeof(header));
+    g_byte_array_append(contents, docs->data, docs->len);
+    g_byte_array_append(contents, terms->data, terms->len);
+    g_byte_array_append(contents, postings->data, postings->len);
+    g_byte_array_append(contents, strings->data, strings->len);
+
+    gchar *path = get_index_path(index->directory);
+    gchar *dirname = g_path_get_dirname(path);
+    gboolean written =
+        !g_mkdir_with_parents(dirname, 0700) &&
+        g_file_set_contents(path, (const gchar *)contents->data, contents->len,
+                            NULL);
+
+    // on failure, delta is kept in memory
+    if (written) {
+        clear_delta(index);
+        if (index->file)
+            g_mapped_file_unref(index->file);
+        index->file = NULL;
+        index->base_count = 0;
+        index->term_count = 0;
+        index->loaded = FALSE;
+        load(index);
+        init_keys(index);
+    }
+
+    g_free(dirname);
+    g_free(path);
+    g_byte_array_free(contents, TRUE);
+    g_array_free(ids, TRUE);
+    g_ptr_array_free(delta_terms, TRUE);
+    g_byte_array_free(strings, TRUE);
+    g_byte_array_free(postings, TRUE);
+    g_byte_array_free(terms, TRUE);
+    g_byte_array_free(docs, TRUE);
+    g_array_free(new_ids, TRUE);
+}
+
+
+static void merge_if_needed(mbgui_index_t *index) {
+    if (index->paths->len >= INDEX_MERGE_SIZE ||
+        (!index->base_count && index->paths->len) ||
+        g_hash_table_size(index->deleted) > index->base_count / 8)
+        merge(index);
+}
+
+
+static void on_list_entry(const gchar *subdirectory, const gchar *name,
+                          gpointer user_data) {
+    GPtrArray *names = user_data;
+
+    g_ptr_array_add(names, g_build_filename(subdirectory, name, NULL));
+}
+
+
+static guint get_prefix_begin(mbgui_index_t *index, const gchar *prefix) {
+    guint begin = 0;
+    guint end = index->term_count;
+
+    while (begin < end) {
+        guint middle = begin + (end - begin) / 2;
+        if (strcmp(get_base_term(index, middle), prefix) < 0)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+
+    return begin;
+}
+
+
+static gint compare_ids(gconstpointer a, gconstpointer b) {
+    guint32 x = *(const guint32 *)a;
+    guint32 y = *(const guint32 *)b;
+    return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+
+// sorted ids of documents containing term starting with `prefix`
+static GArray *find_prefix(mbgui_index_t *index, const gchar *prefix) {
+    GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+    guint lists = 0;
+
+    for (guint i = get_prefix_begin(index, prefix);
+         i < index->term_count &&
+         g_str_has_prefix(get_base_term(index, i), prefix);
+         ++i, ++lists)
+        append_postings(index, index->terms + i, ids);
+
+    GHashTableIter iter;
+    gpointer term;
+    gpointer delta_ids;
+    g_hash_table_iter_init(&iter, index->delta);
+    while (g_hash_table_iter_next(&iter, &term, &delta_ids)) {
+        if (!g_str_has_prefix(term, prefix))
+            continue;
+
+        g_array_append_vals(ids, ((GArray *)delta_ids)->data,
+                            ((GArray *)delta_ids)->len);
+        lists += 1;
+    }
+
+    if (lists < 2)
+        return ids;
+
+    g_array_sort(ids, compare_ids);
+    guint count = 0;
+    for (guint i = 0; i < ids->len; ++i) {
+        if (!count || g_array_index(ids, guint32, count - 1) !=
+                          g_array_index(ids, guint32, i))
+            g_array_index(ids, guint32, count++) =
+                g_array_index(ids, guint32, i);
+    }
+    g_array_set_size(ids, count);
+    return ids;
+}
+
+
+static void intersect(GArray *result, GArray *ids) {
+    guint count = 0;
+    guint j = 0;
+
+    for (guint i = 0; i < result->len; ++i) {
+        guint32 id = g_array_index(result, guint32, i);
+        while (j < ids->len && g_array_index(ids, guint32, j) < id)
+            ++j;
+        if (j < ids->len && g_array_index(ids, guint32, j) == id)
+            g_array_index(result, guint32, count++) = id;
+    }
+
+    g_array_set_size(result, count);
+}
+
+
+mbgui_index_t *mbgui_index_new(const gchar *directory) {
+    mbgui_index_t *index = g_malloc0(sizeof(mbgui_index_t));
+    g_mutex_init(&(index->mutex));
+    index->directory = g_strdup(directory);
+    index->paths = g_ptr_array_new_with_free_func(g_free);
+    index->renamed = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    index->deleted = g_hash_table_new(NULL, NULL);
+    index->delta = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         (GDestroyNotify)g_array_unref);
+    return index;
+}
+
+
+void mbgui_index_free(mbgui_index_t *index) {
+    clear_delta(index);
+    g_ptr_array_free(index->paths, TRUE);
+    g_hash_table_destroy(index->renamed);
+    g_hash_table_destroy(index->deleted);
+    g_hash_table_destroy(index->delta);
+    if (index->file)
+        g_mapped_file_unref(index->file);
+    g_free(index->directory);
+    g_mutex_clear(&(index->mutex));
+    g_free(index);
+}
+
+
+// indexes new messages and forgets removed ones - once synced, index is kept
+// up to date by mbgui_index_update
+void mbgui_index_sync(mbgui_index_t *index, GCancellable *cancellable) {
+    g_mutex_lock(&(index->mutex));
+
+    if (index->synced) {
+        g_mutex_unlock(&(index->mutex));
+        return;
+    }
+
+    load(index);
+    init_keys(index);
+
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    mbgui_maildir_list(index->directory, on_list_entry, names);
+
+    GHashTable *existing =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray *added = g_ptr_array_new();
+
+    for (guint i = 0; i < names->len; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        gchar *key = mbgui_maildir_get_key(name);
+        gpointer id;
+
+        if (g_hash_table_lookup_extended(index->keys, key, NULL, &id)) {
+            if (strcmp(get_path(index, GPOINTER_TO_UINT(id)), name))
+                rename_document(index, GPOINTER_TO_UINT(id), name);
+        } else {
+            g_ptr_array_add(added, (gpointer)name);
+        }
+
+        g_hash_table_add(existing, key);
+    }
+
+    GPtrArray *removed = g_ptr_array_new();
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, index->keys);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (!g_hash_table_contains(existing, key))
+            g_ptr_array_add(removed, g_strdup(key));
+    }
+    for (guint i = 0; i < removed->len; ++i) {
+        remove_document(index, g_ptr_array_index(removed, i));
+        g_free(g_ptr_array_index(removed, i));
+    }
+
+    index_documents(index, added, cancellable);
+    index->synced = !g_cancellable_is_cancelled(cancellable);
+    merge_if_needed(index);
+
+    g_ptr_array_free(removed, TRUE);
+    g_ptr_array_free(added, TRUE);
+    g_hash_table_destroy(existing);
+    g_ptr_array_free(names, TRUE);
+    g_mutex_unlock(&(index->mutex));
+}
+
+
+void mbgui_index_update(mbgui_index_t *index, mbgui_watch_event_t event,
+                        const gchar *path, const gchar *new_path) {
+    g_mutex_lock(&(index->mutex));
+
+    // changes before sync are found by sync
+    gsize directory_len = strlen(index->directory);
+    if (!index->synced || strncmp(path, index->directory, directory_len) ||
+        path[directory_len] != '/') {
+        g_mutex_unlock(&(index->mutex));
+        return;
+    }
+
+    const gchar *name = path + directory_len + 1;
+    const gchar *new_name = (new_path ? new_path + directory_len + 1 : NULL);
+    if (event == MBGUI_WATCH_EVENT_RENAMED) {
+        path = new_path;
+        name = new_name;
+    }
+
+    gchar *key = mbgui_maildir_get_key(name);
+    gpointer id;
+    gboolean indexed =
+        g_hash_table_lookup_extended(index->keys, key, NULL, &id);
+
+    if (event == MBGUI_WATCH_EVENT_REMOVED) {
+        remove_document(index, key);
+
+    } else if (indexed) {
+        rename_document(index, GPOINTER_TO_UINT(id), name);
+
+    } else {
+        document_t document = {.path = (gchar *)path,
+                               .name = (gchar *)name,
+                               .terms = get_document_terms(path)};
+        add_document(index, &document);
+        g_ptr_array_free(document.terms, TRUE);
+    }
+
+    merge_if_needed(index);
+
+    g_free(key);
+    g_mutex_unlock(&(index->mutex));
+}
+
+
+// paths of messages containing all query words (as word prefixes), most
+// recently indexed first
+GPtrArray *mbgui_index_search(mbgui_index_t *index, const gchar *query,
+                              gsize limit) {
+    GHashTable *terms =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    add_terms(terms, query);
+
+    g_mutex_lock(&(index->mutex));
+    load(index);
+
+    GArray *result = NULL;
+    GHashTableIter iter;
+    gpointer term;
+    g_hash_table_iter_init(&iter, terms);
+    while (g_hash_table_iter_next(&iter, &term, NULL)) {
+        GArray *ids = find_prefix(index, term);
+        if (result) {
+            intersect(result, ids);
+            g_array_free(ids, TRUE);
+        } else {
+            result = ids;
+        }
+
+        if (!result->len)
+            break;
+    }
+
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = (result ? result->len : 0); i > 0 && paths->len < limit;
+         --i) {
+        guint32 id = g_array_index(result, guint32, i - 1);
+        if (!g_hash_table_contains(index->deleted, GUINT_TO_POINTER(id)))
+            g_ptr_array_add(paths, g_build_filename(index->directory,
+                                                    get_path(index, id),
+                                                    NULL));
+    }
+
+    g_mutex_unlock(&(index->mutex));
+
+    if (result)
+        g_array_free(result, TRUE);
+    g_hash_table_destroy(terms);
+    return paths;
+}
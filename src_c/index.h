@@ -0,0 +1,21 @@
+#ifndef MBGUI_INDEX_H
+#define MBGUI_INDEX_H
+
+#include <gio/gio.h>
+#include "mblaze.h"
+
+
+typedef struct mbgui_index_t mbgui_index_t;
+
+
+// index functions are thread safe - access is serialized by index mutex
+
+mbgui_index_t *mbgui_index_new(const gchar *directory);
+void mbgui_index_free(mbgui_index_t *index);
+void mbgui_index_sync(mbgui_index_t *index, GCancellable *cancellable);
+void mbgui_index_update(mbgui_index_t *index, mbgui_watch_event_t event,
+                        const gchar *path, const gchar *new_path);
+GPtrArray *mbgui_index_search(mbgui_index_t *index, const gchar *query,
+                              gsize limit);
+
+#endif
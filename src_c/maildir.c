@@ -0,0 +1,317 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include "maildir.h"
+
+
+// position and real are made of readdir positions and real paths of all path
+// components below searched argument
+typedef struct {
+    gchar *path;
+    guint32 *position;
+    gchar **real;
+    guint depth;
+} find_entry_t;
+
+typedef struct {
+    GCancellable *cancellable;
+    GThreadPool *pool;
+    GMutex mutex;
+    GCond cond;
+    gsize pending;
+    GPtrArray *result;
+} find_data_t;
+
+
+static void list_subdirectory(const gchar *directory,
+                              const gchar *subdirectory,
+                              mbgui_maildir_list_cb_t cb, gpointer user_data) {
+    gchar *path = g_build_filename(directory, subdirectory, NULL);
+    DIR *dir = opendir(path);
+    g_free(path);
+    if (!dir)
+        return;
+
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+            entry->d_type != DT_UNKNOWN)
+            continue;
+
+        cb(subdirectory, entry->d_name, user_data);
+    }
+
+    closedir(dir);
+}
+
+
+static void on_count_entry(const gchar *subdirectory, const gchar *name,
+                           gpointer user_data) {
+    gsize *counts = user_data;
+
+    if (!mbgui_maildir_has_flag(name, 'S'))
+        counts[0] += 1;
+    counts[1] += 1;
+}
+
+
+static void free_find_entry(find_entry_t *entry) {
+    for (guint i = 0; i < entry->depth; ++i)
+        g_free(entry->real[i]);
+    g_free(entry->path);
+    g_free(entry->position);
+    g_free(entry->real);
+    g_free(entry);
+}
+
+
+static void find_directory(gpointer entry, gpointer user_data);
+
+
+// directory is reported with path as it was given, real path is used only to
+// skip symlinks leading back to one of its parents
+static void push_directory(find_data_t *data, find_entry_t *parent,
+                           guint32 position, const gchar *path) {
+    gchar *real = realpath(path, NULL);
+    if (!real)
+        return;
+
+    for (guint i = 0; parent && i < parent->depth; ++i) {
+        if (!strcmp(parent->real[i], real)) {
+            free(real);
+            return;
+        }
+    }
+
+    g_mutex_lock(&(data->mutex));
+    data->pending += 1;
+    g_mutex_unlock(&(data->mutex));
+
+    find_entry_t *entry = g_malloc(sizeof(find_entry_t));
+    entry->path = g_strdup(path);
+    entry->depth = (parent ? parent->depth + 1 : 1);
+    entry->position = g_new(guint32, entry->depth);
+    entry->real = g_new(gchar *, entry->depth);
+    for (guint i = 0; parent && i < parent->depth; ++i) {
+        entry->position[i] = parent->position[i];
+        entry->real[i] = g_strdup(parent->real[i]);
+    }
+    entry->position[entry->depth - 1] = position;
+    entry->real[entry->depth - 1] = g_strdup(real);
+    free(real);
+
+    if (data->pool)
+        g_thread_pool_push(data->pool, entry, NULL);
+    else
+        find_directory(entry, data);
+}
+
+
+static gboolean is_directory(const gchar *path, struct dirent *entry) {
+    if (entry->d_type == DT_DIR)
+        return TRUE;
+
+    if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+        return FALSE;
+
+    return g_file_test(path, G_FILE_TEST_IS_DIR);
+}
+
+
+static void find_directory(gpointer entry, gpointer user_data) {
+    find_data_t *data = user_data;
+    find_entry_t *directory = entry;
+    gboolean maildir = FALSE;
+
+    DIR *dir = (g_cancellable_is_cancelled(data->cancellable)
+                    ? NULL
+                    : opendir(directory->path));
+
+    guint32 position = 0;
+    for (struct dirent *i = (dir ? readdir(dir) : NULL); i; i = readdir(dir)) {
+        const gchar *name = i->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        gchar *child = g_build_filename(directory->path, name, NULL);
+
+        // as with `mdirs -a`, all subdirectories except Maildir's own are
+        // searched, including hidden Maildir++ folders
+        if (is_directory(child, i)) {
+            if (!strcmp(name, "cur"))
+                maildir = TRUE;
+            else if (strcmp(name, "new") && strcmp(name, "tmp"))
+                push_directory(data, directory, position++, child);
+        }
+
+        g_free(child);
+    }
+
+    if (dir)
+        closedir(dir);
+
+    g_mutex_lock(&(data->mutex));
+    if (maildir)
+        g_ptr_array_add(data->result, directory);
+    else
+        free_find_entry(directory);
+    data->pending -= 1;
+    if (!data->pending)
+        g_cond_signal(&(data->cond));
+    g_mutex_unlock(&(data->mutex));
+}
+
+
+// directories are ordered as `mdirs` prints them - in order of arguments and
+// readdir order, with each directory before its subdirectories
+static gint compare_entries(gconstpointer a, gconstpointer b) {
+    const find_entry_t *x = *(const find_entry_t **)a;
+    const find_entry_t *y = *(const find_entry_t **)b;
+
+    for (guint i = 0; i < x->depth && i < y->depth; ++i) {
+        if (x->position[i] != y->position[i])
+            return (x->position[i] > y->position[i] ? 1 : -1);
+    }
+
+    return (x->depth > y->depth) - (x->depth < y->depth);
+}
+
+
+// unique part of message file name, which is not changed by flag changes
+gchar *mbgui_maildir_get_key(const gchar *path) {
+    const gchar *name = strrchr(path, '/');
+    name = (name ? name + 1 : path);
+    return g_strndup(name, strcspn(name, ":"));
+}
+
+
+const gchar *mbgui_maildir_get_flags(const gchar *name) {
+    const gchar *info = strstr(name, ":2,");
+    return (info ? info + 3 : "");
+}
+
+
+gboolean mbgui_maildir_has_flag(const gchar *name, gchar flag) {
+    return strchr(mbgui_maildir_get_flags(name), flag) != NULL;
+}
+
+
+mbgui_message_status_t mbgui_maildir_get_status(const gchar *name) {
+    const gchar *flags = mbgui_maildir_get_flags(name);
+
+    if (strchr(flags, 'T'))
+        return MBGUI_MSG_STATUS_TRASHED;
+
+    if (strchr(flags, 'F'))
+        return MBGUI_MSG_STATUS_FLAGGED;
+
+    if (!strchr(flags, 'S'))
+        return MBGUI_MSG_STATUS_UNSEEN;
+
+    return MBGUI_MSG_STATUS_SEEN;
+}
+
+
+// path of message after flag is set or cleared - flags are kept in ASCII
+// order and message is moved from new/ to cur/, as it was seen by client
+gchar *mbgui_maildir_get_flagged_path(const gchar *path, gchar flag,
+                                      gboolean set) {
+    gchar *subdirectory = g_path_get_dirname(path);
+    gchar *directory = g_path_get_dirname(subdirectory);
+    gchar *key = mbgui_maildir_get_key(path);
+    const gchar *name = strrchr(path, '/');
+    const gchar *flags = mbgui_maildir_get_flags(name ? name + 1 : path);
+
+    GString *new_name = g_string_new(key);
+    g_string_append(new_name, ":2,");
+    for (gchar c = '!'; c <= '~'; ++c) {
+        if (c == flag ? set : strchr(flags, c) != NULL)
+            g_string_append_c(new_name, c);
+    }
+
+    gchar *result = g_build_filename(directory, "cur", new_name->str, NULL);
+
+    g_string_free(new_name, TRUE);
+    g_free(key);
+    g_free(directory);
+    g_free(subdirectory);
+    return result;
+}
+
+
+// path of message moved to another Maildir, with the same subdirectory and
+// file name
+gchar *mbgui_maildir_get_moved_path(const gchar *path,
+                                    const gchar *directory) {
+    gchar *parent = g_path_get_dirname(path);
+    gchar *subdirectory = g_path_get_basename(parent);
+    gchar *name = g_path_get_basename(path);
+
+    gchar *result = g_build_filename(directory, subdirectory, name, NULL);
+
+    g_free(name);
+    g_free(subdirectory);
+    g_free(parent);
+    return result;
+}
+
+
+void mbgui_maildir_list(const gchar *directory, mbgui_maildir_list_cb_t cb,
+                        gpointer user_data) {
+    list_subdirectory(directory, "new", cb, user_data);
+    list_subdirectory(directory, "cur", cb, user_data);
+}
+
+
+void mbgui_maildir_count(const gchar *directory, gsize *unseen, gsize *total) {
+    gsize counts[2] = {0, 0};
+    mbgui_maildir_list(directory, on_count_entry, counts);
+    *unseen = counts[0];
+    *total = counts[1];
+}
+
+
+GPtrArray *mbgui_maildir_find(gchar **directories, GCancellable *cancellable) {
+    find_data_t data;
+    data.cancellable = cancellable;
+    data.pool = g_thread_pool_new(find_directory, &data,
+                                  g_get_num_processors(), FALSE, NULL);
+    g_mutex_init(&(data.mutex));
+    g_cond_init(&(data.cond));
+    data.pending = 0;
+    data.result = g_ptr_array_new();
+
+    for (guint i = 0; directories[i]; ++i)
+        push_directory(&data, NULL, i, directories[i]);
+
+    g_mutex_lock(&(data.mutex));
+    while (data.pending)
+        g_cond_wait(&(data.cond), &(data.mutex));
+    g_mutex_unlock(&(data.mutex));
+
+    if (data.pool)
+        g_thread_pool_free(data.pool, FALSE, TRUE);
+
+    g_ptr_array_sort(data.result, compare_entries);
+
+    // Maildir reachable through several paths is reported once, with the
+    // first of them, so result does not depend on order of scanning
+    GHashTable *visited = g_hash_table_new(g_str_hash, g_str_equal);
+    GPtrArray *result = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < data.result->len; ++i) {
+        find_entry_t *entry = g_ptr_array_index(data.result, i);
+        if (g_hash_table_add(visited, entry->real[entry->depth - 1])) {
+            g_ptr_array_add(result, entry->path);
+            entry->path = NULL;
+        }
+    }
+
+    g_hash_table_destroy(visited);
+    g_ptr_array_foreach(data.result, (GFunc)free_find_entry, NULL);
+    g_ptr_array_free(data.result, TRUE);
+    g_cond_clear(&(data.cond));
+    g_mutex_clear(&(data.mutex));
+    return result;
+}
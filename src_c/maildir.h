@@ -0,0 +1,25 @@
+#ifndef MBGUI_MAILDIR_H
+#define MBGUI_MAILDIR_H
+
+#include <gio/gio.h>
+#include "mblaze.h"
+
+
+typedef void (*mbgui_maildir_list_cb_t)(const gchar *subdirectory,
+                                        const gchar *name, gpointer user_data);
+
+
+gchar *mbgui_maildir_get_key(const gchar *path);
+const gchar *mbgui_maildir_get_flags(const gchar *name);
+gboolean mbgui_maildir_has_flag(const gchar *name, gchar flag);
+mbgui_message_status_t mbgui_maildir_get_status(const gchar *name);
+gchar *mbgui_maildir_get_flagged_path(const gchar *path, gchar flag,
+                                      gboolean set);
+gchar *mbgui_maildir_get_moved_path(const gchar *path,
+                                    const gchar *directory);
+void mbgui_maildir_list(const gchar *directory, mbgui_maildir_list_cb_t cb,
+                        gpointer user_data);
+void mbgui_maildir_count(const gchar *directory, gsize *unseen, gsize *total);
+GPtrArray *mbgui_maildir_find(gchar **directories, GCancellable *cancellable);
+
+#endif
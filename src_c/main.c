@@ -1,37 +1,81 @@
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
+#include "maildir.h"
 #include "mblaze.h"
+#include "model.h"
+#include "scheduler.h"
+#include "trace.h"
+
+
+#define MESSAGES_IDLE_BUDGET 8000
+#define MESSAGES_CHUNK_SIZE 500
+#define MESSAGES_ADDED_DELAY 200
+#define MESSAGE_DEFAULT_LIMIT (1024 * 1024)
+#define MESSAGE_PREFETCH_COUNT 8
+#define APPLICATION_ID "org.mbgui.mbgui"
 
 
 typedef struct {
     GtkTreeStore *directories_store;
     GtkTreeSelection *directories_selection;
-    GtkTreeStore *messages_store;
+    GtkTreeView *messages_view;
+    MbguiMessagesModel *messages_model;
     GtkTreeSelection *messages_selection;
+    gchar *messages_directory;
+    gchar *messages_query;
+    gchar *messages_filter;
+    gint messages_sort_column;
+    GtkSortType messages_sort_order;
+    GtkWidget *move_menu;
+    GCancellable *messages_cancellable;
+    GQueue messages_batches;
+    mbgui_message_t *messages_next;
+    guint messages_source;
+    GPtrArray *messages_added;
+    guint messages_added_source;
     GtkTextBuffer *message_buffer;
+    GtkWidget *message_rest_button;
+    GtkWidget *message_parts_box;
+    mbgui_message_part_t *message_parts;
+    GCancellable *message_parts_cancellable;
+    gchar *message_path;
+    GCancellable *message_cancellable;
+    gsize message_limit;
+    gsize message_rest;
 } app_data_t;
 
 typedef struct {
-    grefcount rc;
     GtkTreeStore *store;
     GtkTreeIter iter;
-} tree_store_iter_data_t;
-
-
-static gchar *get_message_status_icon(mbgui_message_status_t status) {
-    switch (status) {
-    case MBGUI_MSG_STATUS_SEEN:
-        return "mail-read";
-    case MBGUI_MSG_STATUS_FLAGGED:
-        return "starred";
-    case MBGUI_MSG_STATUS_UNSEEN:
-        return "mail-unread";
-    case MBGUI_MSG_STATUS_TRASHED:
-        return "user-trash";
-    case MBGUI_MSG_STATUS_VIRTUAL:
-        return NULL;
-    }
-    return NULL;
-}
+    gboolean counted;
+    gsize unseen;
+    gsize total;
+    GHashTable *pending;
+    mbgui_watch_t *watch;
+    GCancellable *cancellable;
+} directory_data_t;
+
+typedef struct {
+    gchar *directory;
+    gchar *new_directory;
+} operation_data_t;
+
+typedef struct {
+    gchar *path;
+    mbgui_message_part_t part;
+} save_part_data_t;
+
+
+// windows of the same instance opened with the same arguments share
+// directories store, together with its counts and watches
+static GHashTable *directories_stores = NULL;
+static GList *windows = NULL;
+
+// opened parts are saved to temporary directory of instance, which is removed
+// at exit
+static gchar *parts_directory = NULL;
+static guint parts_count = 0;
 
 
 static gchar *get_selected_directory(app_data_t *data) {
@@ -49,37 +93,378 @@ static gchar *get_selected_directory(app_data_t *data) {
 }
 
 
+// message is previewed only if exactly one row is selected
+static gboolean get_selected_row(app_data_t *data, GtkTreeIter *iter) {
+    if (gtk_tree_selection_count_selected_rows(data->messages_selection) != 1)
+        return FALSE;
+
+    GList *rows =
+        gtk_tree_selection_get_selected_rows(data->messages_selection, NULL);
+    gboolean result = gtk_tree_model_get_iter(
+        GTK_TREE_MODEL(data->messages_model), iter, rows->data);
+    g_list_free_full(rows, (GDestroyNotify)gtk_tree_path_free);
+    return result;
+}
+
+
+// virtual rows stand for missing thread parents and have nothing to preview
 static gchar *get_selected_message(app_data_t *data) {
     GtkTreeIter iter;
 
-    if (!gtk_tree_selection_get_selected(
-            data->messages_selection, (GtkTreeModel **)&(data->messages_store),
-            &iter))
+    if (!get_selected_row(data, &iter))
         return NULL;
 
-    gchar *result;
-    gtk_tree_model_get(GTK_TREE_MODEL(data->messages_store), &iter, 0, &result,
-                       -1);
-    return result;
+    mbgui_message_t *message =
+        mbgui_messages_model_get_message(data->messages_model, &iter);
+    if (message->status == MBGUI_MSG_STATUS_VIRTUAL)
+        return NULL;
+
+    return g_strdup(message->path);
+}
+
+
+static void cancel_request(GCancellable **cancellable) {
+    if (!*cancellable)
+        return;
+
+    g_cancellable_cancel(*cancellable);
+    g_clear_object(cancellable);
 }
 
 
-static void on_get_message(gchar *path, gchar *message, gpointer user_data) {
+static void on_get_message(gchar *path, gchar *chunk, gboolean done,
+                           gsize rest, gpointer user_data) {
     app_data_t *data = user_data;
+    gint64 trace_begin = mbgui_trace_begin();
 
-    if (!message || !message[0])
+    GtkTextIter iter;
+    gtk_text_buffer_get_end_iter(data->message_buffer, &iter);
+    gtk_text_buffer_insert(data->message_buffer, &iter, chunk, -1);
+    mbgui_trace_end("insert_message", 0, path, trace_begin);
+
+    if (done && rest) {
+        data->message_rest = rest;
+        gtk_widget_show(data->message_rest_button);
+    }
+}
+
+
+static void request_message(app_data_t *data, gsize offset, gsize limit) {
+    cancel_request(&(data->message_cancellable));
+    data->message_rest = 0;
+    gtk_widget_hide(data->message_rest_button);
+
+    if (!data->message_path)
         return;
 
-    gchar *selected_message = get_selected_message(data);
-    if (!selected_message)
+    data->message_cancellable = g_cancellable_new();
+    mbgui_get_message(data->message_path, offset, limit,
+                      data->message_cancellable, on_get_message, data);
+}
+
+
+static gboolean get_next_row(app_data_t *data, GtkTreeIter *iter) {
+    GtkTreeModel *model = GTK_TREE_MODEL(data->messages_model);
+    GtkTreeIter next;
+
+    GtkTreePath *path = gtk_tree_model_get_path(model, iter);
+    gboolean expanded = gtk_tree_view_row_expanded(data->messages_view, path);
+    gtk_tree_path_free(path);
+
+    if (expanded && gtk_tree_model_iter_children(model, &next, iter)) {
+        *iter = next;
+        return TRUE;
+    }
+
+    for (GtkTreeIter current = *iter;;) {
+        next = current;
+        if (gtk_tree_model_iter_next(model, &next)) {
+            *iter = next;
+            return TRUE;
+        }
+
+        if (!gtk_tree_model_iter_parent(model, &next, &current))
+            return FALSE;
+        current = next;
+    }
+}
+
+
+static gboolean get_previous_row(app_data_t *data, GtkTreeIter *iter) {
+    GtkTreeModel *model = GTK_TREE_MODEL(data->messages_model);
+    GtkTreeIter previous = *iter;
+
+    if (!gtk_tree_model_iter_previous(model, &previous)) {
+        GtkTreeIter child = *iter;
+        return gtk_tree_model_iter_parent(model, iter, &child);
+    }
+
+    for (;;) {
+        GtkTreePath *path = gtk_tree_model_get_path(model, &previous);
+        gboolean expanded =
+            gtk_tree_view_row_expanded(data->messages_view, path);
+        gtk_tree_path_free(path);
+
+        GtkTreeIter last;
+        gint count = gtk_tree_model_iter_n_children(model, &previous);
+        if (!expanded ||
+            !gtk_tree_model_iter_nth_child(model, &last, &previous, count - 1))
+            break;
+        previous = last;
+    }
+
+    *iter = previous;
+    return TRUE;
+}
+
+
+static void add_prefetch_path(app_data_t *data, GPtrArray *paths,
+                              GtkTreeIter *iter) {
+    if (paths->len >= MESSAGE_PREFETCH_COUNT)
         return;
 
-    int not_selected = g_strcmp0(path, selected_message);
-    g_free(selected_message);
-    if (not_selected)
+    mbgui_message_t *message =
+        mbgui_messages_model_get_message(data->messages_model, iter);
+    if (message->status == MBGUI_MSG_STATUS_VIRTUAL ||
+        !g_strcmp0(message->path, data->message_path))
         return;
 
-    gtk_text_buffer_set_text(data->message_buffer, message, -1);
+    for (guint i = 0; i < paths->len; ++i) {
+        if (!g_strcmp0(g_ptr_array_index(paths, i), message->path))
+            return;
+    }
+
+    g_ptr_array_add(paths, (gpointer)message->path);
+}
+
+
+static void prefetch_messages(app_data_t *data) {
+    GPtrArray *paths = g_ptr_array_new();
+    GtkTreeModel *model = GTK_TREE_MODEL(data->messages_model);
+    GtkTreeIter iter;
+
+    if (data->messages_model && get_selected_row(data, &iter)) {
+        GtkTreeIter neighbour = iter;
+        if (get_next_row(data, &neighbour))
+            add_prefetch_path(data, paths, &neighbour);
+
+        neighbour = iter;
+        if (get_previous_row(data, &neighbour))
+            add_prefetch_path(data, paths, &neighbour);
+
+        GtkTreeIter parent;
+        if (gtk_tree_model_iter_parent(model, &parent, &iter) &&
+            gtk_tree_model_iter_children(model, &neighbour, &parent)) {
+            do
+                add_prefetch_path(data, paths, &neighbour);
+            while (paths->len < MESSAGE_PREFETCH_COUNT &&
+                   gtk_tree_model_iter_next(model, &neighbour));
+        }
+    }
+
+    // also drops pending prefetches of previous selection
+    g_ptr_array_add(paths, NULL);
+    mbgui_prefetch_messages((gchar **)paths->pdata, data->message_limit);
+    g_ptr_array_free(paths, TRUE);
+}
+
+
+static void on_message_rest_clicked(GtkButton *self, gpointer user_data) {
+    app_data_t *data = user_data;
+
+    request_message(data, data->message_rest, 0);
+}
+
+
+static void on_message_part_opened(gchar *output, gboolean success,
+                                   gpointer user_data) {
+    if (!success)
+        return;
+
+    GError *error = NULL;
+    gchar *uri = g_filename_to_uri(output, NULL, NULL);
+    if (!uri || !g_app_info_launch_default_for_uri(uri, NULL, &error)) {
+        g_printerr("can not open %s: %s\n", output,
+                   (error ? error->message : "invalid path"));
+        g_clear_error(&error);
+    }
+    g_free(uri);
+}
+
+
+static void remove_directory(const gchar *path) {
+    GDir *dir = g_dir_open(path, 0, NULL);
+    if (dir) {
+        for (const gchar *name = g_dir_read_name(dir); name;
+             name = g_dir_read_name(dir)) {
+            gchar *child = g_build_filename(path, name, NULL);
+            if (g_file_test(child, G_FILE_TEST_IS_DIR) &&
+                !g_file_test(child, G_FILE_TEST_IS_SYMLINK))
+                remove_directory(child);
+            else
+                g_remove(child);
+            g_free(child);
+        }
+        g_dir_close(dir);
+    }
+
+    g_remove(path);
+}
+
+
+// opened part is saved to new subdirectory of instance temporary directory,
+// so it keeps its name
+static void on_message_part_open_clicked(GtkButton *self, gpointer user_data) {
+    app_data_t *data = user_data;
+    mbgui_message_part_t *part = g_object_get_data(G_OBJECT(self), "part");
+
+    GError *error = NULL;
+    if (!parts_directory) {
+        parts_directory = g_dir_make_tmp("mbgui-XXXXXX", &error);
+        if (!parts_directory) {
+            g_printerr("%s\n", error->message);
+            g_error_free(error);
+            return;
+        }
+    }
+
+    gchar *name = g_strdup_printf("%u", parts_count++);
+    gchar *directory = g_build_filename(parts_directory, name, NULL);
+    g_free(name);
+    if (g_mkdir(directory, 0700)) {
+        g_printerr("can not create %s: %s\n", directory, g_strerror(errno));
+        g_free(directory);
+        return;
+    }
+
+    gchar *output = g_build_filename(
+        directory, (part->name ? part->name : "attachment"), NULL);
+    mbgui_save_message_part(data->message_path, part, output,
+                            on_message_part_opened, NULL);
+
+    g_free(output);
+    g_free(directory);
+}
+
+
+static void on_message_part_save_response(GtkDialog *self, gint response_id,
+                                          gpointer user_data) {
+    save_part_data_t *data = user_data;
+
+    if (response_id == GTK_RESPONSE_ACCEPT) {
+        gchar *output = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(self));
+        mbgui_save_message_part(data->path, &(data->part), output, NULL,
+                                NULL);
+        g_free(output);
+    }
+
+    g_free(data->part.encoding);
+    g_free(data->path);
+    g_free(data);
+    gtk_widget_destroy(GTK_WIDGET(self));
+}
+
+
+static void on_message_part_save_clicked(GtkButton *self, gpointer user_data) {
+    app_data_t *data = user_data;
+    mbgui_message_part_t *part = g_object_get_data(G_OBJECT(self), "part");
+
+    GtkWidget *dialog = gtk_file_chooser_dialog_new(
+        "Save attachment",
+        GTK_WINDOW(gtk_widget_get_toplevel(GTK_WIDGET(self))),
+        GTK_FILE_CHOOSER_ACTION_SAVE, "_Cancel", GTK_RESPONSE_CANCEL, "_Save",
+        GTK_RESPONSE_ACCEPT, NULL);
+    gtk_file_chooser_set_do_overwrite_confirmation(GTK_FILE_CHOOSER(dialog),
+                                                   TRUE);
+    if (part->name)
+        gtk_file_chooser_set_current_name(GTK_FILE_CHOOSER(dialog),
+                                          part->name);
+
+    // selected message and its parts can change while dialog is displayed
+    save_part_data_t *save_data = g_malloc(sizeof(save_part_data_t));
+    save_data->path = g_strdup(data->message_path);
+    save_data->part = *part;
+    save_data->part.type = NULL;
+    save_data->part.name = NULL;
+    save_data->part.encoding = g_strdup(part->encoding);
+    save_data->part.next = NULL;
+
+    g_signal_connect(dialog, "response",
+                     G_CALLBACK(on_message_part_save_response), save_data);
+    gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
+    gtk_widget_show(dialog);
+}
+
+
+static void add_message_part(app_data_t *data, mbgui_message_part_t *part) {
+    gchar *size = g_format_size(part->size);
+    gchar *text = g_strdup_printf(
+        "%s (%s, %s)", (part->name ? part->name : "attachment"), part->type,
+        size);
+
+    GtkWidget *row = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+
+    GtkWidget *label = gtk_label_new(text);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_box_pack_start(GTK_BOX(row), label, TRUE, TRUE, 5);
+
+    GtkWidget *open_button = gtk_button_new_with_label("Open");
+    g_object_set_data(G_OBJECT(open_button), "part", part);
+    g_signal_connect(open_button, "clicked",
+                     G_CALLBACK(on_message_part_open_clicked), data);
+    gtk_box_pack_start(GTK_BOX(row), open_button, FALSE, FALSE, 0);
+
+    GtkWidget *save_button = gtk_button_new_with_label("Save");
+    g_object_set_data(G_OBJECT(save_button), "part", part);
+    g_signal_connect(save_button, "clicked",
+                     G_CALLBACK(on_message_part_save_clicked), data);
+    gtk_box_pack_start(GTK_BOX(row), save_button, FALSE, FALSE, 0);
+
+    gtk_box_pack_start(GTK_BOX(data->message_parts_box), row, FALSE, FALSE,
+                       0);
+    gtk_widget_show_all(row);
+
+    g_free(text);
+    g_free(size);
+}
+
+
+static void on_get_message_parts(gchar *path, mbgui_message_part_t *parts,
+                                 gpointer user_data) {
+    app_data_t *data = user_data;
+
+    data->message_parts = parts;
+    for (mbgui_message_part_t *part = parts; part; part = part->next)
+        add_message_part(data, part);
+
+    if (parts)
+        gtk_widget_show(data->message_parts_box);
+}
+
+
+static void clear_message_parts(app_data_t *data) {
+    cancel_request(&(data->message_parts_cancellable));
+
+    gtk_container_foreach(GTK_CONTAINER(data->message_parts_box),
+                          (GtkCallback)gtk_widget_destroy, NULL);
+    gtk_widget_hide(data->message_parts_box);
+
+    mbgui_free_message_parts(data->message_parts);
+    data->message_parts = NULL;
+}
+
+
+// attachments are listed from structure of message, without decoding them
+static void request_message_parts(app_data_t *data) {
+    clear_message_parts(data);
+
+    if (!data->message_path)
+        return;
+
+    data->message_parts_cancellable = g_cancellable_new();
+    mbgui_get_message_parts(data->message_path,
+                            data->message_parts_cancellable,
+                            on_get_message_parts, data);
 }
 
 
@@ -89,32 +474,73 @@ static void on_messages_selection_changed(GtkTreeSelection *self,
 
     gtk_text_buffer_set_text(data->message_buffer, "", 0);
 
-    gchar *message = get_selected_message(data);
-    if (!message)
-        return;
+    g_free(data->message_path);
+    data->message_path = get_selected_message(data);
 
-    // TODO chech virtual
+    request_message(data, 0, data->message_limit);
+    request_message_parts(data);
+    prefetch_messages(data);
+}
 
-    mbgui_get_message(message, on_get_message, data);
-    g_free(message);
+
+static void add_selected_path(GtkTreeModel *model, GtkTreePath *path,
+                              GtkTreeIter *iter, gpointer user_data) {
+    GPtrArray *paths = user_data;
+
+    mbgui_message_t *message =
+        mbgui_messages_model_get_message(MBGUI_MESSAGES_MODEL(model), iter);
+    if (message->status != MBGUI_MSG_STATUS_VIRTUAL)
+        g_ptr_array_add(paths, g_strdup(message->path));
 }
 
 
-static gboolean on_messages_key_press(GtkWidget *self, GdkEventKey event,
+static GPtrArray *get_selected_paths(app_data_t *data) {
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    gtk_tree_selection_selected_foreach(data->messages_selection,
+                                        add_selected_path, paths);
+    return paths;
+}
+
+
+static void flag_selected_messages(app_data_t *data, gchar flag,
+                                   gboolean set);
+static void popup_move_menu(app_data_t *data, GdkEventKey *event);
+
+
+// keys follow mflag options
+static gboolean on_messages_key_press(GtkWidget *self, GdkEventKey *event,
                                       gpointer user_data) {
     app_data_t *data = user_data;
 
-    // TODO
-    g_print(">> %x\n", event.keyval);
+    if (event->state & (GDK_CONTROL_MASK | GDK_MOD1_MASK))
+        return FALSE;
 
-    if (event.keyval == GDK_KEY_Return) {
-        gchar *path = get_selected_message(data);
+    switch (event->keyval) {
+    case GDK_KEY_Return: {
+        GPtrArray *paths = get_selected_paths(data);
+        for (guint i = 0; i < paths->len; ++i)
+            g_print("%s\n", (gchar *)g_ptr_array_index(paths, i));
+        g_ptr_array_free(paths, TRUE);
+        return TRUE;
+    }
 
-        if (path) {
-            g_print("%s\n", path);
-            g_free(path);
-        }
+    case GDK_KEY_s:
+    case GDK_KEY_S:
+        flag_selected_messages(data, 'S', event->keyval == GDK_KEY_s);
+        return TRUE;
+
+    case GDK_KEY_f:
+    case GDK_KEY_F:
+        flag_selected_messages(data, 'F', event->keyval == GDK_KEY_f);
+        return TRUE;
+
+    case GDK_KEY_t:
+    case GDK_KEY_T:
+        flag_selected_messages(data, 'T', event->keyval == GDK_KEY_t);
+        return TRUE;
 
+    case GDK_KEY_m:
+        popup_move_menu(data, event);
         return TRUE;
     }
 
@@ -122,58 +548,321 @@ static gboolean on_messages_key_press(GtkWidget *self, GdkEventKey event,
 }
 
 
-static void add_message(GtkTreeStore *store, mbgui_message_t *message,
-                        GtkTreeIter *parent) {
+static void add_expanded_message(GtkTreeView *view, GtkTreePath *path,
+                                 gpointer user_data) {
+    GtkTreeModel *model = gtk_tree_view_get_model(view);
     GtkTreeIter iter;
-    gtk_tree_store_append(store, &iter, parent);
-    gtk_tree_store_set(store, &iter, 0, message->path->str, 1,
-                       get_message_status_icon(message->status), 2,
-                       message->subject->str, 3, message->sender->str, 4,
-                       message->date->str, -1);
+    if (gtk_tree_model_get_iter(model, &iter, path))
+        g_ptr_array_add(user_data, mbgui_messages_model_get_message(
+                                       MBGUI_MESSAGES_MODEL(model), &iter));
+}
+
+
+static void add_selected_message(GtkTreeModel *model, GtkTreePath *path,
+                                 GtkTreeIter *iter, gpointer user_data) {
+    g_ptr_array_add(user_data, mbgui_messages_model_get_message(
+                                   MBGUI_MESSAGES_MODEL(model), iter));
+}
+
+
+// rows, whose visibility changed, are deleted and inserted again by model, so
+// their expansion and selection are saved before model is updated
+static void save_messages_view(app_data_t *data, GPtrArray *expanded,
+                               GPtrArray *selected) {
+    g_signal_handlers_block_by_func(data->messages_selection,
+                                    on_messages_selection_changed, data);
+    gtk_tree_view_map_expanded_rows(data->messages_view, add_expanded_message,
+                                    expanded);
+    gtk_tree_selection_selected_foreach(data->messages_selection,
+                                        add_selected_message, selected);
+}
+
+
+// selected messages, which are still displayed, stay selected and preview
+// is not changed
+static void restore_messages_view(app_data_t *data, GPtrArray *expanded,
+                                  GPtrArray *selected) {
+    GtkTreeModel *model = GTK_TREE_MODEL(data->messages_model);
+    GtkTreeIter iter;
+
+    // parents are expanded before their children
+    for (guint i = 0; i < expanded->len; ++i) {
+        if (!mbgui_messages_model_find_message(data->messages_model,
+                                               g_ptr_array_index(expanded, i),
+                                               &iter))
+            continue;
+
+        GtkTreePath *path = gtk_tree_model_get_path(model, &iter);
+        gtk_tree_view_expand_row(data->messages_view, path, FALSE);
+        gtk_tree_path_free(path);
+    }
+
+    gtk_tree_selection_unselect_all(data->messages_selection);
+    for (guint i = 0; i < selected->len; ++i) {
+        if (mbgui_messages_model_find_message(data->messages_model,
+                                              g_ptr_array_index(selected, i),
+                                              &iter))
+            gtk_tree_selection_select_iter(data->messages_selection, &iter);
+    }
+
+    g_signal_handlers_unblock_by_func(data->messages_selection,
+                                      on_messages_selection_changed, data);
+}
+
 
-    for (mbgui_message_t *child = message->children; child; child = child->next)
-        add_message(store, child, &iter);
+static void scroll_to_message(app_data_t *data) {
+    GtkTreeIter iter;
+    if (!data->message_path ||
+        !mbgui_messages_model_find(data->messages_model, data->message_path,
+                                   &iter))
+        return;
+
+    GtkTreePath *path =
+        gtk_tree_model_get_path(GTK_TREE_MODEL(data->messages_model), &iter);
+    gtk_tree_view_scroll_to_cell(data->messages_view, path, NULL, FALSE, 0, 0);
+    gtk_tree_path_free(path);
 }
 
 
-static void on_get_messages(gchar *directory, mbgui_message_t *messages,
+static gboolean on_messages_idle(gpointer user_data) {
+    app_data_t *data = user_data;
+    gint64 trace_begin = mbgui_trace_begin();
+    gint64 begin = g_get_monotonic_time();
+
+    // batches are sorted in thread and merged into sorted model by chunks -
+    // appending stops when frame budget is spent
+    while (!g_queue_is_empty(&(data->messages_batches)) &&
+           g_get_monotonic_time() - begin < MESSAGES_IDLE_BUDGET) {
+        mbgui_message_t *messages = data->messages_next;
+        if (!messages)
+            messages = g_queue_peek_head(&(data->messages_batches));
+
+        data->messages_next = mbgui_messages_model_append(
+            data->messages_model, messages, MESSAGES_CHUNK_SIZE);
+        if (!data->messages_next)
+            g_queue_pop_head(&(data->messages_batches));
+    }
+
+    mbgui_trace_end("insert_messages", 0, data->messages_directory,
+                    trace_begin);
+
+    if (!g_queue_is_empty(&(data->messages_batches)))
+        return G_SOURCE_CONTINUE;
+
+    data->messages_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+
+static MbguiMessagesModel *get_messages_model(app_data_t *data) {
+    if (!data->messages_model) {
+        data->messages_model = mbgui_messages_model_new();
+        mbgui_messages_model_set_filter(data->messages_model,
+                                        data->messages_filter);
+        mbgui_messages_model_set_sort(data->messages_model,
+                                      data->messages_sort_column,
+                                      data->messages_sort_order);
+        gtk_tree_view_set_model(data->messages_view,
+                                GTK_TREE_MODEL(data->messages_model));
+    }
+
+    return data->messages_model;
+}
+
+
+static void clear_messages(app_data_t *data) {
+    if (data->messages_source) {
+        g_source_remove(data->messages_source);
+        data->messages_source = 0;
+    }
+
+    if (data->messages_added_source) {
+        g_source_remove(data->messages_added_source);
+        data->messages_added_source = 0;
+    }
+
+    g_queue_clear(&(data->messages_batches));
+    data->messages_next = NULL;
+    g_ptr_array_set_size(data->messages_added, 0);
+    g_clear_pointer(&(data->messages_directory), g_free);
+
+    cancel_request(&(data->messages_cancellable));
+
+    if (data->messages_model) {
+        gtk_tree_view_set_model(data->messages_view, NULL);
+        g_object_unref(data->messages_model);
+        data->messages_model = NULL;
+    }
+}
+
+
+static void push_messages(mbgui_message_t *messages, gpointer user_data) {
+    app_data_t *data = user_data;
+
+    g_queue_push_tail(&(data->messages_batches), messages);
+
+    if (!data->messages_source)
+        data->messages_source = g_idle_add(on_messages_idle, data);
+}
+
+
+static void on_get_messages(gchar *directory, mbgui_message_arena_t *arena,
+                            mbgui_message_t *messages, gboolean done,
                             gpointer user_data) {
     app_data_t *data = user_data;
 
-    gchar *selected_directory = get_selected_directory(data);
-    if (!selected_directory)
-        return;
+    if (messages) {
+        mbgui_messages_model_add_arena(get_messages_model(data), arena);
+
+        if (data->messages_sort_column >= 0)
+            mbgui_messages_sort(arena, messages, data->messages_sort_column,
+                                data->messages_sort_order,
+                                data->messages_cancellable, push_messages,
+                                data);
+        else
+            push_messages(messages, data);
+    }
+}
+
+
+static void on_scan_messages(gchar *directory, mbgui_message_arena_t *arena,
+                             mbgui_message_t *messages, gboolean done,
+                             gpointer user_data) {
+    app_data_t *data = user_data;
+
+    if (messages) {
+        gint64 trace_begin = mbgui_trace_begin();
+        MbguiMessagesModel *model = get_messages_model(data);
+        mbgui_messages_model_add_arena(model, arena);
+
+        mbgui_messages_model_append(model, messages, G_MAXUINT);
+
+        mbgui_trace_end("insert_scanned_messages", 0, directory, trace_begin);
+    }
+}
 
-    int not_selected = g_strcmp0(directory, selected_directory);
-    g_free(selected_directory);
-    if (not_selected)
+
+static gboolean on_messages_added_timeout(gpointer user_data) {
+    app_data_t *data = user_data;
+
+    data->messages_added_source = 0;
+
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < data->messages_added->len; ++i) {
+        gchar *path = g_ptr_array_index(data->messages_added, i);
+        if (!data->messages_model ||
+            !mbgui_messages_model_contains(data->messages_model, path))
+            g_ptr_array_add(paths, g_strdup(path));
+    }
+    g_ptr_array_set_size(data->messages_added, 0);
+
+    if (paths->len) {
+        g_ptr_array_add(paths, NULL);
+        mbgui_scan_messages(data->messages_directory, (gchar **)paths->pdata,
+                            data->messages_cancellable, on_scan_messages,
+                            data);
+    }
+
+    g_ptr_array_free(paths, TRUE);
+    return G_SOURCE_REMOVE;
+}
+
+
+static void load_messages(app_data_t *data) {
+    clear_messages(data);
+
+    gchar *directory = get_selected_directory(data);
+    if (!directory)
         return;
 
-    for (mbgui_message_t *message = messages; message; message = message->next)
-        add_message(data->messages_store, message, NULL);
+    data->messages_cancellable = g_cancellable_new();
+    if (data->messages_query)
+        mbgui_search_messages(directory, data->messages_query,
+                              data->messages_cancellable, on_get_messages,
+                              data);
+    else
+        mbgui_get_messages(directory, data->messages_cancellable,
+                           on_get_messages, data);
+    data->messages_directory = directory;
 }
 
 
 static void on_directories_selection_changed(GtkTreeSelection *self,
                                              gpointer user_data) {
+    load_messages(user_data);
+}
+
+
+static void on_messages_search_changed(GtkSearchEntry *self,
+                                       gpointer user_data) {
     app_data_t *data = user_data;
 
-    gtk_tree_store_clear(data->messages_store);
+    const gchar *query = gtk_entry_get_text(GTK_ENTRY(self));
+    g_free(data->messages_query);
+    data->messages_query = (*query ? g_strdup(query) : NULL);
 
-    gchar *directory = get_selected_directory(data);
-    if (!directory)
+    load_messages(data);
+}
+
+
+static void on_messages_filter_changed(GtkEditable *self,
+                                       gpointer user_data) {
+    app_data_t *data = user_data;
+
+    const gchar *filter = gtk_entry_get_text(GTK_ENTRY(self));
+    g_free(data->messages_filter);
+    data->messages_filter = (*filter ? g_strdup(filter) : NULL);
+
+    if (!data->messages_model)
         return;
 
-    mbgui_get_messages(directory, on_get_messages, data);
-    g_free(directory);
+    gint64 trace_begin = mbgui_trace_begin();
+    GPtrArray *expanded = g_ptr_array_new();
+    GPtrArray *selected = g_ptr_array_new();
+    save_messages_view(data, expanded, selected);
+    mbgui_messages_model_set_filter(data->messages_model,
+                                    data->messages_filter);
+    restore_messages_view(data, expanded, selected);
+    scroll_to_message(data);
+    g_ptr_array_free(selected, TRUE);
+    g_ptr_array_free(expanded, TRUE);
+    mbgui_trace_end("filter_messages", 0, data->messages_filter, trace_begin);
 }
 
 
-static GtkWidget *create_directories(app_data_t *data) {
-    data->directories_store =
-        gtk_tree_store_new(5, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
-                           G_TYPE_STRING, G_TYPE_STRING);
+static void on_messages_column_clicked(GtkTreeViewColumn *self,
+                                       gpointer user_data) {
+    app_data_t *data = user_data;
+    gint column = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(self), "column"));
+
+    // repeated click reverses order
+    data->messages_sort_order =
+        (data->messages_sort_column == column &&
+                 data->messages_sort_order == GTK_SORT_ASCENDING
+             ? GTK_SORT_DESCENDING
+             : GTK_SORT_ASCENDING);
+    data->messages_sort_column = column;
+
+    GList *columns = gtk_tree_view_get_columns(data->messages_view);
+    for (GList *i = columns; i; i = i->next)
+        gtk_tree_view_column_set_sort_indicator(i->data, i->data == self);
+    g_list_free(columns);
+    gtk_tree_view_column_set_sort_order(self, data->messages_sort_order);
+
+    if (!data->messages_model)
+        return;
 
+    // reordered rows keep their expansion and selection
+    gint64 trace_begin = mbgui_trace_begin();
+    mbgui_messages_model_set_sort(data->messages_model, column,
+                                  data->messages_sort_order);
+    scroll_to_message(data);
+    mbgui_trace_end("sort_messages", 0, data->messages_directory,
+                    trace_begin);
+}
+
+
+static GtkWidget *create_directories(app_data_t *data) {
     GtkCellRenderer *icon_renderer = gtk_cell_renderer_pixbuf_new();
     g_object_set(icon_renderer, "mode", GTK_CELL_RENDERER_MODE_INERT, NULL);
 
@@ -223,11 +912,17 @@ static GtkWidget *create_directories(app_data_t *data) {
 }
 
 
-static GtkWidget *create_messages(app_data_t *data) {
-    data->messages_store =
-        gtk_tree_store_new(5, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING,
-                           G_TYPE_STRING, G_TYPE_STRING);
+static void add_sort_column(app_data_t *data, GtkTreeViewColumn *column,
+                            gint model_column) {
+    g_object_set_data(G_OBJECT(column), "column",
+                      GINT_TO_POINTER(model_column));
+    gtk_tree_view_column_set_clickable(column, TRUE);
+    g_signal_connect(column, "clicked", G_CALLBACK(on_messages_column_clicked),
+                     data);
+}
+
 
+static GtkWidget *create_messages(app_data_t *data) {
     GtkCellRenderer *icon_renderer = gtk_cell_renderer_pixbuf_new();
     g_object_set(icon_renderer, "mode", GTK_CELL_RENDERER_MODE_INERT, NULL);
 
@@ -235,10 +930,29 @@ static GtkWidget *create_messages(app_data_t *data) {
     g_object_set(left_renderer, "xalign", 0.0, "xpad", 5, "mode",
                  GTK_CELL_RENDERER_MODE_INERT, NULL);
 
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+
+    GtkWidget *entries = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 0);
+    gtk_box_pack_start(GTK_BOX(box), entries, FALSE, FALSE, 0);
+
+    // filter is applied on every key press, search waits for typing pause
+    GtkWidget *filter = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(filter), "Filter");
+    g_signal_connect(filter, "changed", G_CALLBACK(on_messages_filter_changed),
+                     data);
+    gtk_box_pack_start(GTK_BOX(entries), filter, TRUE, TRUE, 0);
+
+    GtkWidget *search = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(search), "Search");
+    g_signal_connect(search, "search-changed",
+                     G_CALLBACK(on_messages_search_changed), data);
+    gtk_box_pack_start(GTK_BOX(entries), search, TRUE, TRUE, 0);
+
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_box_pack_start(GTK_BOX(box), scrolled_window, TRUE, TRUE, 0);
 
-    GtkWidget *messages =
-        gtk_tree_view_new_with_model(GTK_TREE_MODEL(data->messages_store));
+    GtkWidget *messages = gtk_tree_view_new();
+    data->messages_view = GTK_TREE_VIEW(messages);
     g_signal_connect(messages, "key-press-event",
                      G_CALLBACK(on_messages_key_press), data);
     gtk_container_add(GTK_CONTAINER(scrolled_window), messages);
@@ -248,43 +962,64 @@ static GtkWidget *create_messages(app_data_t *data) {
     gtk_tree_view_column_set_expand(col_subject, TRUE);
     gtk_tree_view_column_pack_start(col_subject, icon_renderer, FALSE);
     gtk_tree_view_column_set_attributes(col_subject, icon_renderer, "icon-name",
-                                        1, NULL);
+                                        MBGUI_MESSAGES_MODEL_COLUMN_ICON, NULL);
     gtk_tree_view_column_pack_start(col_subject, left_renderer, TRUE);
-    gtk_tree_view_column_set_attributes(col_subject, left_renderer, "text", 2,
+    gtk_tree_view_column_set_attributes(col_subject, left_renderer, "text",
+                                        MBGUI_MESSAGES_MODEL_COLUMN_SUBJECT,
                                         NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(messages), col_subject);
+    add_sort_column(data, col_subject, MBGUI_MESSAGES_MODEL_COLUMN_SUBJECT);
 
     GtkTreeViewColumn *col_sender = gtk_tree_view_column_new_with_attributes(
-        "Sender", left_renderer, "text", 3, NULL);
+        "Sender", left_renderer, "text", MBGUI_MESSAGES_MODEL_COLUMN_SENDER,
+        NULL);
     gtk_tree_view_column_set_sizing(col_sender, GTK_TREE_VIEW_COLUMN_FIXED);
     gtk_tree_view_append_column(GTK_TREE_VIEW(messages), col_sender);
+    add_sort_column(data, col_sender, MBGUI_MESSAGES_MODEL_COLUMN_SENDER);
 
     GtkTreeViewColumn *col_date = gtk_tree_view_column_new_with_attributes(
-        "Date", left_renderer, "text", 4, NULL);
+        "Date", left_renderer, "text", MBGUI_MESSAGES_MODEL_COLUMN_DATE, NULL);
     gtk_tree_view_column_set_sizing(col_date, GTK_TREE_VIEW_COLUMN_FIXED);
     gtk_tree_view_append_column(GTK_TREE_VIEW(messages), col_date);
+    add_sort_column(data, col_date, MBGUI_MESSAGES_MODEL_COLUMN_DATE);
 
     data->messages_selection =
         gtk_tree_view_get_selection(GTK_TREE_VIEW(messages));
-    gtk_tree_selection_set_mode(data->messages_selection, GTK_SELECTION_SINGLE);
+    gtk_tree_selection_set_mode(data->messages_selection,
+                                GTK_SELECTION_MULTIPLE);
     g_signal_connect(data->messages_selection, "changed",
                      G_CALLBACK(on_messages_selection_changed), data);
 
-    return scrolled_window;
+    return box;
 }
 
 
 static GtkWidget *create_message(app_data_t *data) {
     data->message_buffer = gtk_text_buffer_new(NULL);
 
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+
     GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
+    gtk_box_pack_start(GTK_BOX(box), scrolled_window, TRUE, TRUE, 0);
 
     GtkWidget *message = gtk_text_view_new_with_buffer(data->message_buffer);
     gtk_text_view_set_editable(GTK_TEXT_VIEW(message), FALSE);
     gtk_text_view_set_monospace(GTK_TEXT_VIEW(message), TRUE);
     gtk_container_add(GTK_CONTAINER(scrolled_window), message);
 
-    return scrolled_window;
+    data->message_rest_button = gtk_button_new_with_label("Load rest");
+    gtk_widget_set_no_show_all(data->message_rest_button, TRUE);
+    g_signal_connect(data->message_rest_button, "clicked",
+                     G_CALLBACK(on_message_rest_clicked), data);
+    gtk_box_pack_start(GTK_BOX(box), data->message_rest_button, FALSE, FALSE,
+                       0);
+
+    data->message_parts_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_widget_set_no_show_all(data->message_parts_box, TRUE);
+    gtk_box_pack_start(GTK_BOX(box), data->message_parts_box, FALSE, FALSE,
+                       0);
+
+    return box;
 }
 
 
@@ -315,33 +1050,159 @@ static GtkWidget *create_window(GtkApplication *app, app_data_t *data) {
 }
 
 
-static void on_get_directory_unseen(gchar *directory, gsize unseen,
-                                    gpointer user_data) {
-    tree_store_iter_data_t *data = user_data;
+static void set_directory_count(directory_data_t *directory) {
+    // directory was removed from store
+    if (!directory->store)
+        return;
 
     GString *unseen_str = g_string_sized_new(8);
-    g_string_printf(unseen_str, "%lu", unseen);
+    g_string_printf(unseen_str, "%lu", directory->unseen);
+
+    GString *total_str = g_string_sized_new(8);
+    g_string_printf(total_str, "%lu", directory->total);
 
-    gtk_tree_store_set(data->store, &(data->iter), 3, unseen_str->str, -1);
+    gtk_tree_store_set(directory->store, &(directory->iter), 3,
+                       unseen_str->str, 4, total_str->str, -1);
 
     g_string_free(unseen_str, TRUE);
-    if (g_ref_count_dec((grefcount *)data))
-        g_free(data);
+    g_string_free(total_str, TRUE);
 }
 
 
-static void on_get_directory_total(gchar *directory, gsize total,
-                                   gpointer user_data) {
-    tree_store_iter_data_t *data = user_data;
+static void on_get_directory_count(gchar *directory, gsize unseen,
+                                   gsize total, gpointer user_data) {
+    directory_data_t *data = user_data;
 
-    GString *total_str = g_string_sized_new(8);
-    g_string_printf(total_str, "%lu", total);
+    data->counted = TRUE;
+    data->unseen = unseen;
+    data->total = total;
+    set_directory_count(data);
+}
 
-    gtk_tree_store_set(data->store, &(data->iter), 4, total_str->str, -1);
 
-    g_string_free(total_str, TRUE);
-    if (g_ref_count_dec((grefcount *)data))
-        g_free(data);
+static void count_event(directory_data_t *directory, mbgui_watch_event_t event,
+                        gchar *path, gchar *new_path) {
+    gboolean unseen = !mbgui_maildir_has_flag(path, 'S');
+
+    switch (event) {
+    case MBGUI_WATCH_EVENT_ADDED:
+        directory->total += 1;
+        if (unseen)
+            directory->unseen += 1;
+        break;
+
+    case MBGUI_WATCH_EVENT_REMOVED:
+        if (directory->total)
+            directory->total -= 1;
+        if (unseen && directory->unseen)
+            directory->unseen -= 1;
+        break;
+
+    case MBGUI_WATCH_EVENT_RENAMED:
+        if (!mbgui_maildir_has_flag(new_path, 'S')) {
+            if (!unseen)
+                directory->unseen += 1;
+        } else if (unseen && directory->unseen) {
+            directory->unseen -= 1;
+        }
+        break;
+    }
+}
+
+
+static void update_directory_count(directory_data_t *directory,
+                                   mbgui_watch_event_t event, gchar *path,
+                                   gchar *new_path) {
+    if (!directory->counted)
+        return;
+
+    count_event(directory, event, path, new_path);
+    set_directory_count(directory);
+}
+
+
+static void update_messages(app_data_t *data, mbgui_watch_event_t event,
+                            gchar *path, gchar *new_path) {
+    // messages that were not scanned yet only need their pending path updated
+    for (guint i = 0; i < data->messages_added->len; ++i) {
+        if (g_strcmp0(g_ptr_array_index(data->messages_added, i), path))
+            continue;
+
+        if (event == MBGUI_WATCH_EVENT_RENAMED) {
+            g_free(g_ptr_array_index(data->messages_added, i));
+            g_ptr_array_index(data->messages_added, i) = g_strdup(new_path);
+        } else if (event == MBGUI_WATCH_EVENT_REMOVED) {
+            g_ptr_array_remove_index(data->messages_added, i);
+        }
+        return;
+    }
+
+    switch (event) {
+    case MBGUI_WATCH_EVENT_ADDED:
+        // search results are not updated with new messages
+        if (data->messages_query)
+            break;
+
+        g_ptr_array_add(data->messages_added, g_strdup(path));
+        if (!data->messages_added_source)
+            data->messages_added_source = g_timeout_add(
+                MESSAGES_ADDED_DELAY, on_messages_added_timeout, data);
+        break;
+
+    case MBGUI_WATCH_EVENT_REMOVED:
+        if (data->messages_model)
+            mbgui_messages_model_remove(data->messages_model, path);
+        break;
+
+    case MBGUI_WATCH_EVENT_RENAMED:
+        if (data->messages_model)
+            mbgui_messages_model_rename(data->messages_model, path, new_path);
+        break;
+    }
+}
+
+
+static void on_directory_changed(gchar *directory, mbgui_watch_event_t event,
+                                 gchar *path, gchar *new_path,
+                                 gpointer user_data) {
+    directory_data_t *data = user_data;
+
+    if (!data->store)
+        return;
+
+    // counts were already updated by operation, which caused the event
+    if (!g_hash_table_remove(data->pending, path))
+        update_directory_count(data, event, path, new_path);
+    mbgui_update_index(directory, event, path, new_path);
+
+    for (GList *i = windows; i; i = i->next) {
+        app_data_t *window_data = i->data;
+        if (!g_strcmp0(directory, window_data->messages_directory))
+            update_messages(window_data, event, path, new_path);
+    }
+}
+
+
+static void free_directory_data(directory_data_t *data) {
+    mbgui_unwatch_directory(data->watch);
+    g_cancellable_cancel(data->cancellable);
+    g_object_unref(data->cancellable);
+    g_hash_table_destroy(data->pending);
+    g_free(data);
+}
+
+
+// directories data of store, by path
+static GHashTable *get_directories_data(GtkTreeStore *store) {
+    GHashTable *directories = g_object_get_data(G_OBJECT(store), "data");
+    if (!directories) {
+        directories = g_hash_table_new_full(
+            g_str_hash, g_str_equal, g_free,
+            (GDestroyNotify)free_directory_data);
+        g_object_set_data_full(G_OBJECT(store), "data", directories,
+                               (GDestroyNotify)g_hash_table_destroy);
+    }
+    return directories;
 }
 
 
@@ -361,47 +1222,500 @@ static void add_directory(GtkTreeStore *store, mbgui_directory_t *directory,
     if (!directory->path)
         return;
 
-    tree_store_iter_data_t *data = g_malloc(sizeof(tree_store_iter_data_t));
-    data->store = store;
-    data->iter = iter;
+    // directory, which was already displayed, keeps its watch and counts
+    GHashTable *directories = get_directories_data(store);
+    directory_data_t *directory_data =
+        g_hash_table_lookup(directories, directory->path->str);
+    if (directory_data) {
+        directory_data->store = store;
+        directory_data->iter = iter;
+        if (directory_data->counted)
+            set_directory_count(directory_data);
+        return;
+    }
 
-    g_ref_count_init((grefcount *)data);
-    mbgui_get_directory_unseen(directory->path->str, on_get_directory_unseen,
-                               data);
+    directory_data = g_malloc(sizeof(directory_data_t));
+    directory_data->store = store;
+    directory_data->iter = iter;
+    directory_data->counted = directory->counted;
+    directory_data->unseen = directory->unseen;
+    directory_data->total = directory->total;
+    directory_data->pending =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    directory_data->cancellable = g_cancellable_new();
+    g_hash_table_insert(directories, g_strdup(directory->path->str),
+                        directory_data);
+
+    // counts from snapshot are displayed until they are revalidated
+    if (directory_data->counted)
+        set_directory_count(directory_data);
+
+    directory_data->watch = mbgui_watch_directory(
+        directory->path->str, on_directory_changed, directory_data);
+    mbgui_get_directory_count(directory->path->str,
+                              directory_data->cancellable,
+                              on_get_directory_count, directory_data);
+}
 
-    g_ref_count_inc((grefcount *)data);
-    mbgui_get_directory_total(directory->path->str, on_get_directory_total,
-                              data);
+
+static gboolean contains_directories(GHashTable *directories,
+                                     mbgui_directory_t *tree, guint *count) {
+    for (mbgui_directory_t *directory = tree; directory;
+         directory = directory->next) {
+        if (directory->path) {
+            directory_data_t *directory_data =
+                g_hash_table_lookup(directories, directory->path->str);
+            if (!directory_data || !directory_data->store)
+                return FALSE;
+            *count += 1;
+        }
+
+        if (!contains_directories(directories, directory->children, count))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static gboolean is_displayed(GtkTreeStore *store, mbgui_directory_t *tree) {
+    GHashTable *directories = get_directories_data(store);
+
+    guint displayed = 0;
+    GHashTableIter iter;
+    gpointer directory_data;
+    g_hash_table_iter_init(&iter, directories);
+    while (g_hash_table_iter_next(&iter, NULL, &directory_data)) {
+        if (((directory_data_t *)directory_data)->store)
+            displayed += 1;
+    }
+
+    guint count = 0;
+    return contains_directories(directories, tree, &count) &&
+           count == displayed;
+}
+
+
+static gboolean is_removed_directory(gpointer key, gpointer value,
+                                     gpointer user_data) {
+    return !((directory_data_t *)value)->store;
+}
+
+
+static void clear_directories(GtkTreeStore *store) {
+    GHashTableIter iter;
+    gpointer directory_data;
+    g_hash_table_iter_init(&iter, get_directories_data(store));
+    while (g_hash_table_iter_next(&iter, NULL, &directory_data))
+        ((directory_data_t *)directory_data)->store = NULL;
+
+    gtk_tree_store_clear(store);
 }
 
 
-static void on_get_directories(mbgui_directory_t *directories,
+// snapshot of last known directories is replaced only if found directories
+// differ
+static void on_get_directories(mbgui_directory_t *directories, gboolean done,
                                gpointer user_data) {
-    app_data_t *data = user_data;
+    GtkTreeStore *store = user_data;
+
+    if (is_displayed(store, directories))
+        return;
+
+    clear_directories(store);
 
     for (mbgui_directory_t *directory = directories; directory;
          directory = directory->next)
-        add_directory(data->directories_store, directory, NULL);
+        add_directory(store, directory, NULL);
+
+    // directories, which are no longer found, stop being watched and counted
+    g_hash_table_foreach_remove(get_directories_data(store),
+                                is_removed_directory, NULL);
+}
+
+
+// data of directory in all stores, which display it
+static GPtrArray *get_directory_data(gchar *directory) {
+    GPtrArray *result = g_ptr_array_new();
+
+    GHashTableIter iter;
+    gpointer store;
+    g_hash_table_iter_init(&iter, directories_stores);
+    while (g_hash_table_iter_next(&iter, NULL, &store)) {
+        directory_data_t *directory_data =
+            g_hash_table_lookup(get_directories_data(store), directory);
+        if (directory_data && directory_data->store)
+            g_ptr_array_add(result, directory_data);
+    }
+
+    return result;
+}
+
+
+// counts are updated once for all renames - the same events reported later
+// by directory watches are skipped
+static void count_operation_events(gchar *directory, mbgui_watch_event_t event,
+                                   gchar **paths, gchar **new_paths) {
+    GPtrArray *directories = get_directory_data(directory);
+
+    for (guint i = 0; i < directories->len; ++i) {
+        directory_data_t *directory_data = g_ptr_array_index(directories, i);
+
+        for (gsize j = 0; paths[j]; ++j) {
+            g_hash_table_add(directory_data->pending, g_strdup(paths[j]));
+            if (directory_data->counted)
+                count_event(directory_data, event, paths[j],
+                            (new_paths ? new_paths[j] : NULL));
+        }
+
+        if (directory_data->counted)
+            set_directory_count(directory_data);
+    }
+
+    g_ptr_array_free(directories, TRUE);
+}
+
+
+// events of failed renames will not be reported, so counts are recounted
+static void recount_operation_events(gchar *directory, gchar **paths) {
+    GPtrArray *directories = get_directory_data(directory);
+
+    for (guint i = 0; i < directories->len; ++i) {
+        directory_data_t *directory_data = g_ptr_array_index(directories, i);
+
+        for (gsize j = 0; paths[j]; ++j)
+            g_hash_table_remove(directory_data->pending, paths[j]);
+
+        mbgui_get_directory_count(directory, directory_data->cancellable,
+                                  on_get_directory_count, directory_data);
+    }
+
+    g_ptr_array_free(directories, TRUE);
+}
+
+
+// preview follows selection, which was renamed or removed
+static void update_selected_message(app_data_t *data) {
+    gchar *path = get_selected_message(data);
+    if (g_strcmp0(path, data->message_path))
+        on_messages_selection_changed(data->messages_selection, data);
+    g_free(path);
+}
+
+
+static void update_operation_messages(gchar *directory,
+                                      mbgui_watch_event_t event,
+                                      gchar **paths, gchar **new_paths) {
+    for (GList *i = windows; i; i = i->next) {
+        app_data_t *window_data = i->data;
+        if (g_strcmp0(directory, window_data->messages_directory))
+            continue;
+
+        // selection is handled once, instead of for every removed row
+        g_signal_handlers_block_by_func(window_data->messages_selection,
+                                        on_messages_selection_changed,
+                                        window_data);
+        for (gsize j = 0; paths[j]; ++j)
+            update_messages(window_data, event, paths[j],
+                            (new_paths ? new_paths[j] : NULL));
+        g_signal_handlers_unblock_by_func(window_data->messages_selection,
+                                          on_messages_selection_changed,
+                                          window_data);
+
+        update_selected_message(window_data);
+    }
+}
+
+
+static void on_rename_messages(gchar **paths, gchar **new_paths,
+                               gpointer user_data) {
+    operation_data_t *operation = user_data;
+
+    if (paths[0] && operation->new_directory) {
+        recount_operation_events(operation->directory, paths);
+        recount_operation_events(operation->new_directory, new_paths);
+        update_operation_messages(operation->directory,
+                                  MBGUI_WATCH_EVENT_ADDED, paths, NULL);
+    } else if (paths[0]) {
+        recount_operation_events(operation->directory, paths);
+        update_operation_messages(operation->directory,
+                                  MBGUI_WATCH_EVENT_RENAMED, new_paths, paths);
+    }
+
+    g_free(operation->directory);
+    g_free(operation->new_directory);
+    g_free(operation);
+}
+
+
+// displayed messages and counts are updated before files are renamed, and
+// reverted for renames, which failed
+static void rename_messages(app_data_t *data, GPtrArray *paths,
+                            GPtrArray *new_paths, gchar *new_directory) {
+    g_ptr_array_add(paths, NULL);
+    g_ptr_array_add(new_paths, NULL);
+    gchar **from = (gchar **)paths->pdata;
+    gchar **to = (gchar **)new_paths->pdata;
+
+    if (from[0]) {
+        gint64 trace_begin = mbgui_trace_begin();
+        gchar *directory = data->messages_directory;
+
+        if (new_directory) {
+            count_operation_events(directory, MBGUI_WATCH_EVENT_REMOVED, from,
+                                   NULL);
+            count_operation_events(new_directory, MBGUI_WATCH_EVENT_ADDED, to,
+                                   NULL);
+            update_operation_messages(directory, MBGUI_WATCH_EVENT_REMOVED,
+                                      from, NULL);
+        } else {
+            count_operation_events(directory, MBGUI_WATCH_EVENT_RENAMED, from,
+                                   to);
+            update_operation_messages(directory, MBGUI_WATCH_EVENT_RENAMED,
+                                      from, to);
+        }
+
+        mbgui_trace_end("update_renamed_messages", 0, directory, trace_begin);
+
+        operation_data_t *operation = g_malloc(sizeof(operation_data_t));
+        operation->directory = g_strdup(directory);
+        operation->new_directory = g_strdup(new_directory);
+        mbgui_rename_messages(from, to, on_rename_messages, operation);
+    }
+
+    g_ptr_array_free(paths, TRUE);
+    g_ptr_array_free(new_paths, TRUE);
+}
+
+
+static void flag_selected_messages(app_data_t *data, gchar flag,
+                                   gboolean set) {
+    GPtrArray *selected = get_selected_paths(data);
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *new_paths = g_ptr_array_new_with_free_func(g_free);
+
+    for (guint i = 0; i < selected->len; ++i) {
+        gchar *path = g_ptr_array_index(selected, i);
+        gchar *new_path = mbgui_maildir_get_flagged_path(path, flag, set);
+
+        if (!g_strcmp0(path, new_path)) {
+            g_free(new_path);
+            continue;
+        }
+
+        g_ptr_array_add(paths, g_strdup(path));
+        g_ptr_array_add(new_paths, new_path);
+    }
+
+    g_ptr_array_free(selected, TRUE);
+    rename_messages(data, paths, new_paths, NULL);
+}
+
+
+static void on_move_activate(GtkMenuItem *self, gpointer user_data) {
+    app_data_t *data = user_data;
+    gchar *directory = g_object_get_data(G_OBJECT(self), "path");
+
+    GPtrArray *paths = get_selected_paths(data);
+    GPtrArray *new_paths = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < paths->len; ++i)
+        g_ptr_array_add(new_paths,
+                        mbgui_maildir_get_moved_path(
+                            g_ptr_array_index(paths, i), directory));
+
+    rename_messages(data, paths, new_paths, directory);
 }
 
 
-static void on_command_line(GtkApplication *app,
+static void add_move_items(app_data_t *data, GtkWidget *menu,
+                           GtkTreeIter *parent, gint depth) {
+    GtkTreeModel *model = GTK_TREE_MODEL(data->directories_store);
+    GtkTreeIter iter;
+
+    if (!gtk_tree_model_iter_children(model, &iter, parent))
+        return;
+
+    do {
+        gchar *path;
+        gchar *name;
+        gtk_tree_model_get(model, &iter, 0, &path, 2, &name, -1);
+
+        gchar *label = g_strdup_printf("%*s%s", depth * 4, "", name);
+        GtkWidget *item = gtk_menu_item_new_with_label(label);
+        gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
+
+        // parents without Maildir and current directory are only displayed
+        if (path && g_strcmp0(path, data->messages_directory)) {
+            g_object_set_data_full(G_OBJECT(item), "path", path, g_free);
+            g_signal_connect(item, "activate", G_CALLBACK(on_move_activate),
+                             data);
+        } else {
+            gtk_widget_set_sensitive(item, FALSE);
+            g_free(path);
+        }
+
+        g_free(label);
+        g_free(name);
+
+        add_move_items(data, menu, &iter, depth + 1);
+    } while (gtk_tree_model_iter_next(model, &iter));
+}
+
+
+static void popup_move_menu(app_data_t *data, GdkEventKey *event) {
+    if (!data->messages_directory ||
+        !gtk_tree_selection_count_selected_rows(data->messages_selection))
+        return;
+
+    if (data->move_menu)
+        gtk_widget_destroy(data->move_menu);
+
+    data->move_menu = gtk_menu_new();
+    gtk_menu_attach_to_widget(GTK_MENU(data->move_menu),
+                              GTK_WIDGET(data->messages_view), NULL);
+    add_move_items(data, data->move_menu, NULL, 0);
+    gtk_widget_show_all(data->move_menu);
+    gtk_menu_popup_at_widget(GTK_MENU(data->move_menu),
+                             GTK_WIDGET(data->messages_view),
+                             GDK_GRAVITY_CENTER, GDK_GRAVITY_CENTER,
+                             (GdkEvent *)event);
+}
+
+
+// arguments are resolved relative to working directory of invocation, which
+// can differ from working directory of primary instance
+static GtkTreeStore *
+get_directories_store(GApplicationCommandLine *command_line) {
+    gint argc;
+    gchar **argv =
+        g_application_command_line_get_arguments(command_line, &argc);
+
+    gchar **paths = g_new0(gchar *, MAX(argc, 1));
+    for (gint i = 1; i < argc; ++i) {
+        GFile *file = g_application_command_line_create_file_for_arg(
+            command_line, argv[i]);
+        paths[i - 1] = g_file_get_path(file);
+        g_object_unref(file);
+    }
+
+    if (!directories_stores)
+        directories_stores = g_hash_table_new_full(
+            g_str_hash, g_str_equal, g_free, g_object_unref);
+
+    gchar *key = g_strjoinv("\n", paths);
+    GtkTreeStore *store = g_hash_table_lookup(directories_stores, key);
+
+    if (store) {
+        g_free(key);
+    } else {
+        store = gtk_tree_store_new(5, G_TYPE_STRING, G_TYPE_STRING,
+                                   G_TYPE_STRING, G_TYPE_STRING,
+                                   G_TYPE_STRING);
+        g_hash_table_insert(directories_stores, key, store);
+        mbgui_get_directories(paths, NULL, on_get_directories, store);
+    }
+
+    g_strfreev(paths);
+    g_strfreev(argv);
+    return store;
+}
+
+
+static void on_window_destroy(GtkWidget *self, gpointer user_data) {
+    app_data_t *data = user_data;
+
+    windows = g_list_remove(windows, data);
+    g_signal_handlers_disconnect_by_data(data->directories_selection, data);
+    g_signal_handlers_disconnect_by_data(data->messages_selection, data);
+
+    if (data->move_menu)
+        gtk_widget_destroy(data->move_menu);
+
+    clear_messages(data);
+    cancel_request(&(data->message_cancellable));
+    cancel_request(&(data->message_parts_cancellable));
+    mbgui_free_message_parts(data->message_parts);
+
+    g_ptr_array_free(data->messages_added, TRUE);
+    g_free(data->messages_query);
+    g_free(data->messages_filter);
+    g_free(data->message_path);
+    g_object_unref(data->message_buffer);
+    g_free(data);
+}
+
+
+static gint on_command_line(GtkApplication *app,
                             GApplicationCommandLine *command_line,
                             gpointer user_data) {
     app_data_t *data = g_malloc(sizeof(app_data_t));
+    data->directories_store = get_directories_store(command_line);
+    data->messages_model = NULL;
+    data->messages_directory = NULL;
+    data->messages_query = NULL;
+    data->messages_filter = NULL;
+    data->messages_sort_column = -1;
+    data->messages_sort_order = GTK_SORT_ASCENDING;
+    data->move_menu = NULL;
+    data->messages_cancellable = NULL;
+    g_queue_init(&(data->messages_batches));
+    data->messages_next = NULL;
+    data->messages_source = 0;
+    data->messages_added = g_ptr_array_new_with_free_func(g_free);
+    data->messages_added_source = 0;
+    data->message_path = NULL;
+    data->message_cancellable = NULL;
+    data->message_parts = NULL;
+    data->message_parts_cancellable = NULL;
+    data->message_rest = 0;
+
+    const gchar *message_limit =
+        g_application_command_line_getenv(command_line, "MBGUI_MESSAGE_LIMIT");
+    data->message_limit =
+        (message_limit ? g_ascii_strtoull(message_limit, NULL, 10)
+                       : MESSAGE_DEFAULT_LIMIT);
+
     GtkWidget *window = create_window(app, data);
+    g_signal_connect(window, "destroy", G_CALLBACK(on_window_destroy), data);
     gtk_widget_show_all(window);
+    windows = g_list_prepend(windows, data);
 
-    gchar **argv = g_application_command_line_get_arguments(command_line, NULL);
-    mbgui_get_directories(argv, on_get_directories, data);
-    g_strfreev(argv);
+    return 0;
 }
 
 
 int main(int argc, char **argv) {
-    GtkApplication *app =
-        gtk_application_new(NULL, G_APPLICATION_HANDLES_COMMAND_LINE);
+    const gchar *trace = g_getenv("MBGUI_TRACE");
+    if (trace)
+        mbgui_trace_init(trace);
+
+    const gchar *max_jobs = g_getenv("MBGUI_JOBS");
+    if (max_jobs)
+        mbgui_scheduler_set_max_jobs(g_ascii_strtoull(max_jobs, NULL, 10));
+
+    const gchar *message_cache_size = g_getenv("MBGUI_MESSAGE_CACHE");
+    if (message_cache_size)
+        mbgui_set_message_cache_size(
+            g_ascii_strtoull(message_cache_size, NULL, 10));
+
+    // by default, invocations open new windows in already running instance
+    const gchar *unique = g_getenv("MBGUI_UNIQUE");
+    GApplicationFlags flags = G_APPLICATION_HANDLES_COMMAND_LINE;
+    if (unique && !g_strcmp0(unique, "0"))
+        flags |= G_APPLICATION_NON_UNIQUE;
+
+    GtkApplication *app = gtk_application_new(APPLICATION_ID, flags);
     g_signal_connect(app, "command-line", G_CALLBACK(on_command_line), NULL);
 
-    return g_application_run(G_APPLICATION(app), argc, argv);
+    int result = g_application_run(G_APPLICATION(app), argc, argv);
+
+    mbgui_save_directories();
+
+    if (parts_directory) {
+        remove_directory(parts_directory);
+        g_free(parts_directory);
+    }
+
+    mbgui_trace_close();
+    return result;
 }
@@ -1,58 +1,168 @@
+#include <errno.h>
+#include <string.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
-#include <gio/gunixinputstream.h>
 #include "mblaze.h"
+#include "arena.h"
+#include "cache.h"
+#include "index.h"
+#include "maildir.h"
+#include "mime.h"
+#include "scheduler.h"
+#include "thread.h"
+#include "trace.h"
+
+
+#define MESSAGE_READ_SIZE (64 * 1024)
+#define MESSAGE_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+#define SEARCH_MAX_RESULTS 5000
 
 
 typedef struct {
+    gchar **argv;
+    gchar *key;
+    GCancellable *cancellable;
     mbgui_get_directories_cb_t cb;
     gpointer user_data;
+    GPtrArray *paths;
     mbgui_directory_t *directories;
-    GSubprocess *process;
-    GDataInputStream *stream;
+    guint64 trace_id;
+    gint64 trace_begin;
 } get_directories_data_t;
 
+typedef struct {
+    mbgui_directory_t *directory;
+    mbgui_directory_t **children_tail;
+} directory_node_t;
+
 typedef struct {
     GString *directory;
-    mbgui_get_directory_total_cb_t cb;
+    GCancellable *cancellable;
+    mbgui_get_directory_count_cb_t cb;
     gpointer user_data;
+    gsize unseen;
     gsize total;
-    GSubprocess *process;
-    GDataInputStream *stream;
-} get_directory_total_data_t;
+    guint64 trace_id;
+    gint64 trace_begin;
+} get_directory_count_data_t;
 
 typedef struct {
     GString *directory;
-    mbgui_get_directory_unseen_cb_t cb;
+    GCancellable *cancellable;
+    mbgui_get_messages_cb_t cb;
     gpointer user_data;
-    gsize unseen;
-    GSubprocess *process;
-    GDataInputStream *stream;
-} get_directory_unseen_data_t;
+    mbgui_message_arena_t *arena;
+    mbgui_message_t *messages;
+    mbgui_cache_writer_t *cache_writer;
+    GArray *cached_messages;
+    GPtrArray *added_paths;
+    gboolean cached;
+    gboolean stamp_valid;
+    mbgui_cache_stamp_t stamp;
+    gchar **paths;
+    gchar *query;
+    mbgui_index_t *index;
+    GMainContext *context;
+    guint64 trace_id;
+    gint64 trace_begin;
+} get_messages_data_t;
 
 typedef struct {
     GString *directory;
+    GCancellable *cancellable;
     mbgui_get_messages_cb_t cb;
     gpointer user_data;
+    mbgui_message_arena_t *arena;
     mbgui_message_t *messages;
-    gchar *line_buff[6];
-    gsize line_buff_count;
-    gint mlist_stdout_fd;
-    gint mthread_stdout_fd;
-    gint mscan_stdout_fd;
-    GInputStream *mscan_stdout;
-    GDataInputStream *stream;
-} get_messages_data_t;
+} messages_batch_data_t;
 
 typedef struct {
     GString *path;
+    gsize offset;
+    gsize limit;
+    GCancellable *cancellable;
     mbgui_get_message_cb_t cb;
     gpointer user_data;
-    gchar buff[1024];
-    GString *message;
+    gchar buff[MESSAGE_READ_SIZE];
+    gsize position;
+    GString *pending;
+    GString *text;
     GSubprocess *process;
+    guint64 trace_id;
+    gint64 trace_begin;
+    gint64 trace_process;
 } get_message_data_t;
 
+typedef struct {
+    gchar *path;
+    gchar *text;
+    gsize size;
+    gsize rest;
+    GList *link;
+} message_cache_entry_t;
+
+struct mbgui_watch_t {
+    GString *directory;
+    mbgui_watch_directory_cb_t cb;
+    gpointer user_data;
+    GFile *subdirectories[2];
+    GFileMonitor *monitors[2];
+};
+
+typedef struct {
+    mbgui_index_t *index;
+    mbgui_watch_event_t event;
+    gchar *path;
+    gchar *new_path;
+} update_index_data_t;
+
+typedef struct {
+    gchar **paths;
+    gchar **new_paths;
+    mbgui_rename_messages_cb_t cb;
+    gpointer user_data;
+    GPtrArray *failed_paths;
+    GPtrArray *failed_new_paths;
+    guint64 trace_id;
+    gint64 trace_begin;
+} rename_messages_data_t;
+
+typedef struct {
+    GString *path;
+    GCancellable *cancellable;
+    mbgui_get_message_parts_cb_t cb;
+    gpointer user_data;
+    mbgui_message_part_t *parts;
+    guint64 trace_id;
+    gint64 trace_begin;
+} get_message_parts_data_t;
+
+typedef struct {
+    GString *path;
+    gsize offset;
+    gsize length;
+    gchar *encoding;
+    gchar *output;
+    mbgui_save_message_part_cb_t cb;
+    gpointer user_data;
+    gboolean success;
+    guint64 trace_id;
+    gint64 trace_begin;
+} save_message_part_data_t;
+
+
+static GHashTable *message_cache = NULL;
+static GQueue message_cache_lru = G_QUEUE_INIT;
+static gsize message_cache_size = 0;
+static gsize message_cache_max_size = MESSAGE_CACHE_DEFAULT_SIZE;
+static GCancellable *prefetch_cancellable = NULL;
+static gsize process_count = 0;
+static GHashTable *indexes = NULL;
+static GHashTable *directory_lists = NULL;
+static GHashTable *directory_counts = NULL;
+static GMutex directory_counts_mutex;
+static GThreadPool *update_index_pool = NULL;
+
 
 static void free_directories(mbgui_directory_t *directories) {
     if (!directories)
@@ -67,74 +177,174 @@ static void free_directories(mbgui_directory_t *directories) {
 }
 
 
-static void free_messages(mbgui_message_t *messages) {
-    if (!messages)
-        return;
-    if (messages->path)
-        g_string_free(messages->path, TRUE);
-    if (messages->subject)
-        g_string_free(messages->subject, TRUE);
-    if (messages->sender)
-        g_string_free(messages->sender, TRUE);
-    if (messages->date)
-        g_string_free(messages->date, TRUE);
-    free_messages(messages->children);
-    free_messages(messages->next);
-    g_free(messages);
-}
-
-
 static void free_get_directories_data(get_directories_data_t *data) {
+    mbgui_trace_end_async("get_directories", data->trace_id, NULL,
+                          data->trace_begin);
+    g_strfreev(data->argv);
+    g_free(data->key);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    if (data->paths)
+        g_ptr_array_unref(data->paths);
     free_directories(data->directories);
-    g_object_unref(data->stream);
-    g_object_unref(data->process);
     g_free(data);
 }
 
 
-static void free_get_directory_total_data(get_directory_total_data_t *data) {
+static void free_get_directory_count_data(get_directory_count_data_t *data) {
+    mbgui_trace_end_async("get_directory_count", data->trace_id,
+                          data->directory->str, data->trace_begin);
     g_string_free(data->directory, TRUE);
-    g_object_unref(data->stream);
-    g_object_unref(data->process);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
     g_free(data);
 }
 
 
-static void free_get_directory_unseen_data(get_directory_unseen_data_t *data) {
+static void free_get_messages_data(get_messages_data_t *data) {
+    mbgui_trace_end_async((data->query   ? "search_messages"
+                           : data->paths ? "scan_messages"
+                                         : "get_messages"),
+                          data->trace_id, data->directory->str,
+                          data->trace_begin);
     g_string_free(data->directory, TRUE);
-    g_object_unref(data->stream);
-    g_object_unref(data->process);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    mbgui_message_arena_unref(data->arena);
+    if (data->cache_writer)
+        mbgui_cache_writer_free(data->cache_writer);
+    if (data->cached_messages)
+        g_array_unref(data->cached_messages);
+    if (data->added_paths)
+        g_ptr_array_unref(data->added_paths);
+    g_strfreev(data->paths);
+    g_free(data->query);
+    g_main_context_unref(data->context);
     g_free(data);
 }
 
 
-static void free_get_messages_data(get_messages_data_t *data) {
+static void free_messages_batch_data(messages_batch_data_t *data) {
     g_string_free(data->directory, TRUE);
-    free_messages(data->messages);
-    for (gsize i = 0; i < data->line_buff_count; ++i)
-        g_free(data->line_buff[i]);
-    if (data->stream)
-        g_object_unref(data->stream);
-    if (data->mscan_stdout)
-        g_object_unref(data->mscan_stdout);
-    if (data->mscan_stdout_fd >= 0)
-        g_close(data->mscan_stdout_fd, NULL);
-    if (data->mthread_stdout_fd >= 0)
-        g_close(data->mthread_stdout_fd, NULL);
-    if (data->mlist_stdout_fd >= 0)
-        g_close(data->mlist_stdout_fd, NULL);
-    free(data);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    mbgui_message_arena_unref(data->arena);
+    g_free(data);
 }
 
 
 static void free_get_message_data(get_message_data_t *data) {
+    mbgui_trace_end_async((data->cb ? "get_message" : "prefetch_message"),
+                          data->trace_id, data->path->str, data->trace_begin);
+    if (data->process)
+        mbgui_trace_end_async("mshow", data->trace_id, data->path->str,
+                              data->trace_process);
+    g_string_free(data->path, TRUE);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    g_string_free(data->pending, TRUE);
+    if (data->text)
+        g_string_free(data->text, TRUE);
+    if (data->process)
+        g_object_unref(data->process);
+    g_free(data);
+}
+
+
+static void free_rename_messages_data(rename_messages_data_t *data) {
+    mbgui_trace_end_async("rename_messages", data->trace_id, NULL,
+                          data->trace_begin);
+    g_strfreev(data->paths);
+    g_strfreev(data->new_paths);
+    g_ptr_array_free(data->failed_paths, TRUE);
+    g_ptr_array_free(data->failed_new_paths, TRUE);
+    g_free(data);
+}
+
+
+static void free_get_message_parts_data(get_message_parts_data_t *data) {
+    mbgui_trace_end_async("get_message_parts", data->trace_id,
+                          data->path->str, data->trace_begin);
     g_string_free(data->path, TRUE);
-    g_string_free(data->message, TRUE);
-    g_object_unref(data->process);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    mbgui_free_message_parts(data->parts);
     g_free(data);
 }
 
 
+static void free_save_message_part_data(save_message_part_data_t *data) {
+    mbgui_trace_end_async("save_message_part", data->trace_id,
+                          data->path->str, data->trace_begin);
+    g_string_free(data->path, TRUE);
+    g_free(data->encoding);
+    g_free(data->output);
+    g_free(data);
+}
+
+
+static void free_message_cache_entry(message_cache_entry_t *entry) {
+    g_free(entry->path);
+    g_free(entry->text);
+    g_free(entry);
+}
+
+
+static void shrink_message_cache(void) {
+    while (message_cache_size > message_cache_max_size) {
+        message_cache_entry_t *entry = g_queue_pop_tail(&message_cache_lru);
+        message_cache_size -= entry->size;
+        g_hash_table_remove(message_cache, entry->path);
+    }
+}
+
+
+static message_cache_entry_t *get_message_cache_entry(const gchar *path) {
+    if (!message_cache)
+        return NULL;
+
+    message_cache_entry_t *entry = g_hash_table_lookup(message_cache, path);
+    if (!entry)
+        return NULL;
+
+    g_queue_unlink(&message_cache_lru, entry->link);
+    g_queue_push_head_link(&message_cache_lru, entry->link);
+    return entry;
+}
+
+
+static void add_message_cache_entry(const gchar *path, GString *text,
+                                    gsize rest) {
+    if (text->len > message_cache_max_size)
+        return;
+
+    if (!message_cache)
+        message_cache = g_hash_table_new_full(
+            g_str_hash, g_str_equal, NULL,
+            (GDestroyNotify)free_message_cache_entry);
+
+    message_cache_entry_t *entry = g_hash_table_lookup(message_cache, path);
+    if (entry) {
+        g_queue_delete_link(&message_cache_lru, entry->link);
+        message_cache_size -= entry->size;
+        g_hash_table_remove(message_cache, path);
+    }
+
+    entry = g_malloc(sizeof(message_cache_entry_t));
+    entry->path = g_strdup(path);
+    entry->text = g_strndup(text->str, text->len);
+    entry->size = text->len;
+    entry->rest = rest;
+
+    g_queue_push_head(&message_cache_lru, entry);
+    entry->link = message_cache_lru.head;
+    g_hash_table_insert(message_cache, entry->path, entry);
+    message_cache_size += text->len;
+
+    shrink_message_cache();
+}
+
+
 static void reduce_directory(mbgui_directory_t *directory) {
     for (mbgui_directory_t *child = directory->children;
          child && !child->next && !directory->path;
@@ -153,359 +363,1185 @@ static void reduce_directory(mbgui_directory_t *directory) {
 }
 
 
-static mbgui_directory_t *reverse_directories(mbgui_directory_t *directories) {
-    mbgui_directory_t *reversed = NULL;
-    while (directories) {
-        mbgui_directory_t *next = directories->next;
-        directories->children = reverse_directories(directories->children);
-        directories->next = reversed;
-        reversed = directories;
-        directories = next;
+static directory_node_t *get_directory_node(GHashTable *nodes,
+                                            directory_node_t *parent,
+                                            const gchar *path, gsize len) {
+    gchar *prefix = g_strndup(path, len);
+    directory_node_t *node = g_hash_table_lookup(nodes, prefix);
+    if (node) {
+        g_free(prefix);
+        return node;
     }
-    return reversed;
-}
 
+    const gchar *name = strrchr(prefix, '/') + 1;
 
-static mbgui_directory_t *add_directory(mbgui_directory_t *directories,
-                                        gchar *path, gchar *name) {
-    if (*name != '/')
-        return directories;
+    node = g_malloc(sizeof(directory_node_t));
+    node->directory = g_malloc(sizeof(mbgui_directory_t));
+    node->directory->path = NULL;
+    node->directory->name = g_string_new(name);
+    node->directory->counted = FALSE;
+    node->directory->unseen = 0;
+    node->directory->total = 0;
+    node->directory->children = NULL;
+    node->directory->next = NULL;
+    node->children_tail = &(node->directory->children);
 
-    gsize index = 1;
-    while (name[index] && name[index] != '/')
-        ++index;
+    *(parent->children_tail) = node->directory;
+    parent->children_tail = &(node->directory->next);
 
-    if (name[index]) {
-        GString *subname = g_string_new_len(name + 1, index - 1);
+    g_hash_table_insert(nodes, prefix, node);
+    return node;
+}
 
-        mbgui_directory_t *directory = directories;
-        while (directory && !g_string_equal(directory->name, subname))
-            directory = directory->next;
 
-        if (directory) {
-            g_string_free(subname, TRUE);
+// paths are in `mdirs` order, so siblings are appended in order of discovery
+static mbgui_directory_t *build_directories(GPtrArray *paths) {
+    GHashTable *nodes =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    mbgui_directory_t *directories = NULL;
+    directory_node_t root = {NULL, &directories};
 
-        } else {
-            directory = g_malloc(sizeof(mbgui_directory_t));
-            directory->path = NULL;
-            directory->name = subname;
-            directory->children = NULL;
-            directory->next = directories;
+    for (guint i = 0; i < paths->len; ++i) {
+        const gchar *path = g_ptr_array_index(paths, i);
+        directory_node_t *node = &root;
+
+        for (const gchar *name = path; *name == '/' && name[1];) {
+            const gchar *name_end = strchr(name + 1, '/');
+            if (!name_end)
+                name_end = name + strlen(name);
+
+            node = get_directory_node(nodes, node, path, name_end - path);
+            name = name_end;
         }
 
-        directory->children =
-            add_directory(directory->children, path, name + index);
-        return directory;
+        if (node != &root && !node->directory->path)
+            node->directory->path = g_string_new(path);
     }
 
-    mbgui_directory_t *directory = g_malloc(sizeof(mbgui_directory_t));
-    directory->path = g_string_new(path);
-    directory->name = g_string_new(name + 1);
-    directory->children = NULL;
-    directory->next = directories;
-    return directory;
+    g_hash_table_destroy(nodes);
+    return directories;
 }
 
 
-static gsize get_message_depth(gchar *line) {
-    gsize depth = 0;
+// counts are valid while modification times of `cur` and `new` are unchanged
+static gboolean get_cached_count(const gchar *directory,
+                                 const mbgui_cache_stamp_t *stamp,
+                                 gsize *unseen, gsize *total) {
+    g_mutex_lock(&directory_counts_mutex);
+
+    mbgui_cache_directory_t *count =
+        (directory_counts ? g_hash_table_lookup(directory_counts, directory)
+                          : NULL);
+    gboolean result =
+        count && count->counted &&
+        (!stamp || !memcmp(&(count->stamp), stamp, sizeof(*stamp)));
+    if (result) {
+        *unseen = count->unseen;
+        *total = count->total;
+    }
+
+    g_mutex_unlock(&directory_counts_mutex);
+    return result;
+}
 
-    if (line[0] == '.' && line[1] == '.') {
-        for (gchar *i = line + 2; g_ascii_isdigit(*i); ++i)
-            depth = depth * 10 + (*i - '0');
 
-    } else {
-        for (gchar *i = line; *i; ++i) {
-            if (*i == ' ')
-                depth += 1;
-        }
+static void free_directory_count(mbgui_cache_directory_t *count) {
+    mbgui_cache_directory_clear(count);
+    g_free(count);
+}
+
+
+static void set_cached_count(mbgui_cache_directory_t *count,
+                             gboolean replace) {
+    g_mutex_lock(&directory_counts_mutex);
+
+    if (!directory_counts)
+        directory_counts =
+            g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                  (GDestroyNotify)free_directory_count);
+
+    if (replace || !g_hash_table_contains(directory_counts, count->path)) {
+        mbgui_cache_directory_t *value = g_malloc(sizeof(*value));
+        *value = *count;
+        value->path = g_strdup(count->path);
+        g_hash_table_replace(directory_counts, value->path, value);
     }
 
-    return depth;
+    g_mutex_unlock(&directory_counts_mutex);
+}
+
+
+static void set_directory_counts(mbgui_directory_t *directories) {
+    for (mbgui_directory_t *directory = directories; directory;
+         directory = directory->next) {
+        if (directory->path)
+            directory->counted =
+                get_cached_count(directory->path->str, NULL,
+                                 &(directory->unseen), &(directory->total));
+        set_directory_counts(directory->children);
+    }
 }
 
 
-static mbgui_message_t *reverse_messages(mbgui_message_t *messages) {
-    mbgui_message_t *reversed = NULL;
-    while (messages) {
-        mbgui_message_t *next = messages->next;
-        messages->children = reverse_messages(messages->children);
-        messages->next = reversed;
-        reversed = messages;
-        messages = next;
+static mbgui_directory_t *get_directories_tree(GPtrArray *paths) {
+    mbgui_directory_t *directories = build_directories(paths);
+
+    for (mbgui_directory_t *directory = directories; directory;
+         directory = directory->next) {
+        g_string_prepend_c(directory->name, '/');
+        reduce_directory(directory);
     }
-    return reversed;
+
+    set_directory_counts(directories);
+    return directories;
 }
 
 
-static mbgui_message_t *add_message(mbgui_message_t *messages, gsize depth,
-                                    gchar **lines) {
-    if (depth && messages) {
-        messages->children = add_message(messages->children, depth - 1, lines);
-        return messages;
+// last known directories, with their counts, are loaded from snapshot saved
+// by mbgui_save_directories
+static void get_directories_cache_thread(GTask *task, gpointer source_object,
+                                         gpointer task_data,
+                                         GCancellable *cancellable) {
+    get_directories_data_t *data = task_data;
+
+    gint64 trace_begin = mbgui_trace_begin();
+    GArray *snapshot = mbgui_cache_load_directories(data->key);
+
+    if (snapshot) {
+        GPtrArray *paths = g_ptr_array_new();
+        for (guint i = 0; i < snapshot->len; ++i) {
+            mbgui_cache_directory_t *count =
+                &g_array_index(snapshot, mbgui_cache_directory_t, i);
+            set_cached_count(count, FALSE);
+            g_ptr_array_add(paths, count->path);
+        }
+
+        data->directories = get_directories_tree(paths);
+        g_ptr_array_free(paths, TRUE);
+        g_array_unref(snapshot);
     }
 
-    mbgui_message_t *message = g_malloc(sizeof(mbgui_message_t));
-    message->path = g_string_new(lines[0]);
-    message->status = lines[1][0];
-    message->subject = g_string_new(lines[2]);
-    message->sender = g_string_new(lines[3]);
-    message->date = g_string_new(lines[4]);
-    message->children = NULL;
-    message->next = messages;
+    mbgui_trace_end("load_directories", data->trace_id, NULL, trace_begin);
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void get_directories_thread(GTask *task, gpointer source_object,
+                                   gpointer task_data,
+                                   GCancellable *cancellable) {
+    get_directories_data_t *data = task_data;
 
-    return message;
+    gint64 trace_begin = mbgui_trace_begin();
+    data->paths = mbgui_maildir_find(data->argv, data->cancellable);
+    mbgui_trace_end("find_maildirs", data->trace_id, NULL, trace_begin);
+
+    trace_begin = mbgui_trace_begin();
+    data->directories = get_directories_tree(data->paths);
+    mbgui_trace_end("build_directories", data->trace_id, NULL, trace_begin);
+
+    g_task_return_boolean(task, TRUE);
 }
 
 
-static void on_get_directories_read_line(GObject *source_object,
-                                         GAsyncResult *result,
-                                         gpointer user_data) {
+static void on_get_directories(GObject *source_object, GAsyncResult *result,
+                               gpointer user_data) {
     get_directories_data_t *data = user_data;
 
-    gchar *line =
-        g_data_input_stream_read_line_finish(data->stream, result, NULL, NULL);
+    if (!g_cancellable_is_cancelled(data->cancellable)) {
+        if (!directory_lists)
+            directory_lists = g_hash_table_new_full(
+                g_str_hash, g_str_equal, g_free,
+                (GDestroyNotify)g_ptr_array_unref);
+        g_hash_table_replace(directory_lists, g_strdup(data->key),
+                             g_ptr_array_ref(data->paths));
 
-    if (!line) {
-        data->directories = reverse_directories(data->directories);
-        for (mbgui_directory_t *directory = data->directories; directory;
-             directory = directory->next) {
-            g_string_prepend_c(directory->name, '/');
-            reduce_directory(directory);
-        }
-        data->cb(data->directories, data->user_data);
+        data->cb(data->directories, TRUE, data->user_data);
+    }
+
+    free_get_directories_data(data);
+    mbgui_scheduler_done();
+}
+
+
+static void on_get_directories_cache(GObject *source_object,
+                                     GAsyncResult *result,
+                                     gpointer user_data) {
+    get_directories_data_t *data = user_data;
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
         free_get_directories_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
+
+    if (data->directories) {
+        data->cb(data->directories, FALSE, data->user_data);
+        g_clear_pointer(&(data->directories), free_directories);
+    }
+
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_directories, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_directories_thread);
+    g_object_unref(task);
+}
+
+
+static void get_directory_count_thread(GTask *task, gpointer source_object,
+                                      gpointer task_data,
+                                      GCancellable *cancellable) {
+    get_directory_count_data_t *data = task_data;
+
+    gint64 trace_begin = mbgui_trace_begin();
+    mbgui_cache_directory_t count = {.path = data->directory->str};
+    gboolean stamp_valid =
+        mbgui_cache_get_stamp(data->directory->str, &(count.stamp));
+
+    if (!stamp_valid || !get_cached_count(data->directory->str, &(count.stamp),
+                                          &(data->unseen), &(data->total))) {
+        mbgui_maildir_count(data->directory->str, &(data->unseen),
+                            &(data->total));
+
+        if (stamp_valid) {
+            count.counted = TRUE;
+            count.unseen = data->unseen;
+            count.total = data->total;
+            set_cached_count(&count, TRUE);
+        }
+    }
+
+    mbgui_trace_end("count_messages", data->trace_id, data->directory->str,
+                    trace_begin);
+
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_get_directory_count(GObject *source_object,
+                                   GAsyncResult *result, gpointer user_data) {
+    get_directory_count_data_t *data = user_data;
+
+    if (!g_cancellable_is_cancelled(data->cancellable))
+        data->cb(data->directory->str, data->unseen, data->total,
+                 data->user_data);
+    free_get_directory_count_data(data);
+    mbgui_scheduler_done();
+}
+
+
+static void rename_messages_thread(GTask *task, gpointer source_object,
+                                   gpointer task_data,
+                                   GCancellable *cancellable) {
+    rename_messages_data_t *data = task_data;
+
+    for (gsize i = 0; data->paths[i]; ++i) {
+        if (!g_rename(data->paths[i], data->new_paths[i]))
+            continue;
+
+        g_printerr("can not rename %s: %s\n", data->paths[i],
+                   g_strerror(errno));
+        g_ptr_array_add(data->failed_paths, g_strdup(data->paths[i]));
+        g_ptr_array_add(data->failed_new_paths, g_strdup(data->new_paths[i]));
+    }
+
+    g_ptr_array_add(data->failed_paths, NULL);
+    g_ptr_array_add(data->failed_new_paths, NULL);
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_rename_messages(GObject *source_object, GAsyncResult *result,
+                               gpointer user_data) {
+    rename_messages_data_t *data = user_data;
+
+    data->cb((gchar **)data->failed_paths->pdata,
+             (gchar **)data->failed_new_paths->pdata, data->user_data);
+    free_rename_messages_data(data);
+    mbgui_scheduler_done();
+}
+
+
+static void get_message_parts_thread(GTask *task, gpointer source_object,
+                                     gpointer task_data,
+                                     GCancellable *cancellable) {
+    get_message_parts_data_t *data = task_data;
+
+    gint64 trace_begin = mbgui_trace_begin();
+    data->parts = mbgui_mime_get_parts(data->path->str);
+    mbgui_trace_end("scan_message_parts", data->trace_id, data->path->str,
+                    trace_begin);
+
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_get_message_parts(GObject *source_object,
+                                 GAsyncResult *result, gpointer user_data) {
+    get_message_parts_data_t *data = user_data;
+
+    // callback takes ownership of parts
+    if (!g_cancellable_is_cancelled(data->cancellable)) {
+        data->cb(data->path->str, data->parts, data->user_data);
+        data->parts = NULL;
+    }
+
+    free_get_message_parts_data(data);
+    mbgui_scheduler_done();
+}
+
+
+static void save_message_part_thread(GTask *task, gpointer source_object,
+                                     gpointer task_data,
+                                     GCancellable *cancellable) {
+    save_message_part_data_t *data = task_data;
+
+    GError *error = NULL;
+    data->success = mbgui_mime_save_part(data->path->str, data->offset,
+                                         data->length, data->encoding,
+                                         data->output, NULL, &error);
+    if (!data->success) {
+        g_printerr("can not save %s: %s\n", data->output, error->message);
+        g_error_free(error);
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_save_message_part(GObject *source_object,
+                                 GAsyncResult *result, gpointer user_data) {
+    save_message_part_data_t *data = user_data;
+
+    if (data->cb)
+        data->cb(data->output, data->success, data->user_data);
+    free_save_message_part_data(data);
+    mbgui_scheduler_done();
+}
+
+
+static gsize get_complete_utf8_len(const gchar *str, gsize len) {
+    for (gsize i = len; i > 0 && len - i < 4; --i) {
+        guchar c = str[i - 1];
+        if ((c & 0xc0) == 0x80)
+            continue;
+
+        gsize size = (c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1);
+        return (i - 1 + size > len ? i - 1 : len);
+    }
+    return len;
+}
+
+
+static void emit_message_chunk(get_message_data_t *data, gboolean done,
+                               gboolean truncated) {
+    // incomplete UTF-8 sequence is kept until next read
+    gsize len = data->pending->len;
+    if (!done || truncated)
+        len = get_complete_utf8_len(data->pending->str, len);
+
+    if (!len && !done)
+        return;
+
+    gchar *chunk = g_utf8_make_valid(data->pending->str, len);
+    g_string_erase(data->pending, 0, len);
+
+    gsize rest = (truncated ? data->position - data->pending->len : 0);
+
+    if (data->text) {
+        g_string_append(data->text, chunk);
+        if (done)
+            add_message_cache_entry(data->path->str, data->text, rest);
+    }
+
+    if (data->cb)
+        data->cb(data->path->str, chunk, done, rest, data->user_data);
+    g_free(chunk);
+}
+
+
+static void on_get_message_read(GObject *source_object, GAsyncResult *result,
+                                gpointer user_data) {
+    get_message_data_t *data = user_data;
+    GInputStream *stream = G_INPUT_STREAM(source_object);
+
+    gssize count = g_input_stream_read_finish(stream, result, NULL);
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        g_subprocess_force_exit(data->process);
+        free_get_message_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
+
+    if (count <= 0) {
+        emit_message_chunk(data, TRUE, FALSE);
+        free_get_message_data(data);
+        mbgui_scheduler_done();
         return;
     }
 
-    data->directories = add_directory(data->directories, line, line);
-    g_free(line);
+    // output before offset was already displayed
+    gsize position = data->position;
+    data->position += count;
+    if (data->position > data->offset) {
+        gsize skip = (position < data->offset ? data->offset - position : 0);
+        g_string_append_len(data->pending, data->buff + skip, count - skip);
+    }
+
+    if (data->limit && data->position >= data->offset + data->limit) {
+        emit_message_chunk(data, TRUE, TRUE);
+        g_subprocess_force_exit(data->process);
+        free_get_message_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
+
+    emit_message_chunk(data, FALSE, FALSE);
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_directories_read_line, data);
+    g_input_stream_read_async(stream, data->buff, sizeof(data->buff),
+                              G_PRIORITY_DEFAULT, data->cancellable,
+                              on_get_message_read, data);
 }
 
 
-static void on_get_directory_total_read_line(GObject *source_object,
-                                             GAsyncResult *result,
-                                             gpointer user_data) {
-    get_directory_total_data_t *data = user_data;
+static void start_get_directories(gpointer user_data) {
+    get_directories_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, NULL, data->trace_begin);
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_directories_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
+
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_directories_cache, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_directories_cache_thread);
+    g_object_unref(task);
+}
+
 
-    gchar *line =
-        g_data_input_stream_read_line_finish(data->stream, result, NULL, NULL);
+static void start_get_directory_count(gpointer user_data) {
+    get_directory_count_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, data->directory->str,
+                          data->trace_begin);
 
-    if (!line) {
-        data->cb(data->directory->str, data->total, data->user_data);
-        free_get_directory_total_data(data);
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_directory_count_data(data);
+        mbgui_scheduler_done();
         return;
     }
 
-    data->total += 1;
-    g_free(line);
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_directory_count, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_directory_count_thread);
+    g_object_unref(task);
+}
+
+
+static void get_messages_cache_thread(GTask *task, gpointer source_object,
+                                     gpointer task_data,
+                                     GCancellable *cancellable) {
+    get_messages_data_t *data = task_data;
+    gint64 trace_begin = mbgui_trace_begin();
+
+    data->stamp_valid =
+        mbgui_cache_get_stamp(data->directory->str, &(data->stamp));
+    // stale cache is threaded again with added messages
+    if (data->stamp_valid &&
+        mbgui_cache_load_messages(data->directory->str, &(data->stamp),
+                                  data->arena, &(data->messages),
+                                  &(data->cached_messages),
+                                  &(data->added_paths)))
+        data->cached = !data->cached_messages;
+
+    mbgui_trace_end("load_cache", data->trace_id, data->directory->str,
+                    trace_begin);
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static gboolean on_messages_batch(gpointer user_data) {
+    messages_batch_data_t *data = user_data;
+
+    if (!g_cancellable_is_cancelled(data->cancellable))
+        data->cb(data->directory->str, data->arena, data->messages, FALSE,
+                 data->user_data);
+    return G_SOURCE_REMOVE;
+}
+
+
+// batches are passed to main loop while remaining threads are built - last
+// batch is passed with result of request, which is dispatched after batches
+// as idle source of the same priority
+static void on_thread_batch(mbgui_message_t *messages, gpointer user_data) {
+    get_messages_data_t *data = user_data;
+
+    if (data->messages) {
+        messages_batch_data_t *batch = g_malloc(sizeof(messages_batch_data_t));
+        batch->directory = g_string_new(data->directory->str);
+        batch->cancellable =
+            (data->cancellable ? g_object_ref(data->cancellable) : NULL);
+        batch->cb = data->cb;
+        batch->user_data = data->user_data;
+        batch->arena = mbgui_message_arena_ref(data->arena);
+        batch->messages = data->messages;
+
+        GSource *source = g_idle_source_new();
+        g_source_set_priority(source, G_PRIORITY_DEFAULT);
+        g_source_set_callback(source, on_messages_batch, batch,
+                              (GDestroyNotify)free_messages_batch_data);
+        g_source_attach(source, data->context);
+        g_source_unref(source);
+    }
+
+    data->messages = messages;
+}
+
+
+static void get_messages_thread_thread(GTask *task, gpointer source_object,
+                                       gpointer task_data,
+                                       GCancellable *cancellable) {
+    get_messages_data_t *data = task_data;
+    gint64 trace_begin;
+
+    if (data->query) {
+        trace_begin = mbgui_trace_begin();
+        mbgui_index_sync(data->index, data->cancellable);
+        GPtrArray *paths =
+            mbgui_index_search(data->index, data->query, SEARCH_MAX_RESULTS);
+        g_ptr_array_add(paths, NULL);
+        data->paths = (gchar **)g_ptr_array_free(paths, FALSE);
+        mbgui_trace_end("search_index", data->trace_id, data->query,
+                        trace_begin);
+    }
+
+    trace_begin = mbgui_trace_begin();
+    if (data->paths)
+        data->messages =
+            mbgui_thread_scan(data->paths, data->arena, data->cancellable);
+    else if (data->cached_messages)
+        mbgui_thread_update(data->directory->str, data->cached_messages,
+                            data->added_paths, data->arena, data->cache_writer,
+                            data->cancellable, on_thread_batch, data);
+    else
+        mbgui_thread_messages(data->directory->str, data->arena,
+                              data->cache_writer, data->cancellable,
+                              on_thread_batch, data);
+
+    mbgui_trace_end("thread_messages", data->trace_id, data->directory->str,
+                    trace_begin);
+
+    // partial results of cancelled request are not cached
+    if (data->cache_writer && !g_cancellable_is_cancelled(data->cancellable)) {
+        trace_begin = mbgui_trace_begin();
+        mbgui_cache_writer_save(data->cache_writer, data->directory->str,
+                                &(data->stamp));
+        mbgui_trace_end("save_cache", data->trace_id, data->directory->str,
+                        trace_begin);
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_get_messages_thread(GObject *source_object,
+                                   GAsyncResult *result, gpointer user_data) {
+    get_messages_data_t *data = user_data;
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_messages_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_directory_total_read_line, data);
+    data->cb(data->directory->str, data->arena, data->messages, TRUE,
+             data->user_data);
+    free_get_messages_data(data);
+    mbgui_scheduler_done();
 }
 
 
-static void on_get_directory_unseen_read_line(GObject *source_object,
-                                              GAsyncResult *result,
-                                              gpointer user_data) {
-    get_directory_unseen_data_t *data = user_data;
+static void run_get_messages_thread(get_messages_data_t *data) {
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_messages_thread, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_messages_thread_thread);
+    g_object_unref(task);
+}
+
 
-    gchar *line =
-        g_data_input_stream_read_line_finish(data->stream, result, NULL, NULL);
+static void on_get_messages_cache(GObject *source_object, GAsyncResult *result,
+                                  gpointer user_data) {
+    get_messages_data_t *data = user_data;
 
-    if (!line) {
-        data->cb(data->directory->str, data->unseen, data->user_data);
-        free_get_directory_unseen_data(data);
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_messages_data(data);
+        mbgui_scheduler_done();
         return;
     }
 
-    data->unseen += 1;
-    g_free(line);
+    if (!data->cached) {
+        if (data->stamp_valid)
+            data->cache_writer = mbgui_cache_writer_new();
+        run_get_messages_thread(data);
+        return;
+    }
 
-    g_data_input_stream_read_line_async(
-        data->stream, 0, NULL, on_get_directory_unseen_read_line, data);
+    data->cb(data->directory->str, data->arena, data->messages, TRUE,
+             data->user_data);
+    free_get_messages_data(data);
+    mbgui_scheduler_done();
 }
 
 
-static void on_get_messages_read_line(GObject *source_object,
-                                      GAsyncResult *result,
-                                      gpointer user_data) {
+static void start_get_messages(gpointer user_data) {
     get_messages_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, data->directory->str,
+                          data->trace_begin);
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_messages_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
 
-    gchar *line =
-        g_data_input_stream_read_line_finish(data->stream, result, NULL, NULL);
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_messages_cache, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_messages_cache_thread);
+    g_object_unref(task);
+}
+
+
+static void start_scan_messages(gpointer user_data) {
+    get_messages_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, data->directory->str,
+                          data->trace_begin);
 
-    if (!line) {
-        data->messages = reverse_messages(data->messages);
-        data->cb(data->directory->str, data->messages, data->user_data);
+    if (g_cancellable_is_cancelled(data->cancellable)) {
         free_get_messages_data(data);
+        mbgui_scheduler_done();
         return;
     }
 
-    data->line_buff[data->line_buff_count++] = line;
+    run_get_messages_thread(data);
+}
 
-    if (data->line_buff_count >= 6) {
-        gsize depth = get_message_depth(data->line_buff[0]);
-        data->messages =
-            add_message(data->messages, depth, data->line_buff + 1);
 
-        for (gsize i = 0; i < data->line_buff_count; ++i)
-            g_free(data->line_buff[i]);
-        data->line_buff_count = 0;
+static void start_get_message_parts(gpointer user_data) {
+    get_message_parts_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, data->path->str,
+                          data->trace_begin);
+
+    if (g_cancellable_is_cancelled(data->cancellable)) {
+        free_get_message_parts_data(data);
+        mbgui_scheduler_done();
+        return;
     }
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_messages_read_line, data);
+    GTask *task =
+        g_task_new(NULL, data->cancellable, on_get_message_parts, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, get_message_parts_thread);
+    g_object_unref(task);
+}
+
+
+static void start_save_message_part(gpointer user_data) {
+    save_message_part_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, data->path->str,
+                          data->trace_begin);
+
+    GTask *task = g_task_new(NULL, NULL, on_save_message_part, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, save_message_part_thread);
+    g_object_unref(task);
 }
 
 
-static void on_get_message_read_all(GObject *source_object,
-                                    GAsyncResult *result, gpointer user_data) {
+static void start_rename_messages(gpointer user_data) {
+    rename_messages_data_t *data = user_data;
+    mbgui_trace_end_async("queued", data->trace_id, NULL, data->trace_begin);
+
+    GTask *task = g_task_new(NULL, NULL, on_rename_messages, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, rename_messages_thread);
+    g_object_unref(task);
+}
+
+
+static void start_get_message(gpointer user_data) {
     get_message_data_t *data = user_data;
-    GInputStream *stream = g_subprocess_get_stdout_pipe(data->process);
+    mbgui_trace_end_async("queued", data->trace_id, data->path->str,
+                          data->trace_begin);
+
+    message_cache_entry_t *entry =
+        (data->offset ? NULL : get_message_cache_entry(data->path->str));
 
-    gsize count = 0;
-    g_input_stream_read_all_finish(stream, result, &count, NULL);
-    g_string_append_len(data->message, data->buff, count);
+    if (entry || g_cancellable_is_cancelled(data->cancellable)) {
+        if (entry && data->cb)
+            data->cb(data->path->str, entry->text, TRUE, entry->rest,
+                     data->user_data);
+        free_get_message_data(data);
+        mbgui_scheduler_done();
+        return;
+    }
 
-    if (count < sizeof(data->buff)) {
-        data->cb(data->path->str, data->message->str, data->user_data);
+    // only complete previews (starting at offset 0) are cached
+    if (!data->offset && message_cache_max_size)
+        data->text = g_string_new(NULL);
+
+    process_count += 1;
+    data->trace_process = mbgui_trace_begin();
+    GError *error = NULL;
+    data->process = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, &error,
+                                     "mshow", data->path->str, NULL);
+    if (!data->process) {
+        g_printerr("can not run mshow for %s: %s\n", data->path->str,
+                   error->message);
+        g_error_free(error);
+        emit_message_chunk(data, TRUE, FALSE);
         free_get_message_data(data);
+        mbgui_scheduler_done();
         return;
     }
 
-    g_input_stream_read_all_async(stream, data->buff, sizeof(data->buff), 0,
-                                  NULL, on_get_message_read_all, data);
+    GInputStream *stream = g_subprocess_get_stdout_pipe(data->process);
+    g_input_stream_read_async(stream, data->buff, sizeof(data->buff),
+                              G_PRIORITY_DEFAULT, data->cancellable,
+                              on_get_message_read, data);
+}
+
+
+static gboolean is_watched_file(mbgui_watch_t *data, GFile *file) {
+    if (!file)
+        return FALSE;
+
+    GFile *parent = g_file_get_parent(file);
+    if (!parent)
+        return FALSE;
+
+    gboolean result = (g_file_equal(parent, data->subdirectories[0]) ||
+                       g_file_equal(parent, data->subdirectories[1]));
+    g_object_unref(parent);
+    return result;
 }
 
 
-void mbgui_get_directories(gchar **argv, mbgui_get_directories_cb_t cb,
-                           gpointer user_data) {
-    GStrvBuilder *new_argv_builder = g_strv_builder_new();
-    g_strv_builder_add_many(new_argv_builder, "mdirs", "-a", NULL);
-    g_strv_builder_addv(new_argv_builder, (const gchar **)argv);
+static void on_watch_directory_changed(GFileMonitor *monitor, GFile *file,
+                                       GFile *other_file,
+                                       GFileMonitorEvent event_type,
+                                       gpointer user_data) {
+    mbgui_watch_t *data = user_data;
+
+    gchar *name = g_file_get_basename(file);
+    gboolean hidden = (name[0] == '.');
+    g_free(name);
+    if (hidden)
+        return;
+
+    // moves between new/ and cur/ are reported once, as renames, by the
+    // monitor of the source subdirectory
+    gboolean other_watched = is_watched_file(data, other_file);
+    mbgui_watch_event_t event;
+
+    switch (event_type) {
+    case G_FILE_MONITOR_EVENT_CREATED:
+        event = MBGUI_WATCH_EVENT_ADDED;
+        break;
+    case G_FILE_MONITOR_EVENT_MOVED_IN:
+        if (other_watched)
+            return;
+        event = MBGUI_WATCH_EVENT_ADDED;
+        break;
+    case G_FILE_MONITOR_EVENT_DELETED:
+        event = MBGUI_WATCH_EVENT_REMOVED;
+        break;
+    case G_FILE_MONITOR_EVENT_MOVED_OUT:
+        event = (other_watched ? MBGUI_WATCH_EVENT_RENAMED
+                               : MBGUI_WATCH_EVENT_REMOVED);
+        break;
+    case G_FILE_MONITOR_EVENT_RENAMED:
+        event = MBGUI_WATCH_EVENT_RENAMED;
+        break;
+    default:
+        return;
+    }
+
+    gchar *path = g_file_get_path(file);
+    gchar *new_path = (event == MBGUI_WATCH_EVENT_RENAMED
+                           ? g_file_get_path(other_file)
+                           : NULL);
+
+    data->cb(data->directory->str, event, path, new_path, data->user_data);
+
+    g_free(path);
+    g_free(new_path);
+}
 
-    gchar **new_argv = g_strv_builder_end(new_argv_builder);
-    g_strv_builder_unref(new_argv_builder);
 
+void mbgui_get_directories(gchar **argv, GCancellable *cancellable,
+                           mbgui_get_directories_cb_t cb, gpointer user_data) {
     get_directories_data_t *data = g_malloc(sizeof(get_directories_data_t));
+    data->argv = g_strdupv(argv);
+    data->key = g_strjoinv("\n", argv);
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
     data->cb = cb;
     data->user_data = user_data;
+    data->paths = NULL;
     data->directories = NULL;
-    data->process = g_subprocess_newv((const gchar **)new_argv,
-                                      G_SUBPROCESS_FLAGS_STDOUT_PIPE, NULL);
-    data->stream =
-        g_data_input_stream_new(g_subprocess_get_stdout_pipe(data->process));
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_LIST, start_get_directories,
+                         data);
+}
+
+
+// waits for pending writes of message caches and writes snapshot of
+// directories found by mbgui_get_directories, with last counts, which is
+// shown by next mbgui_get_directories before search is done
+void mbgui_save_directories(void) {
+    mbgui_cache_flush();
+
+    if (!directory_lists)
+        return;
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_directories_read_line, data);
+    GHashTableIter iter;
+    gpointer key;
+    gpointer value;
+    g_hash_table_iter_init(&iter, directory_lists);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray *paths = value;
+        GArray *directories =
+            g_array_new(FALSE, TRUE, sizeof(mbgui_cache_directory_t));
+
+        g_mutex_lock(&directory_counts_mutex);
+        for (guint i = 0; i < paths->len; ++i) {
+            gchar *path = g_ptr_array_index(paths, i);
+            mbgui_cache_directory_t *count =
+                (directory_counts ? g_hash_table_lookup(directory_counts, path)
+                                  : NULL);
+            mbgui_cache_directory_t directory = {.path = path};
+            if (count) {
+                directory = *count;
+                directory.path = path;
+            }
+            g_array_append_val(directories, directory);
+        }
+        g_mutex_unlock(&directory_counts_mutex);
 
-    g_strfreev(new_argv);
+        mbgui_cache_save_directories(key, directories);
+        g_array_free(directories, TRUE);
+    }
 }
 
 
-void mbgui_get_directory_total(gchar *directory,
-                               mbgui_get_directory_total_cb_t cb,
+void mbgui_get_directory_count(gchar *directory, GCancellable *cancellable,
+                               mbgui_get_directory_count_cb_t cb,
                                gpointer user_data) {
-    get_directory_total_data_t *data =
-        g_malloc(sizeof(get_directory_total_data_t));
+    get_directory_count_data_t *data =
+        g_malloc(sizeof(get_directory_count_data_t));
     data->directory = g_string_new(directory);
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
     data->cb = cb;
     data->user_data = user_data;
+    data->unseen = 0;
     data->total = 0;
-    data->process = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, NULL,
-                                     "mlist", directory, NULL);
-    data->stream =
-        g_data_input_stream_new(g_subprocess_get_stdout_pipe(data->process));
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_directory_total_read_line, data);
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_BACKGROUND,
+                         start_get_directory_count, data);
 }
 
 
-void mbgui_get_directory_unseen(gchar *directory,
-                                mbgui_get_directory_unseen_cb_t cb,
-                                gpointer user_data) {
-    get_directory_unseen_data_t *data =
-        g_malloc(sizeof(get_directory_unseen_data_t));
+static get_messages_data_t *
+new_get_messages_data(gchar *directory, GCancellable *cancellable,
+                      mbgui_get_messages_cb_t cb, gpointer user_data) {
+    get_messages_data_t *data = g_malloc(sizeof(get_messages_data_t));
     data->directory = g_string_new(directory);
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
     data->cb = cb;
     data->user_data = user_data;
-    data->unseen = 0;
-    data->process = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, NULL,
-                                     "mlist", "-s", directory, NULL);
-    data->stream =
-        g_data_input_stream_new(g_subprocess_get_stdout_pipe(data->process));
+    data->arena = mbgui_message_arena_new();
+    data->messages = NULL;
+    data->cache_writer = NULL;
+    data->cached_messages = NULL;
+    data->added_paths = NULL;
+    data->cached = FALSE;
+    data->stamp_valid = FALSE;
+    data->paths = NULL;
+    data->query = NULL;
+    data->index = NULL;
+    data->context = g_main_context_ref_thread_default();
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
+    return data;
+}
+
 
-    g_data_input_stream_read_line_async(
-        data->stream, 0, NULL, on_get_directory_unseen_read_line, data);
+void mbgui_get_messages(gchar *directory, GCancellable *cancellable,
+                        mbgui_get_messages_cb_t cb, gpointer user_data) {
+    get_messages_data_t *data =
+        new_get_messages_data(directory, cancellable, cb, user_data);
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_LIST, start_get_messages,
+                         data);
 }
 
 
-void mbgui_get_messages(gchar *directory, mbgui_get_messages_cb_t cb,
-                        gpointer user_data) {
-    get_messages_data_t *data = g_malloc(sizeof(get_messages_data_t));
-    data->directory = g_string_new(directory), data->cb = cb;
-    data->user_data = user_data;
-    data->messages = NULL;
-    data->line_buff_count = 0;
-    data->mlist_stdout_fd = -1;
-    data->mthread_stdout_fd = -1;
-    data->mscan_stdout_fd = -1;
-    data->mscan_stdout = NULL;
-    data->stream = NULL;
-
-    const gchar *mlist_argv[] = {"mlist", directory, NULL};
-    if (!g_spawn_async_with_pipes_and_fds(
-            NULL, mlist_argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, -1, -1, -1,
-            NULL, NULL, 0, NULL, NULL, &(data->mlist_stdout_fd), NULL, NULL)) {
-        g_printerr(">> mlist err");
-        free_get_messages_data(data);
-        return;
-    }
+void mbgui_scan_messages(gchar *directory, gchar **paths,
+                         GCancellable *cancellable, mbgui_get_messages_cb_t cb,
+                         gpointer user_data) {
+    get_messages_data_t *data =
+        new_get_messages_data(directory, cancellable, cb, user_data);
+    data->paths = g_strdupv(paths);
 
-    const gchar *mthread_argv[] = {"mthread", "-r", NULL};
-    if (!g_spawn_async_with_pipes_and_fds(
-            NULL, mthread_argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
-            data->mlist_stdout_fd, -1, -1, NULL, NULL, 0, NULL, NULL,
-            &(data->mthread_stdout_fd), NULL, NULL)) {
-        g_printerr(">> mthread err");
-        free_get_messages_data(data);
-        return;
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_LIST, start_scan_messages,
+                         data);
+}
+
+
+static mbgui_index_t *get_index(gchar *directory) {
+    if (!indexes)
+        indexes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)mbgui_index_free);
+
+    mbgui_index_t *index = g_hash_table_lookup(indexes, directory);
+    if (!index) {
+        index = mbgui_index_new(directory);
+        g_hash_table_insert(indexes, g_strdup(directory), index);
     }
+    return index;
+}
 
-    const gchar *mscan_argv[] = {"mscan", "-f", "%i\n%R\n%u\n%s\n%f\n%D", NULL};
-    if (!g_spawn_async_with_pipes_and_fds(
-            NULL, mscan_argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL,
-            data->mthread_stdout_fd, -1, -1, NULL, NULL, 0, NULL, NULL,
-            &(data->mscan_stdout_fd), NULL, NULL)) {
-        g_printerr(">> mscan err");
-        free_get_messages_data(data);
+
+void mbgui_search_messages(gchar *directory, gchar *query,
+                           GCancellable *cancellable,
+                           mbgui_get_messages_cb_t cb, gpointer user_data) {
+    get_messages_data_t *data =
+        new_get_messages_data(directory, cancellable, cb, user_data);
+    data->query = g_strdup(query);
+    data->index = get_index(directory);
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_LIST, start_scan_messages,
+                         data);
+}
+
+
+static void update_index(gpointer task, gpointer user_data) {
+    update_index_data_t *data = task;
+
+    mbgui_index_update(data->index, data->event, data->path, data->new_path);
+
+    g_free(data->path);
+    g_free(data->new_path);
+    g_free(data);
+}
+
+
+void mbgui_update_index(gchar *directory, mbgui_watch_event_t event,
+                        gchar *path, gchar *new_path) {
+    mbgui_index_t *index =
+        (indexes ? g_hash_table_lookup(indexes, directory) : NULL);
+    if (!index)
         return;
-    }
 
-    data->mscan_stdout = g_unix_input_stream_new(data->mscan_stdout_fd, FALSE);
-    data->stream = g_data_input_stream_new(data->mscan_stdout);
+    // updates are applied in order of events
+    if (!update_index_pool)
+        update_index_pool =
+            g_thread_pool_new(update_index, NULL, 1, FALSE, NULL);
+
+    update_index_data_t *data = g_malloc(sizeof(update_index_data_t));
+    data->index = index;
+    data->event = event;
+    data->path = g_strdup(path);
+    data->new_path = g_strdup(new_path);
+    g_thread_pool_push(update_index_pool, data, NULL);
+}
+
+
+// renames are not cancellable - callback receives renames, which failed
+void mbgui_rename_messages(gchar **paths, gchar **new_paths,
+                           mbgui_rename_messages_cb_t cb, gpointer user_data) {
+    rename_messages_data_t *data = g_malloc(sizeof(rename_messages_data_t));
+    data->paths = g_strdupv(paths);
+    data->new_paths = g_strdupv(new_paths);
+    data->cb = cb;
+    data->user_data = user_data;
+    data->failed_paths = g_ptr_array_new_with_free_func(g_free);
+    data->failed_new_paths = g_ptr_array_new_with_free_func(g_free);
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
 
-    g_data_input_stream_read_line_async(data->stream, 0, NULL,
-                                        on_get_messages_read_line, data);
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_INTERACTIVE,
+                         start_rename_messages, data);
 }
 
 
-void mbgui_get_message(gchar *path, mbgui_get_message_cb_t cb,
-                       gpointer user_data) {
+static get_message_data_t *
+new_get_message_data(gchar *path, gsize offset, gsize limit,
+                     GCancellable *cancellable, mbgui_get_message_cb_t cb,
+                     gpointer user_data) {
     get_message_data_t *data = g_malloc(sizeof(get_message_data_t));
     data->path = g_string_new(path);
+    data->offset = offset;
+    data->limit = limit;
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
     data->cb = cb;
     data->user_data = user_data;
-    data->message = g_string_new("");
-    data->process = g_subprocess_new(G_SUBPROCESS_FLAGS_STDOUT_PIPE, NULL,
-                                     "mshow", path, NULL);
+    data->position = 0;
+    data->pending = g_string_new("");
+    data->text = NULL;
+    data->process = NULL;
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
+    data->trace_process = 0;
+    return data;
+}
 
-    GInputStream *stream = g_subprocess_get_stdout_pipe(data->process);
-    g_input_stream_read_all_async(stream, data->buff, sizeof(data->buff), 0,
-                                  NULL, on_get_message_read_all, data);
+
+void mbgui_get_message(gchar *path, gsize offset, gsize limit,
+                       GCancellable *cancellable, mbgui_get_message_cb_t cb,
+                       gpointer user_data) {
+    get_message_data_t *data =
+        new_get_message_data(path, offset, limit, cancellable, cb, user_data);
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_INTERACTIVE,
+                         start_get_message, data);
+}
+
+
+// only structure of message is scanned - parts are decoded when saved
+void mbgui_get_message_parts(gchar *path, GCancellable *cancellable,
+                             mbgui_get_message_parts_cb_t cb,
+                             gpointer user_data) {
+    get_message_parts_data_t *data =
+        g_malloc(sizeof(get_message_parts_data_t));
+    data->path = g_string_new(path);
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
+    data->cb = cb;
+    data->user_data = user_data;
+    data->parts = NULL;
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_INTERACTIVE,
+                         start_get_message_parts, data);
+}
+
+
+// saving is not cancellable - part is written to `output` in chunks
+void mbgui_save_message_part(gchar *path, mbgui_message_part_t *part,
+                             gchar *output, mbgui_save_message_part_cb_t cb,
+                             gpointer user_data) {
+    save_message_part_data_t *data =
+        g_malloc(sizeof(save_message_part_data_t));
+    data->path = g_string_new(path);
+    data->offset = part->offset;
+    data->length = part->length;
+    data->encoding = g_strdup(part->encoding);
+    data->output = g_strdup(output);
+    data->cb = cb;
+    data->user_data = user_data;
+    data->success = FALSE;
+    data->trace_id = mbgui_trace_next_id();
+    data->trace_begin = mbgui_trace_begin();
+
+    mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_INTERACTIVE,
+                         start_save_message_part, data);
+}
+
+
+void mbgui_free_message_parts(mbgui_message_part_t *parts) {
+    while (parts) {
+        mbgui_message_part_t *next = parts->next;
+        g_free(parts->type);
+        g_free(parts->name);
+        g_free(parts->encoding);
+        g_free(parts);
+        parts = next;
+    }
+}
+
+
+void mbgui_prefetch_messages(gchar **paths, gsize limit) {
+    // previous prefetches, queued or running, are no longer needed
+    if (prefetch_cancellable) {
+        g_cancellable_cancel(prefetch_cancellable);
+        g_object_unref(prefetch_cancellable);
+    }
+    prefetch_cancellable = g_cancellable_new();
+
+    for (gchar **path = paths; *path; ++path) {
+        if (message_cache && g_hash_table_contains(message_cache, *path))
+            continue;
+
+        get_message_data_t *data = new_get_message_data(
+            *path, 0, limit, prefetch_cancellable, NULL, NULL);
+
+        mbgui_scheduler_push(MBGUI_SCHEDULER_PRIORITY_BACKGROUND,
+                             start_get_message, data);
+    }
+}
+
+
+gsize mbgui_get_process_count(void) { return process_count; }
+
+
+void mbgui_set_message_cache_size(gsize size) {
+    message_cache_max_size = size;
+    if (message_cache)
+        shrink_message_cache();
+}
+
+
+mbgui_watch_t *mbgui_watch_directory(gchar *directory,
+                                     mbgui_watch_directory_cb_t cb,
+                                     gpointer user_data) {
+    mbgui_watch_t *data = g_malloc(sizeof(mbgui_watch_t));
+    data->directory = g_string_new(directory);
+    data->cb = cb;
+    data->user_data = user_data;
+
+    const gchar *subdirectories[] = {"new", "cur"};
+    for (gsize i = 0; i < 2; ++i) {
+        gchar *path = g_build_filename(directory, subdirectories[i], NULL);
+        data->subdirectories[i] = g_file_new_for_path(path);
+
+        GError *error = NULL;
+        data->monitors[i] =
+            g_file_monitor_directory(data->subdirectories[i],
+                                     G_FILE_MONITOR_WATCH_MOVES, NULL, &error);
+        if (data->monitors[i]) {
+            g_signal_connect(data->monitors[i], "changed",
+                             G_CALLBACK(on_watch_directory_changed), data);
+        } else {
+            g_printerr("can not watch %s: %s\n", path, error->message);
+            g_error_free(error);
+        }
+
+        g_free(path);
+    }
+
+    return data;
+}
+
+
+void mbgui_unwatch_directory(mbgui_watch_t *watch) {
+    for (gsize i = 0; i < 2; ++i) {
+        if (watch->monitors[i]) {
+            g_signal_handlers_disconnect_by_data(watch->monitors[i], watch);
+            g_file_monitor_cancel(watch->monitors[i]);
+            g_object_unref(watch->monitors[i]);
+        }
+        g_object_unref(watch->subdirectories[i]);
+    }
+
+    g_string_free(watch->directory, TRUE);
+    g_free(watch);
 }
@@ -1,7 +1,7 @@
 #ifndef MBGUI_MBLAZE_H
 #define MBGUI_MBLAZE_H
 
-#include <glib.h>
+#include <gio/gio.h>
 
 
 typedef enum {
@@ -12,48 +12,116 @@ typedef enum {
     MBGUI_MSG_STATUS_VIRTUAL = 'v'
 } mbgui_message_status_t;
 
+typedef enum {
+    MBGUI_WATCH_EVENT_ADDED,
+    MBGUI_WATCH_EVENT_REMOVED,
+    MBGUI_WATCH_EVENT_RENAMED
+} mbgui_watch_event_t;
+
 typedef struct mbgui_directory_t {
     GString *path;
     GString *name;
+    gboolean counted;
+    gsize unseen;
+    gsize total;
     struct mbgui_directory_t *children;
     struct mbgui_directory_t *next;
 } mbgui_directory_t;
 
 typedef struct mbgui_message_t {
-    GString *path;
+    const gchar *path;
     mbgui_message_status_t status;
-    GString *subject;
-    GString *sender;
-    GString *date;
+    guint index;
+    const gchar *subject;
+    const gchar *sender;
+    const gchar *date;
+    const gchar *key;
+    const gchar *subject_key;
+    const gchar *sender_key;
+    gint64 timestamp;
+    gboolean hidden;
+    struct mbgui_message_t *parent;
     struct mbgui_message_t *children;
     struct mbgui_message_t *next;
 } mbgui_message_t;
 
+typedef struct mbgui_message_part_t {
+    gchar *type;
+    gchar *name;
+    gchar *encoding;
+    gsize offset;
+    gsize length;
+    gsize size;
+    struct mbgui_message_part_t *next;
+} mbgui_message_part_t;
+
+typedef struct mbgui_message_arena_t mbgui_message_arena_t;
+typedef struct mbgui_watch_t mbgui_watch_t;
+
 
 typedef void (*mbgui_get_directories_cb_t)(mbgui_directory_t *directories,
-                                           gpointer user_data);
-typedef void (*mbgui_get_directory_total_cb_t)(gchar *directory, gsize total,
-                                               gpointer user_data);
-typedef void (*mbgui_get_directory_unseen_cb_t)(gchar *directory, gsize unseen,
-                                                gpointer user_data);
+                                           gboolean done, gpointer user_data);
+typedef void (*mbgui_get_directory_count_cb_t)(gchar *directory, gsize unseen,
+                                               gsize total, gpointer user_data);
 typedef void (*mbgui_get_messages_cb_t)(gchar *directory,
+                                        mbgui_message_arena_t *arena,
                                         mbgui_message_t *messages,
-                                        gpointer user_data);
-typedef void (*mbgui_get_message_cb_t)(gchar *path, gchar *message,
+                                        gboolean done, gpointer user_data);
+typedef void (*mbgui_get_message_cb_t)(gchar *path, gchar *chunk,
+                                       gboolean done, gsize rest,
                                        gpointer user_data);
+typedef void (*mbgui_watch_directory_cb_t)(gchar *directory,
+                                           mbgui_watch_event_t event,
+                                           gchar *path, gchar *new_path,
+                                           gpointer user_data);
+typedef void (*mbgui_get_message_parts_cb_t)(gchar *path,
+                                             mbgui_message_part_t *parts,
+                                             gpointer user_data);
+typedef void (*mbgui_save_message_part_cb_t)(gchar *output, gboolean success,
+                                             gpointer user_data);
+typedef void (*mbgui_rename_messages_cb_t)(gchar **paths, gchar **new_paths,
+                                           gpointer user_data);
+
 
+mbgui_message_arena_t *mbgui_message_arena_ref(mbgui_message_arena_t *arena);
+void mbgui_message_arena_unref(mbgui_message_arena_t *arena);
 
-void mbgui_get_directories(gchar **argv, mbgui_get_directories_cb_t cb,
-                           gpointer user_data);
-void mbgui_get_directory_total(gchar *directory,
-                               mbgui_get_directory_total_cb_t cb,
+// callbacks are not called after request is cancelled
+void mbgui_get_directories(gchar **argv, GCancellable *cancellable,
+                           mbgui_get_directories_cb_t cb, gpointer user_data);
+void mbgui_save_directories(void);
+void mbgui_get_directory_count(gchar *directory, GCancellable *cancellable,
+                               mbgui_get_directory_count_cb_t cb,
                                gpointer user_data);
-void mbgui_get_directory_unseen(gchar *directory,
-                                mbgui_get_directory_unseen_cb_t cb,
-                                gpointer user_data);
-void mbgui_get_messages(gchar *directory, mbgui_get_messages_cb_t cb,
-                        gpointer user_data);
-void mbgui_get_message(gchar *path, mbgui_get_message_cb_t cb,
+void mbgui_get_messages(gchar *directory, GCancellable *cancellable,
+                        mbgui_get_messages_cb_t cb, gpointer user_data);
+void mbgui_scan_messages(gchar *directory, gchar **paths,
+                         GCancellable *cancellable, mbgui_get_messages_cb_t cb,
+                         gpointer user_data);
+void mbgui_search_messages(gchar *directory, gchar *query,
+                           GCancellable *cancellable,
+                           mbgui_get_messages_cb_t cb, gpointer user_data);
+void mbgui_get_message(gchar *path, gsize offset, gsize limit,
+                       GCancellable *cancellable, mbgui_get_message_cb_t cb,
                        gpointer user_data);
+void mbgui_get_message_parts(gchar *path, GCancellable *cancellable,
+                             mbgui_get_message_parts_cb_t cb,
+                             gpointer user_data);
+void mbgui_save_message_part(gchar *path, mbgui_message_part_t *part,
+                             gchar *output, mbgui_save_message_part_cb_t cb,
+                             gpointer user_data);
+void mbgui_free_message_parts(mbgui_message_part_t *parts);
+void mbgui_prefetch_messages(gchar **paths, gsize limit);
+void mbgui_set_message_cache_size(gsize size);
+gsize mbgui_get_process_count(void);
+mbgui_watch_t *mbgui_watch_directory(gchar *directory,
+                                     mbgui_watch_directory_cb_t cb,
+                                     gpointer user_data);
+// callback is not called after directory is unwatched
+void mbgui_unwatch_directory(mbgui_watch_t *watch);
+void mbgui_update_index(gchar *directory, mbgui_watch_event_t event,
+                        gchar *path, gchar *new_path);
+void mbgui_rename_messages(gchar **paths, gchar **new_paths,
+                           mbgui_rename_messages_cb_t cb, gpointer user_data);
 
 #endif
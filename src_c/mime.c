@@ -0,0 +1,555 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "mime.h"
+
+
+#define READ_SIZE (1024 * 1024)
+#define DECODE_SIZE (64 * 1024)
+#define MAX_DEPTH 8
+
+
+typedef struct {
+    const gchar *headers;
+    gsize headers_len;
+    const gchar *body;
+    gsize body_len;
+} part_t;
+
+typedef gboolean (*part_cb_t)(part_t *part, gpointer user_data);
+
+typedef struct {
+    gsize limit;
+    gsize depth;
+    GString *result;
+} text_data_t;
+
+typedef struct {
+    const gchar *contents;
+    gsize depth;
+    mbgui_message_part_t **tail;
+} parts_data_t;
+
+
+static gchar *read_file(const gchar *path, gsize *len) {
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    gchar *buff = g_malloc(READ_SIZE + 1);
+    gsize size = 0;
+
+    while (size < READ_SIZE) {
+        gssize count = pread(fd, buff + size, READ_SIZE - size, size);
+        if (count <= 0)
+            break;
+        size += count;
+    }
+
+    close(fd);
+    buff[size] = '\0';
+    *len = size;
+    return buff;
+}
+
+
+static const gchar *find_line(const gchar *str, gsize len, gsize *line_len) {
+    const gchar *end = memchr(str, '\n', len);
+    *line_len = (end ? end - str : len);
+    return (end ? end + 1 : str + len);
+}
+
+
+static gsize trim_line(const gchar *line, gsize len) {
+    return (len && line[len - 1] == '\r' ? len - 1 : len);
+}
+
+
+static void split_part(const gchar *str, gsize len, part_t *part) {
+    const gchar *i = str;
+    const gchar *end = str + len;
+
+    while (i < end) {
+        gsize line_len;
+        const gchar *next = find_line(i, end - i, &line_len);
+        if (!trim_line(i, line_len)) {
+            part->headers = str;
+            part->headers_len = i - str;
+            part->body = next;
+            part->body_len = end - next;
+            return;
+        }
+        i = next;
+    }
+
+    part->headers = str;
+    part->headers_len = len;
+    part->body = end;
+    part->body_len = 0;
+}
+
+
+// returns unfolded value of first header with `name` or NULL
+static gchar *get_header(part_t *part, const gchar *name) {
+    gsize name_len = strlen(name);
+    const gchar *i = part->headers;
+    const gchar *end = part->headers + part->headers_len;
+
+    while (i < end) {
+        gsize line_len;
+        const gchar *next = find_line(i, end - i, &line_len);
+
+        if (line_len > name_len && i[name_len] == ':' &&
+            !g_ascii_strncasecmp(i, name, name_len)) {
+            GString *value = g_string_new_len(
+                i + name_len + 1, trim_line(i, line_len) - name_len - 1);
+
+            while (next < end && (*next == ' ' || *next == '\t')) {
+                i = next;
+                next = find_line(i, end - i, &line_len);
+                g_string_append_len(value, i, trim_line(i, line_len));
+            }
+
+            return g_strstrip(g_string_free(value, FALSE));
+        }
+
+        i = next;
+    }
+
+    return NULL;
+}
+
+
+static gchar *get_parameter(const gchar *value, const gchar *name) {
+    gsize name_len = strlen(name);
+
+    for (const gchar *i = strchr(value, ';'); i; i = strchr(i + 1, ';')) {
+        const gchar *param = i + 1;
+        while (g_ascii_isspace(*param))
+            ++param;
+
+        if (g_ascii_strncasecmp(param, name, name_len) ||
+            param[name_len] != '=')
+            continue;
+
+        param += name_len + 1;
+        if (*param == '"') {
+            const gchar *param_end = strchr(param + 1, '"');
+            if (!param_end)
+                param_end = param + strlen(param);
+            return g_strndup(param + 1, param_end - param - 1);
+        }
+
+        return g_strndup(param, strcspn(param, "; \t"));
+    }
+
+    return NULL;
+}
+
+
+static GString *decode_quoted_printable(const gchar *str, gsize len) {
+    GString *result = g_string_sized_new(len);
+
+    for (gsize i = 0; i < len; ++i) {
+        if (str[i] != '=') {
+            g_string_append_c(result, str[i]);
+            continue;
+        }
+
+        // soft line break
+        gsize j = i + 1;
+        while (j < len && (str[j] == ' ' || str[j] == '\t'))
+            ++j;
+        if (j < len && str[j] == '\r')
+            ++j;
+        if (j < len && str[j] == '\n') {
+            i = j;
+            continue;
+        }
+
+        if (i + 2 < len && g_ascii_isxdigit(str[i + 1]) &&
+            g_ascii_isxdigit(str[i + 2])) {
+            g_string_append_c(result, (g_ascii_xdigit_value(str[i + 1]) << 4) |
+                                          g_ascii_xdigit_value(str[i + 2]));
+            i += 2;
+            continue;
+        }
+
+        g_string_append_c(result, str[i]);
+    }
+
+    return result;
+}
+
+
+static GString *decode_base64(const gchar *str, gsize len) {
+    GString *result = g_string_sized_new(len * 3 / 4 + 3);
+    gint state = 0;
+    guint save = 0;
+
+    result->len = g_base64_decode_step(str, len, (guchar *)result->str, &state,
+                                       &save);
+    result->str[result->len] = '\0';
+    return result;
+}
+
+
+static void strip_html(GString *text) {
+    gsize count = 0;
+    gboolean tag = FALSE;
+
+    for (gsize i = 0; i < text->len; ++i) {
+        if (text->str[i] == '<') {
+            tag = TRUE;
+        } else if (text->str[i] == '>' && tag) {
+            tag = FALSE;
+            text->str[count++] = ' ';
+        } else if (!tag) {
+            text->str[count++] = text->str[i];
+        }
+    }
+
+    g_string_truncate(text, count);
+}
+
+
+static void append_text(part_t *part, const gchar *type,
+                        const gchar *content_type, GString *result) {
+    gchar *encoding = get_header(part, "content-transfer-encoding");
+
+    GString *text;
+    if (encoding && !g_ascii_strcasecmp(encoding, "base64"))
+        text = decode_base64(part->body, part->body_len);
+    else if (encoding && !g_ascii_strcasecmp(encoding, "quoted-printable"))
+        text = decode_quoted_printable(part->body, part->body_len);
+    else
+        text = g_string_new_len(part->body, part->body_len);
+    g_free(encoding);
+
+    if (!strcmp(type, "text/html"))
+        strip_html(text);
+
+    gchar *charset =
+        (content_type ? get_parameter(content_type, "charset") : NULL);
+    gchar *converted =
+        (charset ? g_convert(text->str, text->len, "UTF-8", charset, NULL,
+                             NULL, NULL)
+                 : NULL);
+    gchar *valid = (converted ? g_utf8_make_valid(converted, -1)
+                              : g_utf8_make_valid(text->str, text->len));
+
+    g_string_append(result, valid);
+    g_string_append_c(result, '\n');
+
+    g_free(valid);
+    g_free(converted);
+    g_free(charset);
+    g_string_free(text, TRUE);
+}
+
+
+// calls `cb` for each part of multipart body, until it returns FALSE
+static void split_multipart(part_t *part, const gchar *boundary, part_cb_t cb,
+                            gpointer user_data) {
+    gsize boundary_len = strlen(boundary);
+    const gchar *i = part->body;
+    const gchar *end = part->body + part->body_len;
+    const gchar *part_begin = NULL;
+
+    while (i < end) {
+        gsize line_len;
+        const gchar *next = find_line(i, end - i, &line_len);
+
+        if (line_len >= boundary_len + 2 && i[0] == '-' && i[1] == '-' &&
+            !strncmp(i + 2, boundary, boundary_len)) {
+            // line break before boundary belongs to boundary
+            if (part_begin) {
+                const gchar *part_end = i;
+                if (part_end > part_begin && part_end[-1] == '\n')
+                    --part_end;
+                if (part_end > part_begin && part_end[-1] == '\r')
+                    --part_end;
+
+                part_t subpart;
+                split_part(part_begin, part_end - part_begin, &subpart);
+                if (!cb(&subpart, user_data))
+                    return;
+            }
+
+            const gchar *suffix = i + 2 + boundary_len;
+            if (line_len >= boundary_len + 4 && suffix[0] == '-' &&
+                suffix[1] == '-')
+                break;
+
+            part_begin = next;
+        }
+
+        i = next;
+    }
+}
+
+
+static gchar *get_type(const gchar *content_type) {
+    return g_ascii_strdown(
+        content_type ? content_type : "text/plain",
+        (content_type ? (gssize)strcspn(content_type, "; \t") : -1));
+}
+
+
+// `cb` is called for parts of multipart and message/rfc822 body, with
+// increased depth
+static gboolean split_container(part_t *part, const gchar *type,
+                                const gchar *content_type, gsize *depth,
+                                part_cb_t cb, gpointer user_data) {
+    if (g_str_has_prefix(type, "multipart/")) {
+        gchar *boundary = get_parameter(content_type, "boundary");
+        *depth += 1;
+        if (boundary)
+            split_multipart(part, boundary, cb, user_data);
+        *depth -= 1;
+        g_free(boundary);
+        return TRUE;
+    }
+
+    if (!strcmp(type, "message/rfc822")) {
+        part_t message;
+        split_part(part->body, part->body_len, &message);
+        *depth += 1;
+        cb(&message, user_data);
+        *depth -= 1;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+static gboolean append_part(part_t *part, gpointer user_data) {
+    text_data_t *data = user_data;
+    if (data->depth > MAX_DEPTH || data->result->len >= data->limit)
+        return FALSE;
+
+    gchar *content_type = get_header(part, "content-type");
+    gchar *type = get_type(content_type);
+
+    if (!split_container(part, type, content_type, &(data->depth),
+                         append_part, data) &&
+        (!strcmp(type, "text/plain") || !strcmp(type, "text/html")))
+        append_text(part, type, content_type, data->result);
+
+    g_free(type);
+    g_free(content_type);
+    return TRUE;
+}
+
+
+static gchar *get_part_name(part_t *part, const gchar *content_type) {
+    gchar *disposition = get_header(part, "content-disposition");
+    gchar *name = NULL;
+
+    // RFC 2231 value without continuations
+    gchar *extended =
+        (disposition ? get_parameter(disposition, "filename*") : NULL);
+    const gchar *encoded = (extended ? strstr(extended, "''") : NULL);
+    if (encoded)
+        name = g_uri_unescape_string(encoded + 2, NULL);
+
+    if (!name && disposition)
+        name = get_parameter(disposition, "filename");
+    if (!name && content_type)
+        name = get_parameter(content_type, "name");
+
+    g_free(extended);
+    g_free(disposition);
+
+    if (!name)
+        return NULL;
+
+    // name is used as file name of opened part
+    g_strdelimit(name, "/", '_');
+    if (!name[0] || !strcmp(name, ".") || !strcmp(name, "..")) {
+        g_free(name);
+        return NULL;
+    }
+
+    gchar *valid = g_utf8_make_valid(name, -1);
+    g_free(name);
+    return valid;
+}
+
+
+static gboolean add_part(part_t *part, gpointer user_data) {
+    parts_data_t *data = user_data;
+    if (data->depth > MAX_DEPTH)
+        return FALSE;
+
+    gchar *content_type = get_header(part, "content-type");
+    gchar *type = get_type(content_type);
+
+    if (!split_container(part, type, content_type, &(data->depth), add_part,
+                         data)) {
+        // text parts without file name are displayed as message text
+        gchar *name = get_part_name(part, content_type);
+        gboolean text =
+            (!strcmp(type, "text/plain") || !strcmp(type, "text/html"));
+
+        if (name || !text) {
+            gchar *encoding = get_header(part, "content-transfer-encoding");
+
+            mbgui_message_part_t *result =
+                g_malloc(sizeof(mbgui_message_part_t));
+            result->type = g_utf8_make_valid(type, -1);
+            result->name = name;
+            result->encoding = (encoding ? g_ascii_strdown(encoding, -1)
+                                         : g_strdup("7bit"));
+            result->offset = part->body - data->contents;
+            result->length = part->body_len;
+            result->size = (!strcmp(result->encoding, "base64")
+                                ? part->body_len * 3 / 4
+                                : part->body_len);
+            result->next = NULL;
+
+            *(data->tail) = result;
+            data->tail = &(result->next);
+            g_free(encoding);
+        } else {
+            g_free(name);
+        }
+    }
+
+    g_free(type);
+    g_free(content_type);
+    return TRUE;
+}
+
+
+static gboolean write_part(GOutputStream *stream, const gchar *body,
+                           gsize len, const gchar *encoding,
+                           GCancellable *cancellable, GError **error) {
+    gboolean base64 = !strcmp(encoding, "base64");
+    gboolean quoted_printable = !strcmp(encoding, "quoted-printable");
+    guchar *buff = (base64 ? g_malloc(DECODE_SIZE) : NULL);
+    gint state = 0;
+    guint save = 0;
+    gboolean result = TRUE;
+
+    for (const gchar *i = body, *end = body + len; result && i < end;) {
+        gsize chunk_len = MIN(DECODE_SIZE, (gsize)(end - i));
+
+        // quoted-printable chunks end with line, so escapes are not split
+        if (quoted_printable && i + chunk_len < end) {
+            const gchar *line_end = g_strrstr_len(i, chunk_len, "\n");
+            if (line_end)
+                chunk_len = line_end + 1 - i;
+        }
+
+        if (base64) {
+            gsize count =
+                g_base64_decode_step(i, chunk_len, buff, &state, &save);
+            result = g_output_stream_write_all(stream, buff, count, NULL,
+                                               cancellable, error);
+        } else if (quoted_printable) {
+            GString *text = decode_quoted_printable(i, chunk_len);
+            result = g_output_stream_write_all(stream, text->str, text->len,
+                                               NULL, cancellable, error);
+            g_string_free(text, TRUE);
+        } else {
+            result = g_output_stream_write_all(stream, i, chunk_len, NULL,
+                                               cancellable, error);
+        }
+
+        i += chunk_len;
+    }
+
+    g_free(buff);
+    return result;
+}
+
+
+// decoded text of text/plain and text/html parts (with tags removed),
+// truncated to approximately `limit` bytes
+gchar *mbgui_mime_get_text(const gchar *path, gsize limit) {
+    gsize len;
+    gchar *buff = read_file(path, &len);
+    if (!buff)
+        return NULL;
+
+    part_t message;
+    split_part(buff, len, &message);
+
+    GString *result = g_string_new(NULL);
+    text_data_t data = {limit, 0, result};
+    append_part(&message, &data);
+    g_free(buff);
+
+    // truncated at UTF-8 character boundary
+    if (result->len > limit) {
+        gsize text_len = limit;
+        while (text_len && (result->str[text_len] & 0xc0) == 0x80)
+            --text_len;
+        g_string_truncate(result, text_len);
+    }
+
+    return g_string_free(result, FALSE);
+}
+
+
+// parts, which are not displayed as message text, found by scanning mapped
+// message without decoding them
+mbgui_message_part_t *mbgui_mime_get_parts(const gchar *path) {
+    GMappedFile *file = g_mapped_file_new(path, FALSE, NULL);
+    if (!file)
+        return NULL;
+
+    const gchar *contents = g_mapped_file_get_contents(file);
+    mbgui_message_part_t *result = NULL;
+
+    if (contents) {
+        part_t message;
+        split_part(contents, g_mapped_file_get_length(file), &message);
+
+        parts_data_t data = {contents, 0, &result};
+        add_part(&message, &data);
+    }
+
+    g_mapped_file_unref(file);
+    return result;
+}
+
+
+// decoded part is written to `output` in chunks, without reading whole part
+// into memory
+gboolean mbgui_mime_save_part(const gchar *path, gsize offset, gsize length,
+                              const gchar *encoding, const gchar *output,
+                              GCancellable *cancellable, GError **error) {
+    GMappedFile *file = g_mapped_file_new(path, FALSE, error);
+    if (!file)
+        return FALSE;
+
+    gsize len = g_mapped_file_get_length(file);
+    if (offset > len || length > len - offset) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "message %s was changed", path);
+        g_mapped_file_unref(file);
+        return FALSE;
+    }
+
+    GFile *output_file = g_file_new_for_path(output);
+    GFileOutputStream *stream = g_file_replace(
+        output_file, NULL, FALSE, G_FILE_CREATE_NONE, cancellable, error);
+    g_object_unref(output_file);
+
+    gboolean result = (stream != NULL);
+    if (stream) {
+        result = write_part(G_OUTPUT_STREAM(stream),
+                            g_mapped_file_get_contents(file) + offset,
+                            length, encoding, cancellable, error);
+        result = g_output_stream_close(G_OUTPUT_STREAM(stream), cancellable,
+                                       (result ? error : NULL)) &&
+                 result;
+        g_object_unref(stream);
+    }
+
+    g_mapped_file_unref(file);
+    return result;
+}
@@ -0,0 +1,14 @@
+#ifndef MBGUI_MIME_H
+#define MBGUI_MIME_H
+
+#include <gio/gio.h>
+#include "mblaze.h"
+
+
+gchar *mbgui_mime_get_text(const gchar *path, gsize limit);
+mbgui_message_part_t *mbgui_mime_get_parts(const gchar *path);
+gboolean mbgui_mime_save_part(const gchar *path, gsize offset, gsize length,
+                              const gchar *encoding, const gchar *output,
+                              GCancellable *cancellable, GError **error);
+
+#endif
@@ -0,0 +1,914 @@
+#include <string.h>
+#include "model.h"
+#include "arena.h"
+#include "maildir.h"
+
+
+typedef struct {
+    gint column;
+    GtkSortType order;
+} sort_t;
+
+// visible children of parent in order, in which they are displayed
+typedef struct {
+    mbgui_message_t *parent;
+    GPtrArray *children;
+} reorder_t;
+
+typedef struct {
+    mbgui_message_arena_t *arena;
+    mbgui_message_t *messages;
+    sort_t sort;
+    GCancellable *cancellable;
+    mbgui_messages_sort_cb_t cb;
+    gpointer user_data;
+} sort_messages_data_t;
+
+struct _MbguiMessagesModel {
+    GObject parent_instance;
+    gint stamp;
+    GPtrArray *arenas;
+    mbgui_message_arena_t *arena;
+    GPtrArray *roots;
+    GPtrArray *rows;
+    GHashTable *paths;
+    GHashTable *accessed;
+    gchar *filter;
+    sort_t sort;
+};
+
+
+static void mbgui_messages_model_tree_model_init(GtkTreeModelIface *iface);
+static GtkTreePath *get_path(GtkTreeModel *tree_model, GtkTreeIter *iter);
+
+G_DEFINE_TYPE_WITH_CODE(MbguiMessagesModel, mbgui_messages_model,
+                        G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(
+                            GTK_TYPE_TREE_MODEL,
+                            mbgui_messages_model_tree_model_init))
+
+
+static const gchar *get_message_status_icon(mbgui_message_status_t status) {
+    switch (status) {
+    case MBGUI_MSG_STATUS_SEEN:
+        return "mail-read";
+    case MBGUI_MSG_STATUS_FLAGGED:
+        return "starred";
+    case MBGUI_MSG_STATUS_UNSEEN:
+        return "mail-unread";
+    case MBGUI_MSG_STATUS_TRASHED:
+        return "user-trash";
+    case MBGUI_MSG_STATUS_VIRTUAL:
+        return NULL;
+    }
+    return NULL;
+}
+
+
+static gboolean set_iter(MbguiMessagesModel *model, GtkTreeIter *iter,
+                         mbgui_message_t *message) {
+    iter->stamp = (message ? model->stamp : 0);
+    iter->user_data = message;
+    iter->user_data2 = NULL;
+    iter->user_data3 = NULL;
+    return message != NULL;
+}
+
+
+// roots are kept in order of arrival, rows are displayed roots when filter or
+// sort is set - message indices are positions among visible siblings
+static GPtrArray *get_rows(MbguiMessagesModel *model) {
+    return (model->rows ? model->rows : model->roots);
+}
+
+
+static mbgui_message_t *skip_hidden(mbgui_message_t *message) {
+    while (message && message->hidden)
+        message = message->next;
+    return message;
+}
+
+
+// hides messages which don't match filter and don't have matching
+// descendants - `changed` is set if visibility of any message was changed
+static gboolean filter_message(mbgui_message_t *message, const gchar *filter,
+                               gboolean *changed) {
+    gboolean visible = (!filter || strstr(message->key, filter));
+
+    guint index = 0;
+    for (mbgui_message_t *child = message->children; child;
+         child = child->next) {
+        if (filter_message(child, filter, changed)) {
+            child->index = index++;
+            visible = TRUE;
+        }
+    }
+
+    if (changed && message->hidden == visible)
+        *changed = TRUE;
+    message->hidden = !visible;
+    return visible;
+}
+
+
+// virtual messages are sorted as their first reply
+static const mbgui_message_t *get_sort_message(const mbgui_message_t *message) {
+    while (message->status == MBGUI_MSG_STATUS_VIRTUAL && message->children)
+        message = message->children;
+    return message;
+}
+
+
+static gint compare_messages(gconstpointer a, gconstpointer b,
+                             gpointer user_data) {
+    sort_t *sort = user_data;
+    const mbgui_message_t *x = get_sort_message(*(mbgui_message_t **)a);
+    const mbgui_message_t *y = get_sort_message(*(mbgui_message_t **)b);
+
+    gint result = 0;
+    if (sort->column == MBGUI_MESSAGES_MODEL_COLUMN_SUBJECT)
+        result = strcmp(x->subject_key, y->subject_key);
+    else if (sort->column == MBGUI_MESSAGES_MODEL_COLUMN_SENDER)
+        result = strcmp(x->sender_key, y->sender_key);
+
+    if (!result)
+        result = (x->timestamp > y->timestamp) - (x->timestamp < y->timestamp);
+
+    return (sort->order == GTK_SORT_DESCENDING ? -result : result);
+}
+
+
+static void sort_children(sort_t *sort, mbgui_message_t *message) {
+    if (!message->children)
+        return;
+
+    GPtrArray *children = g_ptr_array_new();
+    for (mbgui_message_t *child = message->children; child;
+         child = child->next) {
+        sort_children(sort, child);
+        g_ptr_array_add(children, child);
+    }
+
+    g_ptr_array_sort_with_data(children, compare_messages, sort);
+
+    guint index = 0;
+    for (guint i = 0; i < children->len; ++i) {
+        mbgui_message_t *child = g_ptr_array_index(children, i);
+        child->next = (i + 1 < children->len
+                           ? g_ptr_array_index(children, i + 1)
+                           : NULL);
+        if (!child->hidden)
+            child->index = index++;
+    }
+    message->children = g_ptr_array_index(children, 0);
+
+    g_ptr_array_free(children, TRUE);
+}
+
+
+// virtual messages are sorted as their first reply, so their replies have to
+// be sorted before roots are compared
+static void sort_virtual(sort_t *sort, mbgui_message_t *message) {
+    if (message->status == MBGUI_MSG_STATUS_VIRTUAL)
+        sort_children(sort, message);
+}
+
+
+// replies are sorted when their thread is accessed for the first time, which
+// for collapsed threads is when they are expanded - threads with virtual
+// roots are sorted before roots are compared
+static void sort_thread(MbguiMessagesModel *model, mbgui_message_t *message) {
+    while (message->parent)
+        message = message->parent;
+
+    if (g_hash_table_add(model->accessed, message) && model->sort.column >= 0)
+        sort_children(&(model->sort), message);
+}
+
+
+static void add_reorders(GArray *reorders, mbgui_message_t *message) {
+    mbgui_message_t *child = skip_hidden(message->children);
+    if (!child)
+        return;
+
+    reorder_t reorder = {message, g_ptr_array_new()};
+    for (; child; child = skip_hidden(child->next)) {
+        g_ptr_array_add(reorder.children, child);
+        add_reorders(reorders, child);
+    }
+    g_array_append_val(reorders, reorder);
+}
+
+
+static void update_rows(MbguiMessagesModel *model) {
+    if (!model->filter && model->sort.column < 0)
+        g_clear_pointer(&(model->rows), g_ptr_array_unref);
+    else if (!model->rows)
+        model->rows = g_ptr_array_new();
+    else
+        g_ptr_array_set_size(model->rows, 0);
+
+    if (model->rows) {
+        for (guint i = 0; i < model->roots->len; ++i) {
+            mbgui_message_t *message = g_ptr_array_index(model->roots, i);
+            if (!message->hidden)
+                g_ptr_array_add(model->rows, message);
+        }
+
+        if (model->sort.column >= 0)
+            g_ptr_array_sort_with_data(model->rows, compare_messages,
+                                       &(model->sort));
+    }
+
+    GPtrArray *rows = get_rows(model);
+    for (guint i = 0; i < rows->len; ++i)
+        ((mbgui_message_t *)g_ptr_array_index(rows, i))->index = i;
+}
+
+
+// merges visible roots, which are sorted by model sort, into sorted rows in
+// one pass
+static void merge_rows(MbguiMessagesModel *model, GPtrArray *batch) {
+    for (guint i = 1; i < batch->len; ++i) {
+        // batches queued before sort was changed are sorted here
+        if (compare_messages(batch->pdata + i - 1, batch->pdata + i,
+                             &(model->sort)) > 0) {
+            g_ptr_array_sort_with_data(batch, compare_messages,
+                                       &(model->sort));
+            break;
+        }
+    }
+
+    GPtrArray *rows = model->rows;
+    GPtrArray *merged = g_ptr_array_sized_new(rows->len + batch->len);
+    for (guint i = 0, j = 0; i < rows->len || j < batch->len;) {
+        mbgui_message_t *message;
+        if (j >= batch->len ||
+            (i < rows->len && compare_messages(rows->pdata + i,
+                                               batch->pdata + j,
+                                               &(model->sort)) <= 0))
+            message = g_ptr_array_index(rows, i++);
+        else
+            message = g_ptr_array_index(batch, j++);
+
+        message->index = merged->len;
+        g_ptr_array_add(merged, message);
+    }
+
+    g_ptr_array_unref(model->rows);
+    model->rows = merged;
+}
+
+
+// adds visible roots to rows - roots were already added to model roots
+static void add_rows(MbguiMessagesModel *model, GPtrArray *batch) {
+    if (!model->rows) {
+        for (guint i = 0; i < batch->len; ++i)
+            ((mbgui_message_t *)g_ptr_array_index(batch, i))->index =
+                model->roots->len - batch->len + i;
+        return;
+    }
+
+    if (model->sort.column >= 0) {
+        merge_rows(model, batch);
+        return;
+    }
+
+    for (guint i = 0; i < batch->len; ++i) {
+        mbgui_message_t *message = g_ptr_array_index(batch, i);
+        message->index = model->rows->len;
+        g_ptr_array_add(model->rows, message);
+    }
+}
+
+
+static void emit_row_inserted(MbguiMessagesModel *model,
+                              mbgui_message_t *message) {
+    GtkTreeIter iter;
+    set_iter(model, &iter, message);
+
+    GtkTreePath *path = gtk_tree_path_new_from_indices(message->index, -1);
+    gtk_tree_model_row_inserted(GTK_TREE_MODEL(model), path, &iter);
+    if (skip_hidden(message->children))
+        gtk_tree_model_row_has_child_toggled(GTK_TREE_MODEL(model), path,
+                                             &iter);
+    gtk_tree_path_free(path);
+}
+
+
+static void emit_row_deleted(MbguiMessagesModel *model, guint index) {
+    GtkTreePath *path = gtk_tree_path_new_from_indices(index, -1);
+    gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), path);
+    gtk_tree_path_free(path);
+}
+
+
+// `children` are in order, in which they were displayed before their indices
+// were changed
+static void emit_rows_reordered(MbguiMessagesModel *model,
+                                mbgui_message_t *parent,
+                                GPtrArray *children) {
+    gint *new_order = g_new(gint, children->len);
+    gboolean changed = FALSE;
+    for (guint i = 0; i < children->len; ++i) {
+        mbgui_message_t *child = g_ptr_array_index(children, i);
+        new_order[child->index] = i;
+        changed = changed || child->index != i;
+    }
+
+    if (changed) {
+        GtkTreeIter iter;
+        set_iter(model, &iter, parent);
+        GtkTreePath *path = (parent ? get_path(GTK_TREE_MODEL(model), &iter)
+                                    : gtk_tree_path_new());
+        gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model), path,
+                                      (parent ? &iter : NULL), new_order);
+        gtk_tree_path_free(path);
+    }
+
+    g_free(new_order);
+}
+
+
+static void add_paths(GHashTable *paths, mbgui_message_t *message) {
+    if (message->status != MBGUI_MSG_STATUS_VIRTUAL)
+        g_hash_table_insert(paths, (gpointer)message->path, message);
+
+    for (mbgui_message_t *child = message->children; child; child = child->next)
+        add_paths(paths, child);
+}
+
+
+static mbgui_message_t *lookup_message(MbguiMessagesModel *model,
+                                       const gchar *path) {
+    if (!model->paths) {
+        model->paths = g_hash_table_new(g_str_hash, g_str_equal);
+        for (guint i = 0; i < model->roots->len; ++i)
+            add_paths(model->paths, g_ptr_array_index(model->roots, i));
+    }
+
+    return g_hash_table_lookup(model->paths, path);
+}
+
+
+static void unlink_message(MbguiMessagesModel *model,
+                           mbgui_message_t *message) {
+    if (!message->parent) {
+        g_hash_table_remove(model->accessed, message);
+        if (model->rows)
+            g_ptr_array_remove(model->roots, message);
+        if (message->hidden)
+            return;
+
+        GPtrArray *roots = get_rows(model);
+        g_ptr_array_remove_index(roots, message->index);
+        for (guint i = message->index; i < roots->len; ++i)
+            ((mbgui_message_t *)g_ptr_array_index(roots, i))->index = i;
+        return;
+    }
+
+    mbgui_message_t **link = &(message->parent->children);
+    while (*link != message)
+        link = &((*link)->next);
+    *link = message->next;
+
+    if (message->hidden)
+        return;
+
+    for (mbgui_message_t *next = message->next; next; next = next->next)
+        next->index -= 1;
+}
+
+
+// hidden messages are not displayed, so they are removed without signals
+static void remove_hidden(MbguiMessagesModel *model,
+                          mbgui_message_t *message) {
+    while (message && message->hidden) {
+        mbgui_message_t *parent = message->parent;
+        unlink_message(model, message);
+
+        if (!parent || parent->children ||
+            parent->status != MBGUI_MSG_STATUS_VIRTUAL)
+            break;
+        message = parent;
+    }
+}
+
+
+static mbgui_message_t *get_nth_message(MbguiMessagesModel *model,
+                                        mbgui_message_t *parent, gint n) {
+    if (n < 0)
+        return NULL;
+
+    GPtrArray *roots = get_rows(model);
+    if (!parent)
+        return ((guint)n < roots->len ? g_ptr_array_index(roots, n) : NULL);
+
+    sort_thread(model, parent);
+    mbgui_message_t *child = skip_hidden(parent->children);
+    for (; child && n; --n)
+        child = skip_hidden(child->next);
+    return child;
+}
+
+
+static GtkTreeModelFlags get_flags(GtkTreeModel *tree_model) {
+    return GTK_TREE_MODEL_ITERS_PERSIST;
+}
+
+
+static gint get_n_columns(GtkTreeModel *tree_model) {
+    return MBGUI_MESSAGES_MODEL_N_COLUMNS;
+}
+
+
+static GType get_column_type(GtkTreeModel *tree_model, gint index) {
+    return G_TYPE_STRING;
+}
+
+
+static gboolean get_iter(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                         GtkTreePath *path) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+
+    gint depth;
+    gint *indices = gtk_tree_path_get_indices_with_depth(path, &depth);
+
+    mbgui_message_t *message = NULL;
+    for (gint i = 0; i < depth; ++i) {
+        message = get_nth_message(model, message, indices[i]);
+        if (!message)
+            break;
+    }
+
+    return set_iter(model, iter, message);
+}
+
+
+static GtkTreePath *get_path(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    GtkTreePath *path = gtk_tree_path_new();
+
+    for (mbgui_message_t *message = iter->user_data; message;
+         message = message->parent)
+        gtk_tree_path_prepend_index(path, message->index);
+
+    return path;
+}
+
+
+static void get_value(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                      gint column, GValue *value) {
+    mbgui_message_t *message = iter->user_data;
+
+    g_value_init(value, G_TYPE_STRING);
+
+    switch (column) {
+    case MBGUI_MESSAGES_MODEL_COLUMN_PATH:
+        g_value_set_static_string(value, message->path);
+        break;
+    case MBGUI_MESSAGES_MODEL_COLUMN_ICON:
+        g_value_set_static_string(value,
+                                  get_message_status_icon(message->status));
+        break;
+    case MBGUI_MESSAGES_MODEL_COLUMN_SUBJECT:
+        g_value_set_static_string(value, message->subject);
+        break;
+    case MBGUI_MESSAGES_MODEL_COLUMN_SENDER:
+        g_value_set_static_string(value, message->sender);
+        break;
+    case MBGUI_MESSAGES_MODEL_COLUMN_DATE:
+        g_value_set_static_string(value, message->date);
+        break;
+    }
+}
+
+
+static gboolean iter_next(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+    mbgui_message_t *message = iter->user_data;
+
+    if (message->parent)
+        return set_iter(model, iter, skip_hidden(message->next));
+
+    return set_iter(model, iter,
+                    get_nth_message(model, NULL, message->index + 1));
+}
+
+
+static gboolean iter_children(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                              GtkTreeIter *parent) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+
+    return set_iter(model, iter,
+                    get_nth_message(model, (parent ? parent->user_data : NULL),
+                                    0));
+}
+
+
+static gboolean iter_has_child(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    mbgui_message_t *message = iter->user_data;
+
+    return skip_hidden(message->children) != NULL;
+}
+
+
+static gint iter_n_children(GtkTreeModel *tree_model, GtkTreeIter *iter) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+
+    if (!iter)
+        return get_rows(model)->len;
+
+    mbgui_message_t *message = iter->user_data;
+
+    gint count = 0;
+    for (mbgui_message_t *child = skip_hidden(message->children); child;
+         child = skip_hidden(child->next))
+        count += 1;
+    return count;
+}
+
+
+static gboolean iter_nth_child(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                               GtkTreeIter *parent, gint n) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+
+    return set_iter(model, iter,
+                    get_nth_message(model, (parent ? parent->user_data : NULL),
+                                    n));
+}
+
+
+static gboolean iter_parent(GtkTreeModel *tree_model, GtkTreeIter *iter,
+                            GtkTreeIter *child) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(tree_model);
+    mbgui_message_t *message = child->user_data;
+
+    return set_iter(model, iter, message->parent);
+}
+
+
+static void sort_messages_thread(GTask *task, gpointer source_object,
+                                 gpointer task_data,
+                                 GCancellable *cancellable) {
+    sort_messages_data_t *data = task_data;
+
+    GPtrArray *messages = g_ptr_array_new();
+    for (mbgui_message_t *message = data->messages; message;
+         message = message->next) {
+        sort_virtual(&(data->sort), message);
+        g_ptr_array_add(messages, message);
+    }
+
+    g_ptr_array_sort_with_data(messages, compare_messages, &(data->sort));
+
+    for (guint i = 0; i < messages->len; ++i)
+        ((mbgui_message_t *)g_ptr_array_index(messages, i))->next =
+            (i + 1 < messages->len ? g_ptr_array_index(messages, i + 1)
+                                   : NULL);
+    data->messages = (messages->len ? g_ptr_array_index(messages, 0) : NULL);
+
+    g_ptr_array_free(messages, TRUE);
+    g_task_return_boolean(task, TRUE);
+}
+
+
+static void on_sort_messages(GObject *source_object, GAsyncResult *result,
+                             gpointer user_data) {
+    sort_messages_data_t *data = user_data;
+
+    if (!g_cancellable_is_cancelled(data->cancellable))
+        data->cb(data->messages, data->user_data);
+
+    mbgui_message_arena_unref(data->arena);
+    if (data->cancellable)
+        g_object_unref(data->cancellable);
+    g_free(data);
+}
+
+
+static void mbgui_messages_model_tree_model_init(GtkTreeModelIface *iface) {
+    iface->get_flags = get_flags;
+    iface->get_n_columns = get_n_columns;
+    iface->get_column_type = get_column_type;
+    iface->get_iter = get_iter;
+    iface->get_path = get_path;
+    iface->get_value = get_value;
+    iface->iter_next = iter_next;
+    iface->iter_children = iter_children;
+    iface->iter_has_child = iter_has_child;
+    iface->iter_n_children = iter_n_children;
+    iface->iter_nth_child = iter_nth_child;
+    iface->iter_parent = iter_parent;
+}
+
+
+static void mbgui_messages_model_finalize(GObject *object) {
+    MbguiMessagesModel *model = MBGUI_MESSAGES_MODEL(object);
+
+    if (model->paths)
+        g_hash_table_destroy(model->paths);
+    g_hash_table_destroy(model->accessed);
+    if (model->rows)
+        g_ptr_array_unref(model->rows);
+    g_ptr_array_free(model->roots, TRUE);
+    g_free(model->filter);
+    g_ptr_array_free(model->arenas, TRUE);
+    mbgui_message_arena_unref(model->arena);
+
+    G_OBJECT_CLASS(mbgui_messages_model_parent_class)->finalize(object);
+}
+
+
+static void mbgui_messages_model_class_init(MbguiMessagesModelClass *klass) {
+    G_OBJECT_CLASS(klass)->finalize = mbgui_messages_model_finalize;
+}
+
+
+static void mbgui_messages_model_init(MbguiMessagesModel *model) {
+    model->stamp = g_random_int();
+    model->arenas = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)mbgui_message_arena_unref);
+    model->arena = mbgui_message_arena_new();
+    model->roots = g_ptr_array_new();
+    model->rows = NULL;
+    model->paths = NULL;
+    model->accessed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    model->filter = NULL;
+    model->sort.column = -1;
+    model->sort.order = GTK_SORT_ASCENDING;
+}
+
+
+MbguiMessagesModel *mbgui_messages_model_new(void) {
+    return g_object_new(MBGUI_TYPE_MESSAGES_MODEL, NULL);
+}
+
+
+void mbgui_messages_model_add_arena(MbguiMessagesModel *model,
+                                    mbgui_message_arena_t *arena) {
+    if (!g_ptr_array_find(model->arenas, arena, NULL))
+        g_ptr_array_add(model->arenas, mbgui_message_arena_ref(arena));
+}
+
+
+mbgui_message_t *mbgui_messages_model_get_message(MbguiMessagesModel *model,
+                                                  GtkTreeIter *iter) {
+    g_return_val_if_fail(iter->stamp == model->stamp, NULL);
+
+    return iter->user_data;
+}
+
+
+// only roots, whose visibility or visibility of their descendants changed,
+// are deleted and inserted again - `filter` is matched as case folded
+// substring of message subject or sender
+void mbgui_messages_model_set_filter(MbguiMessagesModel *model,
+                                     const gchar *filter) {
+    g_free(model->filter);
+    model->filter = (filter && *filter ? g_utf8_casefold(filter, -1) : NULL);
+
+    GPtrArray *old_rows = g_ptr_array_copy(get_rows(model), NULL, NULL);
+    GHashTable *changed = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (guint i = 0; i < model->roots->len; ++i) {
+        mbgui_message_t *message = g_ptr_array_index(model->roots, i);
+        gboolean thread_changed = FALSE;
+        filter_message(message, model->filter, &thread_changed);
+        if (thread_changed)
+            g_hash_table_add(changed, message);
+    }
+
+    update_rows(model);
+
+    // old and new rows are ordered in the same way, so rows missing in one of
+    // them are found in a single pass
+    GPtrArray *rows = get_rows(model);
+    for (guint i = 0, j = 0; i < old_rows->len || j < rows->len;) {
+        mbgui_message_t *old_row =
+            (i < old_rows->len ? g_ptr_array_index(old_rows, i) : NULL);
+        mbgui_message_t *row =
+            (j < rows->len ? g_ptr_array_index(rows, j) : NULL);
+
+        if (old_row && old_row == row) {
+            if (g_hash_table_contains(changed, row)) {
+                emit_row_deleted(model, j);
+                emit_row_inserted(model, row);
+            }
+            i += 1;
+            j += 1;
+        } else if (old_row && old_row->hidden) {
+            emit_row_deleted(model, j);
+            i += 1;
+        } else if (row) {
+            emit_row_inserted(model, row);
+            j += 1;
+        } else {
+            break;
+        }
+    }
+
+    g_hash_table_destroy(changed);
+    g_ptr_array_unref(old_rows);
+}
+
+
+// threads are sorted by their first message and replies are sorted within
+// threads when they are accessed, `column` -1 restores order of arrival
+// (sorted replies stay sorted) - replies of already accessed threads can be
+// displayed, so they are sorted at once and their reordering is signalled
+void mbgui_messages_model_set_sort(MbguiMessagesModel *model, gint column,
+                                   GtkSortType order) {
+    model->sort.column = column;
+    model->sort.order = order;
+
+    GPtrArray *old_rows = g_ptr_array_copy(get_rows(model), NULL, NULL);
+    GArray *reorders = g_array_new(FALSE, FALSE, sizeof(reorder_t));
+
+    if (column >= 0) {
+        GHashTableIter iter;
+        gpointer message;
+        g_hash_table_iter_init(&iter, model->accessed);
+        while (g_hash_table_iter_next(&iter, &message, NULL)) {
+            if (!((mbgui_message_t *)message)->hidden)
+                add_reorders(reorders, message);
+            sort_children(&(model->sort), message);
+        }
+
+        for (guint i = 0; i < model->roots->len; ++i) {
+            mbgui_message_t *message = g_ptr_array_index(model->roots, i);
+            if (message->status == MBGUI_MSG_STATUS_VIRTUAL)
+                sort_thread(model, message);
+        }
+    }
+
+    update_rows(model);
+
+    emit_rows_reordered(model, NULL, old_rows);
+    for (guint i = 0; i < reorders->len; ++i) {
+        reorder_t *reorder = &g_array_index(reorders, reorder_t, i);
+        emit_rows_reordered(model, reorder->parent, reorder->children);
+        g_ptr_array_free(reorder->children, TRUE);
+    }
+
+    g_array_free(reorders, TRUE);
+    g_ptr_array_unref(old_rows);
+}
+
+
+// messages, which were not yet appended to any model, are sorted in thread in
+// the same way as they would be sorted by model - sorted messages are merged
+// into sorted model in one pass, replies are sorted by model
+void mbgui_messages_sort(mbgui_message_arena_t *arena,
+                         mbgui_message_t *messages, gint column,
+                         GtkSortType order, GCancellable *cancellable,
+                         mbgui_messages_sort_cb_t cb, gpointer user_data) {
+    sort_messages_data_t *data = g_malloc(sizeof(sort_messages_data_t));
+    data->arena = mbgui_message_arena_ref(arena);
+    data->messages = messages;
+    data->sort.column = column;
+    data->sort.order = order;
+    data->cancellable = (cancellable ? g_object_ref(cancellable) : NULL);
+    data->cb = cb;
+    data->user_data = user_data;
+
+    // sorting is not limited by scheduler, which limits concurrent reading
+    GTask *task = g_task_new(NULL, cancellable, on_sort_messages, data);
+    g_task_set_task_data(task, data, NULL);
+    g_task_run_in_thread(task, sort_messages_thread);
+    g_object_unref(task);
+}
+
+
+gboolean mbgui_messages_model_find(MbguiMessagesModel *model,
+                                   const gchar *path, GtkTreeIter *iter) {
+    return mbgui_messages_model_find_message(model, lookup_message(model, path),
+                                             iter);
+}
+
+
+// iter of message, which is displayed - including virtual messages
+gboolean mbgui_messages_model_find_message(MbguiMessagesModel *model,
+                                           mbgui_message_t *message,
+                                           GtkTreeIter *iter) {
+    if (!message || message->hidden)
+        return set_iter(model, iter, NULL);
+
+    // path of found reply is based on its sorted position
+    sort_thread(model, message);
+    return set_iter(model, iter, message);
+}
+
+
+gboolean mbgui_messages_model_contains(MbguiMessagesModel *model,
+                                       const gchar *path) {
+    return lookup_message(model, path) != NULL;
+}
+
+
+// rows are signalled in ascending order, after all of them were added
+mbgui_message_t *mbgui_messages_model_append(MbguiMessagesModel *model,
+                                             mbgui_message_t *messages,
+                                             guint count) {
+    GPtrArray *batch = g_ptr_array_new();
+
+    mbgui_message_t *message = messages;
+    for (; message && count; message = message->next, --count) {
+        // after live updates the same message can arrive twice
+        if (model->paths) {
+            if (g_hash_table_contains(model->paths, message->path))
+                continue;
+            add_paths(model->paths, message);
+        }
+
+        if (message->status == MBGUI_MSG_STATUS_VIRTUAL)
+            sort_thread(model, message);
+
+        g_ptr_array_add(model->roots, message);
+        if (!model->filter || filter_message(message, model->filter, NULL))
+            g_ptr_array_add(batch, message);
+    }
+
+    add_rows(model, batch);
+
+    for (guint i = 0; i < batch->len; ++i)
+        emit_row_inserted(model, g_ptr_array_index(batch, i));
+
+    g_ptr_array_free(batch, TRUE);
+    return message;
+}
+
+
+void mbgui_messages_model_rename(MbguiMessagesModel *model, const gchar *path,
+                                 const gchar *new_path) {
+    mbgui_message_t *message = lookup_message(model, path);
+    if (!message)
+        return;
+
+    // arenas of messages can be still filled by threads, which build batches
+    g_hash_table_remove(model->paths, path);
+    message->path = mbgui_message_arena_insert(model->arena, new_path);
+    message->status = mbgui_maildir_get_status(message->path);
+    g_hash_table_insert(model->paths, (gpointer)message->path, message);
+
+    if (message->hidden)
+        return;
+
+    GtkTreeIter iter;
+    set_iter(model, &iter, message);
+
+    GtkTreePath *tree_path = get_path(GTK_TREE_MODEL(model), &iter);
+    gtk_tree_model_row_changed(GTK_TREE_MODEL(model), tree_path, &iter);
+    gtk_tree_path_free(tree_path);
+}
+
+
+void mbgui_messages_model_remove(MbguiMessagesModel *model,
+                                 const gchar *path) {
+    mbgui_message_t *message = lookup_message(model, path);
+    if (!message)
+        return;
+
+    g_hash_table_remove(model->paths, path);
+
+    // messages with replies stay in place, like missing parents in mthread
+    if (message->children)
+        message->status = MBGUI_MSG_STATUS_VIRTUAL;
+
+    if (message->hidden) {
+        if (!message->children)
+            remove_hidden(model, message);
+        return;
+    }
+
+    GtkTreeIter iter;
+    set_iter(model, &iter, message);
+    GtkTreePath *tree_path = get_path(GTK_TREE_MODEL(model), &iter);
+
+    if (message->children) {
+        gtk_tree_model_row_changed(GTK_TREE_MODEL(model), tree_path, &iter);
+        gtk_tree_path_free(tree_path);
+        return;
+    }
+
+    while (message) {
+        mbgui_message_t *parent = message->parent;
+        unlink_message(model, message);
+        gtk_tree_model_row_deleted(GTK_TREE_MODEL(model), tree_path);
+
+        if (!parent || skip_hidden(parent->children))
+            break;
+
+        gtk_tree_path_up(tree_path);
+        set_iter(model, &iter, parent);
+
+        // hidden children are kept, with expander removed
+        if (parent->children || parent->status != MBGUI_MSG_STATUS_VIRTUAL) {
+            gtk_tree_model_row_has_child_toggled(GTK_TREE_MODEL(model),
+                                                 tree_path, &iter);
+            break;
+        }
+
+        message = parent;
+    }
+
+    gtk_tree_path_free(tree_path);
+}
@@ -0,0 +1,55 @@
+#ifndef MBGUI_MODEL_H
+#define MBGUI_MODEL_H
+
+#include <gtk/gtk.h>
+#include "mblaze.h"
+
+
+#define MBGUI_TYPE_MESSAGES_MODEL mbgui_messages_model_get_type()
+G_DECLARE_FINAL_TYPE(MbguiMessagesModel, mbgui_messages_model, MBGUI,
+                     MESSAGES_MODEL, GObject)
+
+
+enum {
+    MBGUI_MESSAGES_MODEL_COLUMN_PATH,
+    MBGUI_MESSAGES_MODEL_COLUMN_ICON,
+    MBGUI_MESSAGES_MODEL_COLUMN_SUBJECT,
+    MBGUI_MESSAGES_MODEL_COLUMN_SENDER,
+    MBGUI_MESSAGES_MODEL_COLUMN_DATE,
+    MBGUI_MESSAGES_MODEL_N_COLUMNS
+};
+
+
+typedef void (*mbgui_messages_sort_cb_t)(mbgui_message_t *messages,
+                                         gpointer user_data);
+
+
+MbguiMessagesModel *mbgui_messages_model_new(void);
+void mbgui_messages_model_add_arena(MbguiMessagesModel *model,
+                                    mbgui_message_arena_t *arena);
+mbgui_message_t *mbgui_messages_model_get_message(MbguiMessagesModel *model,
+                                                  GtkTreeIter *iter);
+void mbgui_messages_model_set_filter(MbguiMessagesModel *model,
+                                     const gchar *filter);
+void mbgui_messages_model_set_sort(MbguiMessagesModel *model, gint column,
+                                   GtkSortType order);
+void mbgui_messages_sort(mbgui_message_arena_t *arena,
+                         mbgui_message_t *messages, gint column,
+                         GtkSortType order, GCancellable *cancellable,
+                         mbgui_messages_sort_cb_t cb, gpointer user_data);
+gboolean mbgui_messages_model_find(MbguiMessagesModel *model,
+                                   const gchar *path, GtkTreeIter *iter);
+gboolean mbgui_messages_model_find_message(MbguiMessagesModel *model,
+                                           mbgui_message_t *message,
+                                           GtkTreeIter *iter);
+gboolean mbgui_messages_model_contains(MbguiMessagesModel *model,
+                                       const gchar *path);
+mbgui_message_t *mbgui_messages_model_append(MbguiMessagesModel *model,
+                                             mbgui_message_t *messages,
+                                             guint count);
+void mbgui_messages_model_rename(MbguiMessagesModel *model, const gchar *path,
+                                 const gchar *new_path);
+void mbgui_messages_model_remove(MbguiMessagesModel *model,
+                                 const gchar *path);
+
+#endif
@@ -0,0 +1,100 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "reader.h"
+
+
+// appends next block after unconsumed data, which is first moved to the
+// beginning of buffer (or buffer is enlarged if it is already full)
+static gboolean read_block(mbgui_reader_t *reader) {
+    if (reader->begin) {
+        memmove(reader->buff, reader->buff + reader->begin,
+                reader->end - reader->begin);
+        reader->end -= reader->begin;
+        reader->begin = 0;
+    }
+
+    if (reader->end == reader->size) {
+        reader->size *= 2;
+        reader->buff = g_realloc(reader->buff, reader->size);
+    }
+
+    gssize count = pread(reader->fd, reader->buff + reader->end,
+                         reader->size - reader->end, reader->offset);
+    if (count <= 0)
+        return FALSE;
+
+    reader->end += count;
+    reader->offset += count;
+    return TRUE;
+}
+
+
+void mbgui_reader_init(mbgui_reader_t *reader, gsize size) {
+    reader->fd = -1;
+    reader->buff = g_malloc(size);
+    reader->size = size;
+    reader->begin = 0;
+    reader->end = 0;
+    reader->offset = 0;
+}
+
+
+void mbgui_reader_clear(mbgui_reader_t *reader) {
+    mbgui_reader_close(reader);
+    g_free(reader->buff);
+    reader->buff = NULL;
+}
+
+
+gboolean mbgui_reader_open(mbgui_reader_t *reader, const gchar *path) {
+    mbgui_reader_close(reader);
+
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    return reader->fd >= 0;
+}
+
+
+void mbgui_reader_close(mbgui_reader_t *reader) {
+    if (reader->fd >= 0)
+        close(reader->fd);
+
+    reader->fd = -1;
+    reader->begin = 0;
+    reader->end = 0;
+    reader->offset = 0;
+}
+
+
+// line is returned without line break ("\n" or "\r\n") - last line of file
+// can be returned without line break
+gboolean mbgui_reader_read_line(mbgui_reader_t *reader, const gchar **line,
+                                gsize *len) {
+    gsize searched = reader->begin;
+
+    for (;;) {
+        gchar *line_end = memchr(reader->buff + searched, '\n',
+                                 reader->end - searched);
+        if (line_end) {
+            *line = reader->buff + reader->begin;
+            *len = line_end - *line;
+            if (*len && line_end[-1] == '\r')
+                *len -= 1;
+            reader->begin = line_end + 1 - reader->buff;
+            return TRUE;
+        }
+
+        // already searched data is moved by read_block
+        searched = reader->end - reader->begin;
+        if (reader->fd < 0 || !read_block(reader))
+            break;
+    }
+
+    if (reader->begin == reader->end)
+        return FALSE;
+
+    *line = reader->buff + reader->begin;
+    *len = reader->end - reader->begin;
+    reader->begin = reader->end;
+    return TRUE;
+}
@@ -0,0 +1,26 @@
+#ifndef MBGUI_READER_H
+#define MBGUI_READER_H
+
+#include <glib.h>
+
+
+// lines are read in blocks into buffer, which is reused for subsequent files,
+// and returned as slices of that buffer - slice is valid until next read
+typedef struct {
+    gint fd;
+    gchar *buff;
+    gsize size;
+    gsize begin;
+    gsize end;
+    gsize offset;
+} mbgui_reader_t;
+
+
+void mbgui_reader_init(mbgui_reader_t *reader, gsize size);
+void mbgui_reader_clear(mbgui_reader_t *reader);
+gboolean mbgui_reader_open(mbgui_reader_t *reader, const gchar *path);
+void mbgui_reader_close(mbgui_reader_t *reader);
+gboolean mbgui_reader_read_line(mbgui_reader_t *reader, const gchar **line,
+                                gsize *len);
+
+#endif
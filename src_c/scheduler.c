@@ -0,0 +1,71 @@
+#include "scheduler.h"
+
+
+#define PRIORITY_COUNT (MBGUI_SCHEDULER_PRIORITY_BACKGROUND + 1)
+
+
+typedef struct {
+    mbgui_scheduler_job_cb_t cb;
+    gpointer user_data;
+} job_t;
+
+
+static GQueue queues[PRIORITY_COUNT] = {G_QUEUE_INIT, G_QUEUE_INIT,
+                                        G_QUEUE_INIT};
+static gsize max_jobs = 0;
+static gsize running_jobs = 0;
+static gboolean starting = FALSE;
+
+
+static job_t *pop_job(void) {
+    for (gsize i = 0; i < PRIORITY_COUNT; ++i) {
+        if (!g_queue_is_empty(queues + i))
+            return g_queue_pop_head(queues + i);
+    }
+    return NULL;
+}
+
+
+static void start_jobs(void) {
+    if (starting)
+        return;
+
+    if (!max_jobs)
+        max_jobs = MAX(g_get_num_processors(), 2);
+
+    starting = TRUE;
+    while (running_jobs < max_jobs) {
+        job_t *job = pop_job();
+        if (!job)
+            break;
+
+        running_jobs += 1;
+        job->cb(job->user_data);
+        g_free(job);
+    }
+    starting = FALSE;
+}
+
+
+void mbgui_scheduler_set_max_jobs(gsize jobs) {
+    max_jobs = MAX(jobs, 1);
+    start_jobs();
+}
+
+
+void mbgui_scheduler_push(mbgui_scheduler_priority_t priority,
+                          mbgui_scheduler_job_cb_t cb, gpointer user_data) {
+    job_t *job = g_malloc(sizeof(job_t));
+    job->cb = cb;
+    job->user_data = user_data;
+
+    g_queue_push_tail(queues + priority, job);
+    start_jobs();
+}
+
+
+void mbgui_scheduler_done(void) {
+    if (running_jobs)
+        running_jobs -= 1;
+    start_jobs();
+}
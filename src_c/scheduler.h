@@ -0,0 +1,22 @@
+#ifndef MBGUI_SCHEDULER_H
+#define MBGUI_SCHEDULER_H
+
+#include <glib.h>
+
+
+typedef enum {
+    MBGUI_SCHEDULER_PRIORITY_INTERACTIVE,
+    MBGUI_SCHEDULER_PRIORITY_LIST,
+    MBGUI_SCHEDULER_PRIORITY_BACKGROUND
+} mbgui_scheduler_priority_t;
+
+
+typedef void (*mbgui_scheduler_job_cb_t)(gpointer user_data);
+
+
+void mbgui_scheduler_set_max_jobs(gsize max_jobs);
+void mbgui_scheduler_push(mbgui_scheduler_priority_t priority,
+                          mbgui_scheduler_job_cb_t cb, gpointer user_data);
+void mbgui_scheduler_done(void);
+
+#endif
@@ -0,0 +1,582 @@
+#include <string.h>
+#include "thread.h"
+#include "arena.h"
+#include "header.h"
+#include "maildir.h"
+#include "trace.h"
+
+
+#define THREAD_MIN_BATCH_SIZE 64
+#define THREAD_MAX_BATCH_SIZE 4096
+
+
+// threading based on Message-ID, References and In-Reply-To headers
+// (https://www.jwz.org/doc/threading.html), without subject grouping, with
+// result ordered as `mthread -r` output
+
+typedef struct container_t {
+    gchar *id;
+    const gchar *path;
+    mbgui_header_t *header;
+    mbgui_message_t *message;
+    gint64 date;
+    gint64 newest;
+    struct container_t *parent;
+    struct container_t *children;
+    struct container_t *next;
+} container_t;
+
+typedef struct {
+    const gchar *directory;
+    GPtrArray *paths;
+    GHashTable *ids;
+    GPtrArray *containers;
+} thread_data_t;
+
+
+static void free_container(container_t *container) {
+    g_free(container->id);
+    g_free(container);
+}
+
+
+static gchar *next_message_id(const gchar **str) {
+    const gchar *begin = strchr(*str, '<');
+    if (!begin)
+        return NULL;
+
+    const gchar *end = strchr(begin, '>');
+    if (!end)
+        return NULL;
+
+    *str = end + 1;
+    return g_strndup(begin, end - begin + 1);
+}
+
+
+static container_t *new_container(thread_data_t *data, gchar *id) {
+    container_t *container = g_malloc0(sizeof(container_t));
+    container->id = id;
+    g_ptr_array_add(data->containers, container);
+    return container;
+}
+
+
+static container_t *get_container(thread_data_t *data, gchar *id) {
+    container_t *container = g_hash_table_lookup(data->ids, id);
+    if (container) {
+        g_free(id);
+        return container;
+    }
+
+    container = new_container(data, id);
+    g_hash_table_insert(data->ids, container->id, container);
+    return container;
+}
+
+
+static gboolean is_descendant(container_t *container, container_t *ancestor) {
+    for (; container; container = container->parent) {
+        if (container == ancestor)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+
+static void link_container(container_t *parent, container_t *child) {
+    child->parent = parent;
+    child->next = parent->children;
+    parent->children = child;
+}
+
+
+static void unlink_container(container_t *child) {
+    container_t **link = &(child->parent->children);
+    while (*link != child)
+        link = &((*link)->next);
+    *link = child->next;
+
+    child->parent = NULL;
+    child->next = NULL;
+}
+
+
+static void on_list_entry(const gchar *subdirectory, const gchar *name,
+                          gpointer user_data) {
+    thread_data_t *data = user_data;
+
+    g_ptr_array_add(data->paths, g_build_filename(data->directory,
+                                                  subdirectory, name, NULL));
+}
+
+
+// `message` is already built message (e.g. loaded from cache) or NULL
+static void add_container(thread_data_t *data, const gchar *path,
+                          mbgui_header_t *header, mbgui_message_t *message) {
+    const gchar *str = (header->message_id ? header->message_id : "");
+    gchar *id = next_message_id(&str);
+
+    container_t *container = (id ? get_container(data, id) : NULL);
+    if (!container || container->path)
+        container = new_container(data, NULL);
+
+    container->path = path;
+    container->header = header;
+    container->message = message;
+    container->date = header->date;
+
+    // references are linked as a chain, without overriding existing parents
+    container_t *parent = NULL;
+    str = (header->references ? header->references : "");
+    for (id = next_message_id(&str); id; id = next_message_id(&str)) {
+        container_t *reference = get_container(data, id);
+        if (parent && !reference->parent && !is_descendant(parent, reference))
+            link_container(parent, reference);
+        parent = reference;
+    }
+
+    if (!parent && header->in_reply_to) {
+        str = header->in_reply_to;
+        id = next_message_id(&str);
+        if (id)
+            parent = get_container(data, id);
+    }
+
+    if (container->parent)
+        unlink_container(container);
+    if (parent && !is_descendant(parent, container))
+        link_container(parent, container);
+}
+
+
+static container_t *prune_containers(container_t *containers) {
+    container_t *result = NULL;
+
+    container_t *next;
+    for (container_t *container = containers; container; container = next) {
+        next = container->next;
+        container->children = prune_containers(container->children);
+
+        // virtual containers are kept only if they join multiple messages
+        if (!container->path && container->children &&
+            container->children->next) {
+            container->next = result;
+            result = container;
+
+        } else if (container->path) {
+            container->next = result;
+            result = container;
+
+        } else if (container->children) {
+            container_t *child = container->children;
+            child->parent = container->parent;
+            child->next = result;
+            result = child;
+        }
+    }
+
+    return result;
+}
+
+
+static gint64 update_dates(container_t *container) {
+    container->newest = container->date;
+
+    for (container_t *child = container->children; child; child = child->next)
+        container->newest = MAX(container->newest, update_dates(child));
+
+    if (!container->path)
+        container->date = container->newest;
+
+    return container->newest;
+}
+
+
+static gint compare_dates(gconstpointer a, gconstpointer b) {
+    const container_t *first = *(const container_t **)a;
+    const container_t *second = *(const container_t **)b;
+
+    if (first->date != second->date)
+        return (first->date < second->date ? -1 : 1);
+
+    return g_strcmp0(first->path, second->path);
+}
+
+
+static gint compare_newest_reversed(gconstpointer a, gconstpointer b) {
+    const container_t *first = *(const container_t **)a;
+    const container_t *second = *(const container_t **)b;
+
+    if (first->newest != second->newest)
+        return (first->newest > second->newest ? -1 : 1);
+
+    return compare_dates(a, b);
+}
+
+
+static container_t *sort_containers(container_t *containers,
+                                    GCompareFunc compare) {
+    GPtrArray *array = g_ptr_array_new();
+    for (container_t *container = containers; container;
+         container = container->next) {
+        container->children =
+            sort_containers(container->children, compare_dates);
+        g_ptr_array_add(array, container);
+    }
+
+    g_ptr_array_sort(array, compare);
+
+    container_t *result = NULL;
+    for (guint i = array->len; i > 0; --i) {
+        container_t *container = g_ptr_array_index(array, i - 1);
+        container->next = result;
+        result = container;
+    }
+
+    g_ptr_array_free(array, TRUE);
+    return result;
+}
+
+
+static const gchar *format_date(mbgui_message_arena_t *arena, gint64 date) {
+    if (!date)
+        return mbgui_message_arena_intern(arena, "");
+
+    GDateTime *time = g_date_time_new_from_unix_local(date);
+    if (!time)
+        return mbgui_message_arena_intern(arena, "");
+
+    gchar *str = g_date_time_format(time, "%Y-%m-%d %H:%M");
+    const gchar *result = mbgui_message_arena_intern(arena, (str ? str : ""));
+    g_free(str);
+    g_date_time_unref(time);
+    return result;
+}
+
+
+// subject without reply and forward prefixes
+static const gchar *get_base_subject(const gchar *subject) {
+    static const gchar *prefixes[] = {"re:", "fw:", "fwd:", "aw:", "sv:"};
+
+    for (;;) {
+        while (g_ascii_isspace(*subject))
+            ++subject;
+
+        gboolean found = FALSE;
+        for (gsize i = 0; !found && i < G_N_ELEMENTS(prefixes); ++i) {
+            gsize len = strlen(prefixes[i]);
+            found = !g_ascii_strncasecmp(subject, prefixes[i], len);
+            if (found)
+                subject += len;
+        }
+
+        if (!found)
+            return subject;
+    }
+}
+
+
+static mbgui_message_t *new_message(mbgui_message_arena_t *arena,
+                                    const gchar *path,
+                                    mbgui_header_t *header) {
+    mbgui_message_t *message = mbgui_message_arena_alloc(arena);
+    message->path = mbgui_message_arena_insert(arena, path);
+    message->status = mbgui_maildir_get_status(path);
+    message->subject = mbgui_message_arena_insert(
+        arena, (header->subject ? header->subject : ""));
+    message->sender = mbgui_message_arena_intern(
+        arena, (header->sender ? header->sender : ""));
+    message->date = format_date(arena, header->date);
+    message->key = mbgui_message_arena_insert_key(arena, message->subject,
+                                                  message->sender);
+    message->subject_key = mbgui_message_arena_insert_sort_key(
+        arena, get_base_subject(message->subject));
+    message->sender_key =
+        mbgui_message_arena_insert_sort_key(arena, message->sender);
+    message->timestamp = header->date;
+    return message;
+}
+
+
+static mbgui_message_t *new_virtual_message(mbgui_message_arena_t *arena,
+                                            const gchar *id) {
+    mbgui_message_t *message = mbgui_message_arena_alloc(arena);
+    message->path = mbgui_message_arena_insert(arena, (id ? id : ""));
+    message->status = MBGUI_MSG_STATUS_VIRTUAL;
+    message->subject = mbgui_message_arena_intern(arena, "");
+    message->sender = message->subject;
+    message->date = message->subject;
+    message->key = message->subject;
+    message->subject_key = message->subject;
+    message->sender_key = message->subject;
+    return message;
+}
+
+
+// references, which are used by threading - In-Reply-To is used only without
+// References, so threading of saved references gives the same parents
+static gchar *get_references(mbgui_header_t *header) {
+    const gchar *str = (header->references ? header->references : "");
+    gchar *id = next_message_id(&str);
+    if (id) {
+        g_free(id);
+        return g_strdup(header->references);
+    }
+
+    str = (header->in_reply_to ? header->in_reply_to : "");
+    id = next_message_id(&str);
+    return (id ? id : g_strdup(""));
+}
+
+
+static void add_cache_message(mbgui_cache_writer_t *writer,
+                              container_t *container, mbgui_message_t *message,
+                              gsize depth) {
+    if (!container->path) {
+        mbgui_cache_writer_add_message(writer, message, depth, container->id,
+                                       "");
+        return;
+    }
+
+    gchar *references = get_references(container->header);
+    mbgui_cache_writer_add_message(
+        writer, message, depth,
+        (container->header->message_id ? container->header->message_id : ""),
+        references);
+    g_free(references);
+}
+
+
+static mbgui_message_t *build_messages(mbgui_message_arena_t *arena,
+                                       mbgui_cache_writer_t *writer,
+                                       container_t *containers,
+                                       mbgui_message_t *parent, gsize depth) {
+    mbgui_message_t *result = NULL;
+    mbgui_message_t *last = NULL;
+    guint index = 0;
+
+    for (container_t *container = containers; container;
+         container = container->next) {
+        mbgui_message_t *message = container->message;
+        if (message) {
+            message->hidden = FALSE;
+            message->next = NULL;
+        } else {
+            message = (container->path
+                           ? new_message(arena, container->path,
+                                         container->header)
+                           : new_virtual_message(arena, container->id));
+        }
+        message->parent = parent;
+        message->index = index++;
+
+        if (writer)
+            add_cache_message(writer, container, message, depth);
+
+        message->children = build_messages(arena, writer, container->children,
+                                           message, depth + 1);
+
+        if (last)
+            last->next = message;
+        else
+            result = message;
+        last = message;
+    }
+
+    return result;
+}
+
+
+// threads are passed in batches, which start small, so the first threads are
+// displayed early, and grow to limit number of callbacks
+static void build_batches(mbgui_message_arena_t *arena,
+                          mbgui_cache_writer_t *writer, container_t *roots,
+                          GCancellable *cancellable, mbgui_thread_cb_t cb,
+                          gpointer user_data) {
+    gsize batch_size = THREAD_MIN_BATCH_SIZE;
+
+    while (roots && !g_cancellable_is_cancelled(cancellable)) {
+        container_t *last = roots;
+        for (gsize i = 1; i < batch_size && last->next; ++i)
+            last = last->next;
+
+        container_t *next = last->next;
+        last->next = NULL;
+        cb(build_messages(arena, writer, roots, NULL, 0), user_data);
+
+        roots = next;
+        batch_size = MIN(batch_size * 2, THREAD_MAX_BATCH_SIZE);
+    }
+}
+
+
+static mbgui_header_t *read_headers(GPtrArray *paths,
+                                    GCancellable *cancellable) {
+    mbgui_header_t *headers = g_new(mbgui_header_t, paths->len);
+    mbgui_header_read_all((gchar **)paths->pdata, paths->len, headers,
+                          cancellable);
+    return headers;
+}
+
+
+static void free_headers(mbgui_header_t *headers, gsize count) {
+    for (gsize i = 0; i < count; ++i)
+        mbgui_header_clear(headers + i);
+    g_free(headers);
+}
+
+
+static void init_thread_data(thread_data_t *data, const gchar *directory) {
+    data->directory = directory;
+    data->paths = g_ptr_array_new_with_free_func(g_free);
+    data->ids = g_hash_table_new(g_str_hash, g_str_equal);
+    data->containers = g_ptr_array_new_with_free_func(
+        (GDestroyNotify)free_container);
+}
+
+
+static void clear_thread_data(thread_data_t *data) {
+    g_hash_table_destroy(data->ids);
+    g_ptr_array_free(data->containers, TRUE);
+    g_ptr_array_free(data->paths, TRUE);
+}
+
+
+static void thread_containers(thread_data_t *data,
+                              mbgui_message_arena_t *arena,
+                              mbgui_cache_writer_t *writer,
+                              GCancellable *cancellable, mbgui_thread_cb_t cb,
+                              gpointer user_data) {
+    gint64 trace_begin = mbgui_trace_begin();
+
+    container_t *roots = NULL;
+    for (guint i = 0; i < data->containers->len; ++i) {
+        container_t *container = g_ptr_array_index(data->containers, i);
+        if (container->parent)
+            continue;
+
+        container->next = roots;
+        roots = container;
+    }
+
+    roots = prune_containers(roots);
+    for (container_t *root = roots; root; root = root->next)
+        update_dates(root);
+    roots = sort_containers(roots, compare_newest_reversed);
+    mbgui_trace_end("thread_containers", 0, data->directory, trace_begin);
+
+    trace_begin = mbgui_trace_begin();
+    build_batches(arena, writer, roots, cancellable, cb, user_data);
+    mbgui_trace_end("build_messages", 0, data->directory, trace_begin);
+}
+
+
+// complete threads are passed to `cb` in batches, in order of `mthread -r` -
+// built messages are added to `writer`, if it is not NULL
+void mbgui_thread_messages(const gchar *directory,
+                           mbgui_message_arena_t *arena,
+                           mbgui_cache_writer_t *writer,
+                           GCancellable *cancellable, mbgui_thread_cb_t cb,
+                           gpointer user_data) {
+    thread_data_t data;
+    init_thread_data(&data, directory);
+
+    gint64 trace_begin = mbgui_trace_begin();
+    mbgui_maildir_list(directory, on_list_entry, &data);
+    mbgui_trace_end("list_maildir", 0, directory, trace_begin);
+
+    trace_begin = mbgui_trace_begin();
+    mbgui_header_t *headers = read_headers(data.paths, cancellable);
+    mbgui_trace_end("read_headers", 0, directory, trace_begin);
+
+    // cancelled read results with empty list
+    guint count = (g_cancellable_is_cancelled(cancellable) ? 0
+                                                           : data.paths->len);
+    for (guint i = 0; i < count; ++i) {
+        if (headers[i].valid)
+            add_container(&data, g_ptr_array_index(data.paths, i),
+                          headers + i, NULL);
+    }
+
+    thread_containers(&data, arena, writer, cancellable, cb, user_data);
+
+    free_headers(headers, data.paths->len);
+    clear_thread_data(&data);
+}
+
+
+// messages loaded from cache are threaded again together with `added`
+// messages, so only headers of added messages are read
+void mbgui_thread_update(const gchar *directory, GArray *cached,
+                         GPtrArray *added, mbgui_message_arena_t *arena,
+                         mbgui_cache_writer_t *writer,
+                         GCancellable *cancellable, mbgui_thread_cb_t cb,
+                         gpointer user_data) {
+    thread_data_t data;
+    init_thread_data(&data, directory);
+
+    // strings of cached headers are owned by cache
+    mbgui_header_t *cached_headers = g_new0(mbgui_header_t, cached->len);
+    for (guint i = 0; i < cached->len; ++i) {
+        mbgui_cache_message_t *message =
+            &g_array_index(cached, mbgui_cache_message_t, i);
+        mbgui_header_t *header = cached_headers + i;
+        header->valid = TRUE;
+        header->message_id = (gchar *)message->message_id;
+        header->references = (gchar *)message->references;
+        header->date = message->message->timestamp;
+        add_container(&data, message->message->path, header, message->message);
+    }
+
+    gint64 trace_begin = mbgui_trace_begin();
+    mbgui_header_t *headers = read_headers(added, cancellable);
+    mbgui_trace_end("read_headers", 0, directory, trace_begin);
+
+    guint count = (g_cancellable_is_cancelled(cancellable) ? 0 : added->len);
+    for (guint i = 0; i < count; ++i) {
+        if (headers[i].valid)
+            add_container(&data, g_ptr_array_index(added, i), headers + i,
+                          NULL);
+    }
+
+    thread_containers(&data, arena, writer, cancellable, cb, user_data);
+
+    free_headers(headers, added->len);
+    g_free(cached_headers);
+    clear_thread_data(&data);
+}
+
+
+mbgui_message_t *mbgui_thread_scan(gchar **paths, mbgui_message_arena_t *arena,
+                                   GCancellable *cancellable) {
+    GPtrArray *array = g_ptr_array_new();
+    for (gchar **path = paths; *path; ++path)
+        g_ptr_array_add(array, *path);
+
+    mbgui_header_t *headers = read_headers(array, cancellable);
+
+    mbgui_message_t *messages = NULL;
+    mbgui_message_t *last = NULL;
+    guint index = 0;
+
+    guint count = (g_cancellable_is_cancelled(cancellable) ? 0 : array->len);
+    for (guint i = 0; i < count; ++i) {
+        if (!headers[i].valid)
+            continue;
+
+        mbgui_message_t *message =
+            new_message(arena, g_ptr_array_index(array, i), headers + i);
+        message->index = index++;
+
+        if (last)
+            last->next = message;
+        else
+            messages = message;
+        last = message;
+    }
+
+    free_headers(headers, array->len);
+    g_ptr_array_free(array, TRUE);
+    return messages;
+}
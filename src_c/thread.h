@@ -0,0 +1,26 @@
+#ifndef MBGUI_THREAD_H
+#define MBGUI_THREAD_H
+
+#include <gio/gio.h>
+#include "cache.h"
+#include "mblaze.h"
+
+
+typedef void (*mbgui_thread_cb_t)(mbgui_message_t *messages,
+                                  gpointer user_data);
+
+
+void mbgui_thread_messages(const gchar *directory,
+                           mbgui_message_arena_t *arena,
+                           mbgui_cache_writer_t *writer,
+                           GCancellable *cancellable, mbgui_thread_cb_t cb,
+                           gpointer user_data);
+void mbgui_thread_update(const gchar *directory, GArray *cached,
+                         GPtrArray *added, mbgui_message_arena_t *arena,
+                         mbgui_cache_writer_t *writer,
+                         GCancellable *cancellable, mbgui_thread_cb_t cb,
+                         gpointer user_data);
+mbgui_message_t *mbgui_thread_scan(gchar **paths, mbgui_message_arena_t *arena,
+                                   GCancellable *cancellable);
+
+#endif
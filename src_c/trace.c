@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "trace.h"
+
+
+static FILE *file = NULL;
+static GMutex mutex;
+static gboolean first = TRUE;
+static guint64 last_id = 0;
+static gint last_thread = 0;
+static GPrivate thread_key;
+
+
+static gint get_thread(void) {
+    gint thread = GPOINTER_TO_INT(g_private_get(&thread_key));
+    if (!thread) {
+        thread = g_atomic_int_add(&last_thread, 1) + 1;
+        g_private_set(&thread_key, GINT_TO_POINTER(thread));
+    }
+    return thread;
+}
+
+
+static void append_escaped(GString *str, const gchar *value) {
+    for (const gchar *i = value; *i; ++i) {
+        if (*i == '"' || *i == '\\')
+            g_string_append_printf(str, "\\%c", *i);
+        else if ((guchar)*i < 0x20)
+            g_string_append_printf(str, "\\u%04x", (guchar)*i);
+        else
+            g_string_append_c(str, *i);
+    }
+}
+
+
+// duration is included only for complete (X) events
+static void append_event(GString *str, const gchar *name, const gchar *phase,
+                         guint64 id, const gchar *detail, gint64 ts,
+                         gint64 duration) {
+    g_string_append_printf(str,
+                           "{\"name\":\"%s\",\"cat\":\"mbgui\",\"ph\":\"%s\","
+                           "\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,"
+                           "\"tid\":%d,\"id\":%" G_GUINT64_FORMAT
+                           ",\"args\":{\"id\":%" G_GUINT64_FORMAT,
+                           name, phase, ts, getpid(), get_thread(), id, id);
+
+    if (detail) {
+        g_string_append(str, ",\"detail\":\"");
+        append_escaped(str, detail);
+        g_string_append_c(str, '"');
+    }
+    g_string_append_c(str, '}');
+
+    if (duration >= 0)
+        g_string_append_printf(str, ",\"dur\":%" G_GINT64_FORMAT, duration);
+    g_string_append_c(str, '}');
+}
+
+
+static void write_events(GString *str) {
+    g_mutex_lock(&mutex);
+    if (file) {
+        fputs(first ? "[\n" : ",\n", file);
+        fputs(str->str, file);
+        first = FALSE;
+    }
+    g_mutex_unlock(&mutex);
+}
+
+
+void mbgui_trace_init(const gchar *path) {
+    file = fopen(path, "w");
+    if (!file)
+        g_printerr("can not open trace file %s\n", path);
+}
+
+
+void mbgui_trace_close(void) {
+    g_mutex_lock(&mutex);
+    if (file) {
+        fputs(first ? "[]\n" : "\n]\n", file);
+        fclose(file);
+        file = NULL;
+    }
+    g_mutex_unlock(&mutex);
+}
+
+
+guint64 mbgui_trace_next_id(void) {
+    if (!file)
+        return 0;
+
+    g_mutex_lock(&mutex);
+    guint64 id = ++last_id;
+    g_mutex_unlock(&mutex);
+    return id;
+}
+
+
+gint64 mbgui_trace_begin(void) { return (file ? g_get_monotonic_time() : 0); }
+
+
+// complete event - spans ended on the same thread have to be nested
+void mbgui_trace_end(const gchar *name, guint64 id, const gchar *detail,
+                     gint64 begin) {
+    if (!begin)
+        return;
+
+    gint64 end = g_get_monotonic_time();
+    GString *str = g_string_new(NULL);
+    append_event(str, name, "X", id, detail, begin, end - begin);
+
+    write_events(str);
+    g_string_free(str, TRUE);
+}
+
+
+// async begin/end pair - spans can overlap (requests, subprocesses)
+void mbgui_trace_end_async(const gchar *name, guint64 id, const gchar *detail,
+                           gint64 begin) {
+    if (!begin)
+        return;
+
+    gint64 end = g_get_monotonic_time();
+    GString *str = g_string_new(NULL);
+    append_event(str, name, "b", id, detail, begin, -1);
+    g_string_append(str, ",\n");
+    append_event(str, name, "e", id, NULL, end, -1);
+
+    write_events(str);
+    g_string_free(str, TRUE);
+}
@@ -0,0 +1,19 @@
+#ifndef MBGUI_TRACE_H
+#define MBGUI_TRACE_H
+
+#include <glib.h>
+
+
+// spans are recorded only after successful mbgui_trace_init - begin returns 0
+// otherwise and end functions ignore spans with 0 begin
+
+void mbgui_trace_init(const gchar *path);
+void mbgui_trace_close(void);
+guint64 mbgui_trace_next_id(void);
+gint64 mbgui_trace_begin(void);
+void mbgui_trace_end(const gchar *name, guint64 id, const gchar *detail,
+                     gint64 begin);
+void mbgui_trace_end_async(const gchar *name, guint64 id, const gchar *detail,
+                           gint64 begin);
+
+#endif